@@ -0,0 +1,85 @@
+// Lexer throughput: mmap'd file input vs. reading the stream into a heap buffer.
+//
+//   bench_lexer [file.tr] [iterations]
+//
+// Without a file a few MB of generated script is written to bench_lexer.tr.
+#include "tr_lexer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* generate(const char* path, int functions) {
+  FILE* fp = fopen(path, "w");
+  if (!fp)
+    return NULL;
+  for (int i = 0; i < functions; i++) {
+    fprintf(fp,
+            "// generated helper %d\n"
+            "fn helper_%d(a, b) {\n"
+            "\tvar total = a * %d + b;   // scale\n"
+            "\tvar name = \"helper number %d\";\n"
+            "\twhile (total) {\n"
+            "\t\ttotal = total - 1;\n"
+            "\t}\n"
+            "\treturn total + %d.25;\n"
+            "}\n\n",
+            i, i, i, i, i);
+  }
+  fclose(fp);
+  return path;
+}
+
+static long drain(struct tr_lexer* lex) {
+  long count = 0;
+  for (;;) {
+    struct tr_token tok = tr_lexer_next_token(lex);
+    count++;
+    if (tok.type == TOKEN_EOF)
+      return count;
+  }
+}
+
+static void report(const char* name, long tokens, double secs, int iterations) {
+  printf("%-10s %10ld tokens  %8.3f s  %12.0f tokens/s\n", name, tokens, secs,
+         (double)tokens * iterations / secs);
+}
+
+int main(int argc, char** argv) {
+  const char* path = argc > 1 ? argv[1] : generate("bench_lexer.tr", 30000);
+  int iterations   = argc > 2 ? atoi(argv[2]) : 3;
+  if (path == NULL || iterations <= 0) {
+    fprintf(stderr, "usage: %s [file.tr] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  struct tr_lexer lex;
+  long tokens  = 0;
+  double start = now();
+  for (int i = 0; i < iterations; i++) {
+    if (tr_lexer_file_init(&lex, path) < 0) {
+      fprintf(stderr, "Failed to open %s\n", path);
+      return 1;
+    }
+    tokens = drain(&lex);
+    tr_lexer_free(&lex);
+  }
+  report("mapped", tokens, now() - start, iterations);
+
+  start = now();
+  for (int i = 0; i < iterations; i++) {
+    FILE* fp = fopen(path, "rb");
+    tr_lexer_stream_init(&lex, fp);
+    tokens = drain(&lex);
+    tr_lexer_free(&lex);
+    fclose(fp);
+  }
+  report("read", tokens, now() - start, iterations);
+  return 0;
+}
@@ -1,38 +1,336 @@
 #include "memory.h"
 
-#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(TR_MEM_HUGEPAGES) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define MEM_SLAB_CLASSES (MEM_SLAB_MAX / 16)
+
+struct slab_block {
+  struct slab_block* next;
+};
+
+// First bytes of every chunk; keeps them reachable until mem_ctx_free.
+struct slab_chunk {
+  struct slab_chunk* next;
+  bool mapped;
+};
+
+_Static_assert(sizeof(struct slab_chunk) <= 16, "chunk header must fit before the blocks");
+
+static int slab_class(size_t sz) { return (int)((sz + 15) / 16) - 1; }
+
+static char* slab_new_chunk(struct mem_slabs* s) {
+  char* c     = NULL;
+  bool mapped = false;
+#if defined(TR_MEM_HUGEPAGES) && defined(__linux__)
+  // Over-map so the chunk can be 2 MB aligned, which transparent huge pages
+  // need, then trim the slack.
+  size_t len = 2 * MEM_SLAB_CHUNK;
+  char* m    = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m != MAP_FAILED) {
+    c           = (char*)(((uintptr_t)m + MEM_SLAB_CHUNK - 1) & ~(uintptr_t)(MEM_SLAB_CHUNK - 1));
+    size_t head = (size_t)(c - m);
+    if (head > 0)
+      munmap(m, head);
+    munmap(c + MEM_SLAB_CHUNK, len - head - MEM_SLAB_CHUNK);
+    madvise(c, MEM_SLAB_CHUNK, MADV_HUGEPAGE);
+    mapped = true;
+  }
+#endif
+  if (c == NULL)
+    c = aligned_alloc(16, MEM_SLAB_CHUNK);
+  if (c == NULL)
+    return NULL;
+  struct slab_chunk* chunk = (struct slab_chunk*)c;
+  chunk->next              = s->chunks;
+  chunk->mapped            = mapped;
+  s->chunks                = chunk;
+  return c + 16;
+}
+
+static void* slab_alloc(struct mem_slabs* s, size_t sz) {
+  int cls                = slab_class(sz);
+  struct slab_block* blk = s->free[cls];
+  if (blk != NULL) {
+    s->free[cls] = blk->next;
+    return blk;
+  }
+  size_t size = (size_t)(cls + 1) * 16;
+  if (s->bump == NULL || (size_t)(s->end - s->bump) < size) {
+    // Whatever is left of the old chunk is too small for this class; hand
+    // it to the smaller classes rather than dropping it.
+    while (s->bump != NULL && s->end - s->bump >= 16) {
+      int left = (int)((s->end - s->bump) / 16) - 1;
+      if (left >= MEM_SLAB_CLASSES)
+        left = MEM_SLAB_CLASSES - 1;
+      struct slab_block* rest = (struct slab_block*)s->bump;
+      rest->next              = s->free[left];
+      s->free[left]           = rest;
+      s->bump += (size_t)(left + 1) * 16;
+    }
+    char* c = slab_new_chunk(s);
+    if (c == NULL)
+      return NULL;
+    s->bump = c;
+    s->end  = s->bump + MEM_SLAB_CHUNK - 16;
+  }
+  void* ret = s->bump;
+  s->bump += size;
+  return ret;
+}
+
+static void slab_release(struct mem_slabs* s, void* ptr, size_t sz) {
+  int cls                         = slab_class(sz);
+  ((struct slab_block*)ptr)->next = s->free[cls];
+  s->free[cls]                    = ptr;
+}
+
+#ifdef TR_MEM_NO_SLAB
+#define is_small(s, sz) false
+#else
+#define is_small(s, sz) ((s) != NULL && (sz) <= MEM_SLAB_MAX)
+#endif
+
+static void* slab_realloc(void* ud, void* ptr, size_t old, size_t new) {
+  struct mem_slabs* s = ud;
+  bool small_old      = ptr != NULL && is_small(s, old);
+  bool small_new      = new != 0 && is_small(s, new);
+  if (!small_old && !small_new) {
+    if (new == 0) {
+      free(ptr);
+      return NULL;
+    }
+    return realloc(ptr, new);
+  }
+  if (small_old && small_new && slab_class(old) == slab_class(new))
+    return ptr;
+
+  void* np = NULL;
+  if (new != 0) {
+    np = small_new ? slab_alloc(s, new) : malloc(new);
+    if (np == NULL)
+      return NULL;
+  }
+  if (ptr != NULL) {
+    if (np != NULL)
+      memcpy(np, ptr, old < new ? old : new);
+    if (small_old)
+      slab_release(s, ptr, old);
+    else
+      free(ptr);
+  }
+  return np;
+}
+
+static void* slab_alloc_fn(void* ud, size_t sz) { return slab_realloc(ud, NULL, 0, sz); }
+
+static void slab_free_fn(void* ud, void* ptr, size_t sz) { slab_realloc(ud, ptr, sz, 0); }
+
+const struct mem_allocator mem_default_allocator = {slab_alloc_fn, slab_realloc, slab_free_fn,
+                                                    NULL};
+
+void mem_ctx_init(struct mem_ctx* m, const struct mem_allocator* a) {
+  memset(&m->slabs, 0, sizeof(m->slabs));
+  m->allocator = a != NULL ? *a : mem_default_allocator;
+  if (a == NULL)
+    m->allocator.ud = &m->slabs;
+  m->live         = 0;
+  m->peak         = 0;
+  m->limit        = 0;
+  m->on_error     = NULL;
+  m->gc_hook      = NULL;
+  m->gc_ctx       = NULL;
+  m->gc_allocated = 0;
+  m->gc_threshold = SIZE_MAX;
+}
+
+void mem_ctx_free(struct mem_ctx* m) {
+  struct slab_chunk* c = m->slabs.chunks;
+  while (c != NULL) {
+    struct slab_chunk* next = c->next;
+#if defined(TR_MEM_HUGEPAGES) && defined(__linux__)
+    if (c->mapped)
+      munmap(c, MEM_SLAB_CHUNK);
+    else
+#endif
+      free(c);
+    c = next;
+  }
+  memset(&m->slabs, 0, sizeof(m->slabs));
+}
+
+// Both per thread; the default context is libc only, so threads share no
+// slabs through it either. current starts out NULL, meaning process_ctx: the
+// address of a thread-local is not a constant initializer.
+static _Thread_local struct mem_ctx process_ctx = {
+    .allocator = {slab_alloc_fn, slab_realloc, slab_free_fn, NULL}, .gc_threshold = SIZE_MAX};
+static _Thread_local struct mem_ctx* current;
+
+static struct mem_ctx* current_ctx(void) { return current != NULL ? current : &process_ctx; }
+
+struct mem_ctx* mem_use(struct mem_ctx* m) {
+  struct mem_ctx* prev = current_ctx();
+  current              = m;
+  return prev;
+}
+
+void mem_gc_set_hook(struct mem_ctx* m, mem_gc_fn fn, void* ctx) {
+  m->gc_hook = fn;
+  m->gc_ctx  = ctx;
+}
+
+void mem_gc_reset(struct mem_ctx* m, size_t threshold) {
+  m->gc_allocated = 0;
+  m->gc_threshold = threshold;
+}
+
+static void* mem_fail(struct mem_ctx* m) {
+  if (m->on_error != NULL)
+    longjmp(*m->on_error, 1);
+  return NULL;
+}
+
 void* mem_realloc(void* ptr, size_t old, size_t new) {
+  struct mem_ctx* m = current_ctx();
   if (ptr == NULL && new == 0)
     return NULL;
-  if (new == 0) {
-    free(ptr);
-    return NULL;
+  if (ptr == NULL)
+    old = 0;
+  if (new > old) {
+    size_t grow = new - old;
+    bool over   = m->limit != 0 && m->live + grow > m->limit;
+    m->gc_allocated += grow;
+    if (m->gc_hook != NULL && (over || m->gc_allocated >= m->gc_threshold))
+      m->gc_hook(m->gc_ctx);
+    if (m->limit != 0 && m->live + grow > m->limit)
+      return mem_fail(m);
   }
-  void* np = realloc(ptr, new);
-  if (!np) {
-    fprintf(stderr, "Out of memory!");
-    exit(EXIT_FAILURE);
+  struct mem_allocator* a = &m->allocator;
+  void* np                = NULL;
+  if (new == 0)
+    a->free(a->ud, ptr, old);
+  else if (ptr == NULL)
+    np = a->alloc(a->ud, new);
+  else
+    np = a->realloc(a->ud, ptr, old, new);
+  if (new != 0 && np == NULL)
+    return mem_fail(m);
+  m->live = m->live - old + new;
+  if (m->live > m->peak)
+    m->peak = m->live;
+  return np;
+}
+
+bool mem_protect(struct mem_ctx* m, void (*fn)(void* arg), void* arg) {
+  // Both are read after a longjmp back here.
+  struct mem_ctx* volatile prev = mem_use(m);
+  jmp_buf* outer                = m->on_error;
+  jmp_buf on_error;
+  volatile bool ok = false;
+  if (setjmp(on_error) == 0) {
+    m->on_error = &on_error;
+    fn(arg);
+    ok = true;
   }
+  m->on_error = outer;
+  mem_use(prev);
+  return ok;
+}
+
+void* mem_try_realloc(void* ptr, size_t old, size_t new) {
+  struct mem_ctx* m = current_ctx();
+  if (ptr == NULL)
+    old = 0;
+  if (new > old && m->limit != 0 && m->live + (new - old) > m->limit)
+    return NULL;
+  struct mem_allocator* a = &m->allocator;
+  void* np                = NULL;
+  if (new == 0)
+    a->free(a->ud, ptr, old);
+  else if (ptr == NULL)
+    np = a->alloc(a->ud, new);
+  else
+    np = a->realloc(a->ud, ptr, old, new);
+  if (new != 0 && np == NULL)
+    return NULL;
+  m->live = m->live - old + new;
+  if (m->live > m->peak)
+    m->peak = m->live;
   return np;
 }
 
 char* mem_strdup(const char* str) {
   size_t len = strlen(str);
   char* new = mem_realloc(NULL, 0, (len + 1) * sizeof(char));
+  if (new == NULL)
+    return NULL;
   memcpy(new, str, len);
   new[len] = '\0';
   return new;
 }
 
 char* mem_strndup(const char* str, int max) {
-  size_t len = strlen(str);
-  if(len > max)
-    len = max;
+  // str need not be terminated (token views), so never read past max.
+  const char* nul = memchr(str, '\0', max);
+  size_t len      = nul != NULL ? (size_t)(nul - str) : (size_t)max;
   char* new = mem_realloc(NULL, 0, (len + 1) * sizeof(char));
+  if (new == NULL)
+    return NULL;
   memcpy(new, str, len);
   new[len] = '\0';
   return new;
-}
\ No newline at end of file
+}
+
+#define MEM_ARENA_BLOCK 4096
+
+struct mem_arena_block {
+  struct mem_arena_block* next;
+  size_t used;
+  size_t size;
+  _Alignas(16) char data[];
+};
+
+void mem_arena_init(struct mem_arena* a) { a->head = NULL; }
+
+void mem_arena_free(struct mem_arena* a) {
+  struct mem_arena_block* b = a->head;
+  while (b != NULL) {
+    struct mem_arena_block* next = b->next;
+    mem_realloc(b, sizeof(*b) + b->size, 0);
+    b = next;
+  }
+  a->head = NULL;
+}
+
+void* mem_arena_alloc(struct mem_arena* a, size_t sz) {
+  sz                        = (sz + 15) & ~(size_t)15;
+  struct mem_arena_block* b = a->head;
+  if (b == NULL || b->size - b->used < sz) {
+    size_t size = sz > MEM_ARENA_BLOCK ? sz : MEM_ARENA_BLOCK;
+    b           = mem_alloc(sizeof(*b) + size);
+    if (b == NULL)
+      return NULL;
+    b->next = a->head;
+    b->used = 0;
+    b->size = size;
+    a->head = b;
+  }
+  void* ret = b->data + b->used;
+  b->used += sz;
+  return ret;
+}
+
+char* mem_arena_strndup(struct mem_arena* a, const char* str, size_t len) {
+  char* new = mem_arena_alloc(a, len + 1);
+  if (new == NULL)
+    return NULL;
+  memcpy(new, str, len);
+  new[len] = '\0';
+  return new;
+}
@@ -1,14 +1,111 @@
 #ifndef tr_memory_h
 #define tr_memory_h
 
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stddef.h>
 
-#define mem_free(ptr) mem_realloc(ptr, 0, 0)
+// Frees must pass the size the block was (last) allocated with.
+#define mem_free(ptr, size) mem_realloc(ptr, size, 0)
 #define mem_alloc(size) mem_realloc(NULL, 0, size)
 
 char *mem_strdup(const char *str);
 char *mem_strndup(const char *str, int len);
 
+// Blocks of up to MEM_SLAB_MAX bytes come from size-class free lists (16-byte
+// steps) carved out of MEM_SLAB_CHUNK chunks; larger ones go to libc. old_sz
+// must be the size ptr was allocated with: it is how a block finds its class
+// again. TR_MEM_NO_SLAB sends everything to libc (handy under ASan);
+// TR_MEM_HUGEPAGES asks for huge-page backed chunks.
+#define MEM_SLAB_MAX 256
+#ifdef TR_MEM_HUGEPAGES
+#define MEM_SLAB_CHUNK (2 * 1024 * 1024)
+#else
+#define MEM_SLAB_CHUNK (256 * 1024)
+#endif
+
+// One set of slabs. Each context has its own, so contexts used from
+// different threads share nothing, and its chunks go back with mem_ctx_free.
+struct mem_slabs {
+  void *free[MEM_SLAB_MAX / 16];
+  void *chunks;
+  char *bump;
+  char *end;
+};
+
+// Where memory comes from. Sizes passed to realloc and free are the ones the
+// block was allocated with. Returning NULL counts as running out of memory.
+struct mem_allocator {
+  void *(*alloc)(void *ud, size_t sz);
+  void *(*realloc)(void *ud, void *ptr, size_t old_sz, size_t sz);
+  void (*free)(void *ud, void *ptr, size_t sz);
+  void *ud;
+};
+
+// The slabs above, with libc for large blocks. ud is the struct mem_slabs to
+// use; with ud NULL every block goes to libc.
+extern const struct mem_allocator mem_default_allocator;
+
+typedef void (*mem_gc_fn)(void *ctx);
+
+// An allocation context: the allocator mem_realloc uses, what it has handed
+// out and what happens when it cannot hand out more. mem_realloc always works
+// on the current context (mem_use), which is per thread; initially it is the
+// thread's default context over libc with no limit.
+struct mem_ctx {
+  struct mem_allocator allocator;
+  size_t live;  // bytes currently allocated
+  size_t peak;
+  size_t limit; // live may not exceed this; 0 means no limit
+  // Where to longjmp when the limit is hit or the allocator fails. Without
+  // one mem_realloc returns NULL, which only code that checks for it may
+  // allow; everything else runs under mem_protect or a handler of its own.
+  jmp_buf *on_error;
+
+  // Collection trigger. Growth (sz - old_sz) is counted and once it reaches
+  // the threshold given to mem_gc_reset, or an allocation would pass the
+  // limit, gc_hook(gc_ctx) is called before the memory is handed out. The
+  // hook keeps being called on later allocations until it calls mem_gc_reset.
+  mem_gc_fn gc_hook;
+  void *gc_ctx;
+  size_t gc_allocated;
+  size_t gc_threshold;
+
+  struct mem_slabs slabs;
+};
+
+// a NULL means mem_default_allocator over m's own slabs, which m then must
+// not move.
+void mem_ctx_init(struct mem_ctx *m, const struct mem_allocator *a);
+// Gives m's slab chunks back. Nothing allocated from them may be used after.
+void mem_ctx_free(struct mem_ctx *m);
+// Makes m current and returns the context it replaces.
+struct mem_ctx *mem_use(struct mem_ctx *m);
+
+void mem_gc_set_hook(struct mem_ctx *m, mem_gc_fn fn, void *ctx);
+void mem_gc_reset(struct mem_ctx *m, size_t threshold);
+
 void *mem_realloc(void *old, size_t old_sz, size_t sz);
+// Runs fn(arg) with m current and its own on_error installed. Returns false
+// if an allocation failed, abandoning fn where it was; fn must leave what it
+// touches consistent at every allocation.
+bool mem_protect(struct mem_ctx *m, void (*fn)(void *arg), void *arg);
+// mem_realloc for callers that may run inside a collection: the growth counts
+// towards live and the limit but never calls gc_hook, and instead of failing
+// it returns NULL and leaves old as it was.
+void *mem_try_realloc(void *old, size_t old_sz, size_t sz);
+
+// Bump allocator for data that lives exactly as long as one owner (e.g. a
+// compilation). Individual allocations are never freed.
+struct mem_arena_block;
+
+struct mem_arena {
+  struct mem_arena_block *head;
+};
+
+void mem_arena_init(struct mem_arena *a);
+void mem_arena_free(struct mem_arena *a);
+void *mem_arena_alloc(struct mem_arena *a, size_t sz);
+char *mem_arena_strndup(struct mem_arena *a, const char *str, size_t len);
 
 #endif // tr_memory_h
\ No newline at end of file
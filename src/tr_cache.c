@@ -0,0 +1,621 @@
+#include "tr_cache.h"
+
+#include "memory.h"
+#include "tr_opcode.h"
+#include "tr_opt.h"
+#include "tr_table.h"
+#include "tr_value.h"
+#include "tr_vm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TR_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// File layout, in native byte order. Every record starts 8-byte aligned so
+// the loader can use constants, lines and code where they lie.
+//
+//   trc_header
+//   string_count x { uint32_t len; char bytes[len]; '\0' }
+//   global_count x uint32_t string index, one per global slot
+//   func_count   x { trc_func; trc_const[const_count]; int32_t lines[code_len];
+//                    uint8_t code[code_len] }
+//
+// Functions come before the functions whose constants refer to them; the
+// last one is the script.
+#define TRC_MAGIC "TRC\x1a"
+#define TRC_BYTE_ORDER 0x01020304u
+
+struct trc_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t op_count;
+  uint32_t flags;
+  uint32_t src_hash;
+  uint64_t src_mtime; // nanoseconds
+  uint64_t src_size;
+  uint32_t string_count;
+  uint32_t global_count;
+  uint32_t func_count;
+  uint32_t pad;
+};
+
+struct trc_func {
+  int32_t arity;
+  int32_t upvalue_count;
+  int32_t type;
+  int32_t name; // string index, -1 if none
+  int32_t code_len;
+  int32_t const_count;
+  int32_t max_locals;
+  int32_t max_stack;
+};
+
+struct trc_const {
+  uint32_t type; // VAL_*
+  uint32_t pad;
+  uint64_t bits; // strings and functions by index
+};
+
+// A loaded file; chunks point into it.
+struct tr_image {
+  struct tr_image* next;
+  uint8_t* base;
+  size_t len;
+  bool mapped;
+};
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Width of the slot operand of a global access, or 0 for other opcodes.
+static int global_operand(uint8_t op) {
+  switch (op) {
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+    return 2;
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+static bool src_stat(const char* path, uint64_t* mtime, uint64_t* size) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+#if defined(__APPLE__)
+  *mtime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000u + (uint64_t)st.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+  *mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+#else
+  *mtime = (uint64_t)st.st_mtime * 1000000000u;
+#endif
+  *size = (uint64_t)st.st_size;
+  return true;
+}
+
+static uint32_t src_hash(const char* text, size_t len) {
+  return tr_string__hash(text, (uint32_t)len, 0);
+}
+
+static bool src_hash_file(const char* path, size_t len, uint32_t* hash) {
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL)
+    return false;
+  char* text = mem_alloc(len + 1);
+  bool ok    = fread(text, 1, len, fp) == len;
+  fclose(fp);
+  if (ok)
+    *hash = src_hash(text, len);
+  mem_free(text, len + 1);
+  return ok;
+}
+
+bool tr_cache_path(const char* src_path, char* buf, size_t len) {
+  size_t n   = strlen(src_path);
+  bool is_tr = n >= 3 && strcmp(src_path + n - 3, ".tr") == 0;
+  int wrote  = snprintf(buf, len, is_tr ? "%sc" : "%s.trc", src_path);
+  return wrote >= 0 && (size_t)wrote < len;
+}
+
+// Writing
+
+struct buf {
+  uint8_t* data;
+  size_t len;
+  size_t cap;
+};
+
+static size_t buf_put(struct buf* b, const void* p, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap == 0 ? 4096 : b->cap;
+    while (cap < b->len + n)
+      cap *= 2;
+    b->data = mem_realloc(b->data, b->cap, cap);
+    b->cap  = cap;
+  }
+  size_t at = b->len;
+  if (p != NULL)
+    memcpy(b->data + at, p, n);
+  else
+    memset(b->data + at, 0, n);
+  b->len += n;
+  return at;
+}
+
+static void buf_align(struct buf* b) { buf_put(b, NULL, align8(b->len) - b->len); }
+
+struct writer {
+  struct buf out;
+  struct tr_func** funcs;
+  int func_count;
+  int func_cap;
+  struct tr_string** strings;
+  int string_count;
+  int string_cap;
+  struct tr_table string_ids; // string -> index into strings
+};
+
+static int find_func(struct writer* w, struct tr_func* f) {
+  for (int i = 0; i < w->func_count; i++) {
+    if (w->funcs[i] == f)
+      return i;
+  }
+  return -1;
+}
+
+// Children first, so the loader has them when it reaches the parent.
+static bool collect_func(struct writer* w, struct tr_func* f) {
+  struct tr_constants* k = &f->chunk.constants;
+  for (int i = 0; i < k->count; i++) {
+    struct tr_value v = k->values[i];
+    if (IS_CFUNC(v) || IS_PTR(v))
+      return false;
+    if (!IS_OBJ(v))
+      continue;
+    if (AS_OBJ(v)->type != OBJ_FUNC)
+      return false;
+    if (find_func(w, (struct tr_func*)AS_OBJ(v)) < 0 &&
+        !collect_func(w, (struct tr_func*)AS_OBJ(v)))
+      return false;
+  }
+  if (w->func_count == w->func_cap) {
+    int cap  = w->func_cap == 0 ? 8 : w->func_cap * 2;
+    w->funcs = mem_realloc(w->funcs, sizeof(*w->funcs) * w->func_cap, sizeof(*w->funcs) * cap);
+    w->func_cap = cap;
+  }
+  w->funcs[w->func_count++] = f;
+  return true;
+}
+
+static int string_id(struct writer* w, struct tr_string* s) {
+  struct tr_value id;
+  if (tr_table_get(&w->string_ids, s, &id))
+    return (int)AS_LNG(id);
+  if (w->string_count == w->string_cap) {
+    int cap    = w->string_cap == 0 ? 16 : w->string_cap * 2;
+    w->strings = mem_realloc(w->strings, sizeof(*w->strings) * w->string_cap,
+                             sizeof(*w->strings) * cap);
+    w->string_cap = cap;
+  }
+  w->strings[w->string_count] = s;
+  tr_table_insert(&w->string_ids, s, INT_VALUE(w->string_count));
+  return w->string_count++;
+}
+
+static void put_func(struct writer* w, struct buf* out, struct tr_func* f) {
+  struct tr_chunk* c = &f->chunk;
+  struct trc_func rf = {f->arity, f->upvalue_count, f->type,
+                        f->name != NULL ? string_id(w, f->name) : -1, c->count,
+                        c->constants.count, f->max_locals, f->max_stack};
+  buf_put(out, &rf, sizeof(rf));
+  for (int i = 0; i < c->constants.count; i++) {
+    struct tr_value v  = c->constants.values[i];
+    struct trc_const k = {(uint32_t)tr_value_type(v), 0, 0};
+    switch (k.type) {
+    case VAL_BOOL:
+      k.bits = AS_BOOL(v);
+      break;
+    case VAL_LNG:
+      k.bits = (uint64_t)(int64_t)AS_LNG(v);
+      break;
+    case VAL_DBL: {
+      double d = AS_DBL(v);
+      memcpy(&k.bits, &d, sizeof(d));
+      break;
+    }
+    case VAL_STR:
+      k.bits = (uint64_t)string_id(w, AS_STR(v));
+      break;
+    case VAL_OBJ:
+      k.bits = (uint64_t)find_func(w, (struct tr_func*)AS_OBJ(v));
+      break;
+    default:
+      break;
+    }
+    buf_put(out, &k, sizeof(k));
+  }
+  for (int i = 0; i < c->count; i++) {
+    int32_t line = c->lines[i];
+    buf_put(out, &line, sizeof(line));
+  }
+  buf_put(out, c->instructions, (size_t)c->count);
+  buf_align(out);
+}
+
+static void put_strings(struct writer* w) {
+  for (int i = 0; i < w->string_count; i++) {
+    uint32_t len = (uint32_t)w->strings[i]->len;
+    buf_put(&w->out, &len, sizeof(len));
+    buf_put(&w->out, w->strings[i]->str, len + 1);
+    buf_align(&w->out);
+  }
+}
+
+static bool write_file(const char* path, const struct buf* b) {
+  // Write aside and rename, so a concurrent reader never sees half a file.
+  char tmp[4096];
+  int n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if (n < 0 || (size_t)n >= sizeof(tmp))
+    return false;
+  FILE* fp = fopen(tmp, "wb");
+  if (fp == NULL)
+    return false;
+  bool ok = fwrite(b->data, 1, b->len, fp) == b->len;
+  ok &= fclose(fp) == 0;
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (!ok)
+    remove(tmp);
+  return ok;
+}
+
+struct write_job {
+  struct tr_vm* vm;
+  struct tr_func* script;
+  const char* path;
+  const char* src_path;
+  const char* src_text;
+  size_t src_len;
+  uint32_t flags;
+  struct writer w;
+  struct buf funcs;
+  bool ok;
+};
+
+static void write_image(void* arg) {
+  struct write_job* j  = arg;
+  struct tr_vm* vm     = j->vm;
+  struct writer* w     = &j->w;
+  const char* src_path = j->src_path;
+  j->ok                = collect_func(w, j->script);
+  if (j->ok) {
+    struct trc_header h = {.version      = TR_CACHE_VERSION,
+                           .byte_order   = TRC_BYTE_ORDER,
+                           .op_count     = OP_COUNT,
+                           .flags        = j->flags,
+                           .src_hash     = src_hash(j->src_text, j->src_len),
+                           .src_size     = j->src_len,
+                           .global_count = (uint32_t)vm->global_count,
+                           .func_count   = (uint32_t)w->func_count};
+    memcpy(h.magic, TRC_MAGIC, sizeof(h.magic));
+    uint64_t size;
+    if (src_path != NULL && !src_stat(src_path, &h.src_mtime, &size))
+      h.src_mtime = 0;
+
+    // Strings are numbered while the functions are written, but have to come
+    // first in the file; write the functions into a buffer of their own.
+    for (int i = 0; i < w->func_count; i++)
+      put_func(w, &j->funcs, w->funcs[i]);
+    for (int i = 0; i < vm->global_count; i++)
+      string_id(w, vm->global_names[i]);
+
+    h.string_count = (uint32_t)w->string_count;
+    buf_put(&w->out, &h, sizeof(h));
+    put_strings(w);
+    for (int i = 0; i < vm->global_count; i++) {
+      uint32_t id = (uint32_t)string_id(w, vm->global_names[i]);
+      buf_put(&w->out, &id, sizeof(id));
+    }
+    buf_align(&w->out);
+    buf_put(&w->out, j->funcs.data, j->funcs.len);
+    j->ok = write_file(j->path, &w->out);
+  }
+}
+
+bool tr_cache_write(struct tr_vm* vm, struct tr_func* script, const char* path,
+                    const char* src_path, const char* src_text, size_t src_len, uint32_t flags) {
+  struct write_job j = {.vm       = vm,
+                        .script   = script,
+                        .path     = path,
+                        .src_path = src_path,
+                        .src_text = src_text,
+                        .src_len  = src_len,
+                        .flags    = flags};
+  tr_table_init(&j.w.string_ids);
+  // Buffers stay consistent at every allocation, so whatever was built is
+  // freed here even if writing ran out of memory.
+  bool ok              = mem_protect(&vm->mem, write_image, &j) && j.ok;
+  struct mem_ctx* prev = mem_use(&vm->mem);
+  mem_free(j.funcs.data, j.funcs.cap);
+  mem_free(j.w.out.data, j.w.out.cap);
+  mem_free(j.w.funcs, sizeof(*j.w.funcs) * j.w.func_cap);
+  mem_free(j.w.strings, sizeof(*j.w.strings) * j.w.string_cap);
+  tr_table_free(&j.w.string_ids);
+  mem_use(prev);
+  return ok;
+}
+
+// Loading
+
+static uint8_t* read_image(const char* path, size_t* len, bool* mapped) {
+#ifdef TR_HAVE_MMAP
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  uint8_t* base = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    // Private and writable: renumbering global slots copies only the pages
+    // it touches.
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      base    = map;
+      *len    = (size_t)st.st_size;
+      *mapped = true;
+    }
+  }
+  close(fd);
+  return base;
+#else
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+  uint8_t* base = NULL;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long n = ftell(fp);
+    if (n > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+      base = mem_alloc((size_t)n);
+      if (fread(base, 1, (size_t)n, fp) != (size_t)n) {
+        mem_free(base, (size_t)n);
+        base = NULL;
+      }
+      *len    = (size_t)n;
+      *mapped = false;
+    }
+  }
+  fclose(fp);
+  return base;
+#endif
+}
+
+static void release_image(uint8_t* base, size_t len, bool mapped) {
+#ifdef TR_HAVE_MMAP
+  if (mapped) {
+    munmap(base, len);
+    return;
+  }
+#endif
+  (void)mapped;
+  mem_free(base, len);
+}
+
+static bool header_ok(const struct trc_header* h, size_t len, const char* src_path,
+                      uint32_t flags) {
+  if (len < sizeof(*h) || memcmp(h->magic, TRC_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != TR_CACHE_VERSION || h->byte_order != TRC_BYTE_ORDER ||
+      h->op_count != OP_COUNT)
+    return false;
+  // Each record takes at least this many bytes; keeps the scratch arrays sane.
+  if (h->string_count > len / 8 || h->global_count > len / 4 || h->func_count == 0 ||
+      h->func_count > len / sizeof(struct trc_func))
+    return false;
+  if (src_path == NULL)
+    return true;
+  uint64_t mtime, size;
+  if (h->flags != flags || !src_stat(src_path, &mtime, &size) || size != h->src_size)
+    return false;
+  if (mtime == h->src_mtime)
+    return true;
+  // Touched since, but possibly unchanged.
+  uint32_t hash;
+  return src_hash_file(src_path, size, &hash) && hash == h->src_hash;
+}
+
+// Builds the functions of a checked header. The scratch arrays come from the
+// caller so nothing here needs freeing if an allocation longjmps out.
+static struct tr_func* decode_image(struct tr_vm* vm, uint8_t* base, size_t len,
+                                    struct tr_string** strings, struct tr_func** funcs,
+                                    int* slots) {
+  const struct trc_header* h = (const struct trc_header*)base;
+  size_t at                  = sizeof(*h);
+
+  for (uint32_t i = 0; i < h->string_count; i++) {
+    uint32_t n;
+    if (len - at < sizeof(n))
+      return NULL;
+    memcpy(&n, base + at, sizeof(n));
+    at += sizeof(n);
+    if (n >= len - at || n > INT32_MAX || base[at + n] != '\0')
+      return NULL;
+    strings[i] = tr_vm_intern(vm, (const char*)base + at, (int)n);
+    at         = align8(at + n + 1);
+    if (at > len)
+      return NULL;
+  }
+
+  if ((len - at) / sizeof(uint32_t) < h->global_count)
+    return NULL;
+  for (uint32_t i = 0; i < h->global_count; i++) {
+    uint32_t id;
+    memcpy(&id, base + at, sizeof(id));
+    at += sizeof(id);
+    if (id >= h->string_count || (slots[i] = tr_vm_global_slot(vm, strings[id])) < 0)
+      return NULL;
+  }
+  at = align8(at);
+
+  for (uint32_t i = 0; i < h->func_count; i++) {
+    if (at > len || len - at < sizeof(struct trc_func))
+      return NULL;
+    struct trc_func rf;
+    memcpy(&rf, base + at, sizeof(rf));
+    at += sizeof(rf);
+    if (rf.code_len < 0 || rf.const_count < 0 || rf.max_locals < 0 || rf.max_stack < 0 ||
+        rf.name < -1 || rf.name >= (int32_t)h->string_count)
+      return NULL;
+    size_t body = sizeof(struct trc_const) * (size_t)rf.const_count +
+                  (sizeof(int32_t) + 1) * (size_t)rf.code_len;
+    if (len - at < body)
+      return NULL;
+
+    struct tr_func* f  = tr_func_new(vm);
+    f->arity           = rf.arity;
+    f->upvalue_count   = rf.upvalue_count;
+    f->type            = rf.type;
+    f->max_locals      = rf.max_locals;
+    f->max_stack       = rf.max_stack;
+    f->name            = rf.name >= 0 ? strings[rf.name] : NULL;
+    for (int32_t k = 0; k < rf.const_count; k++) {
+      struct trc_const rk;
+      memcpy(&rk, base + at, sizeof(rk));
+      at += sizeof(rk);
+      struct tr_value v;
+      switch (rk.type) {
+      case VAL_NIL:
+        v = NIL_VAL;
+        break;
+      case VAL_BOOL:
+        v = BOOL_VALUE(rk.bits != 0);
+        break;
+      case VAL_LNG:
+        v = INT_VALUE((long)(int64_t)rk.bits);
+        break;
+      case VAL_DBL: {
+        double d;
+        memcpy(&d, &rk.bits, sizeof(d));
+        v = DOUBLE_VALUE(d);
+        break;
+      }
+      case VAL_STR:
+        if (rk.bits >= h->string_count)
+          return NULL;
+        v = STR_VALUE(strings[rk.bits]);
+        break;
+      case VAL_OBJ:
+        if (rk.bits >= i)
+          return NULL;
+        funcs[rk.bits]->enclosing = f;
+        v                         = OBJ_VALUE(funcs[rk.bits]);
+        break;
+      default:
+        return NULL;
+      }
+      tr_constants_add(&f->chunk.constants, v);
+    }
+
+    // capacity 0: the chunk does not own these.
+    f->chunk.lines        = (int*)(base + at);
+    f->chunk.instructions = base + at + sizeof(int32_t) * (size_t)rf.code_len;
+    f->chunk.count        = rf.code_len;
+    at                    = align8(at + (sizeof(int32_t) + 1) * (size_t)rf.code_len);
+    funcs[i]              = f;
+
+    uint8_t* code = f->chunk.instructions;
+    for (int32_t off = 0; off < rf.code_len; off += tr_instruction_size(&code[off])) {
+      if (code[off] >= OP_COUNT || off + tr_opcode_size(code[off]) > rf.code_len ||
+          off + tr_instruction_size(&code[off]) > rf.code_len)
+        return NULL;
+      int width = global_operand(code[off]);
+      if (width == 0)
+        continue;
+      uint32_t slot = 0;
+      for (int b = 1; b <= width; b++)
+        slot = slot << 8 | code[off + b];
+      if (slot >= h->global_count)
+        return NULL;
+      uint32_t to = (uint32_t)slots[slot];
+      if (to == slot)
+        continue;
+      if (to >> (8 * width) != 0)
+        return NULL; // renumbered past what the operand holds; recompile
+      for (int b = width; b >= 1; b--, to >>= 8)
+        code[off + b] = to & 0xff;
+    }
+  }
+  return at == align8(len) ? funcs[h->func_count - 1] : NULL;
+}
+
+struct load_job {
+  struct tr_vm* vm;
+  const char* path;
+  const char* src_path;
+  uint32_t flags;
+  uint8_t* base; // until vm->images owns it
+  size_t len;
+  bool mapped;
+  struct tr_string** scratch;
+  size_t scratch_len;
+  struct tr_func* script;
+};
+
+static void load_image(void* arg) {
+  struct load_job* j = arg;
+  struct tr_vm* vm   = j->vm;
+  j->base            = read_image(j->path, &j->len, &j->mapped);
+  if (j->base == NULL)
+    return;
+  const struct trc_header* h = (const struct trc_header*)j->base;
+  if (!header_ok(h, j->len, j->src_path, j->flags))
+    return;
+  j->scratch_len = sizeof(struct tr_string*) * h->string_count +
+                   sizeof(struct tr_func*) * h->func_count + sizeof(int) * h->global_count;
+  j->scratch             = mem_alloc(j->scratch_len);
+  struct tr_func** funcs = (struct tr_func**)(j->scratch + h->string_count);
+  int* slots             = (int*)(funcs + h->func_count);
+  struct tr_func* script = decode_image(vm, j->base, j->len, j->scratch, funcs, slots);
+  if (script == NULL)
+    return;
+  struct tr_image* img = mem_alloc(sizeof(*img));
+  *img                 = (struct tr_image){vm->images, j->base, j->len, j->mapped};
+  vm->images           = img;
+  j->base              = NULL;
+  j->script            = script;
+}
+
+struct tr_func* tr_cache_load(struct tr_vm* vm, const char* path, const char* src_path,
+                              uint32_t flags) {
+  struct load_job j = {.vm = vm, .path = path, .src_path = src_path, .flags = flags};
+  mem_protect(&vm->mem, load_image, &j);
+  struct mem_ctx* prev = mem_use(&vm->mem);
+  mem_free(j.scratch, j.scratch_len);
+  if (j.base != NULL) {
+    // Functions already built stay with the collector but are unreachable;
+    // their chunks do not own the memory released here.
+    release_image(j.base, j.len, j.mapped);
+  }
+  mem_use(prev);
+  return j.script;
+}
+
+void tr_cache_release(struct tr_vm* vm) {
+  struct mem_ctx* prev = mem_use(&vm->mem);
+  while (vm->images != NULL) {
+    struct tr_image* next = vm->images->next;
+    release_image(vm->images->base, vm->images->len, vm->images->mapped);
+    mem_free(vm->images, sizeof(*vm->images));
+    vm->images = next;
+  }
+  mem_use(prev);
+}
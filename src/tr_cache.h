@@ -0,0 +1,45 @@
+#ifndef tr_cache_h
+#define tr_cache_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct tr_vm;
+struct tr_func;
+
+// Precompiled bytecode (.trc). An image holds a compiled script with every
+// function, constant pool, string and line table it uses, plus the key of the
+// source it came from. Loading maps the file and points the chunks straight
+// at it; only strings are copied (interned) and global slots renumbered.
+//
+// Bump TR_CACHE_VERSION whenever an instruction's encoding or the layout changes.
+#define TR_CACHE_VERSION 10
+
+// Compile options that change the bytecode; a cached image is only used
+// when they match. The inlining size limit goes in the bits from
+// TR_CACHE_INLINE_SHIFT up.
+#define TR_CACHE_OPTIMIZED 0x1
+#define TR_CACHE_INLINE_SHIFT 8
+
+// Writes script, compiled by vm from src_text, to path. src_path is stat'ed
+// for the cache key and may be NULL for sources that are not files.
+bool tr_cache_write(struct tr_vm* vm, struct tr_func* script, const char* path,
+                    const char* src_path, const char* src_text, size_t src_len, uint32_t flags);
+
+// Loads the image at path into vm. With src_path set it must have been built
+// from that file as it is now (same mtime and size, or same contents) with
+// the same flags; otherwise, or if the file is missing or malformed, returns
+// NULL. The mapping stays alive until tr_vm_free. Only the file's layout is
+// checked; the bytecode in it is trusted like code the VM compiled itself.
+struct tr_func* tr_cache_load(struct tr_vm* vm, const char* path, const char* src_path,
+                              uint32_t flags);
+
+// Cache file name for a source: "x.tr" -> "x.trc", anything else gets
+// ".trc" appended. Returns false if buf is too small.
+bool tr_cache_path(const char* src_path, char* buf, size_t len);
+
+// Unmaps every image tr_cache_load attached to vm.
+void tr_cache_release(struct tr_vm* vm);
+
+#endif // tr_cache_h
@@ -21,29 +21,29 @@ void tr_debug_print_val(struct tr_value* val, char* buf, int len) {
     snprintf(buf, len, "Invalid");
     return;
   }
-  switch (val->type) {
+  switch (tr_value_type(*val)) {
   case VAL_STR:
-    snprintf(buf, len, "%s", val->s.str);
+    snprintf(buf, len, "%s", AS_STR(*val)->str);
     break;
   case VAL_LNG:
-    snprintf(buf, len, "%ld", val->l);
+    snprintf(buf, len, "%ld", AS_LNG(*val));
     break;
   case VAL_DBL:
-    snprintf(buf, len, "%f", val->d);
+    snprintf(buf, len, "%f", AS_DBL(*val));
     break;
   case VAL_BOOL:
-    snprintf(buf, len, "%s", val->b ? "true" : "false");
+    snprintf(buf, len, "%s", AS_BOOL(*val) ? "true" : "false");
     break;
   case VAL_CFUNC:
-    snprintf(buf, len, "<%p>", val->func);
+    snprintf(buf, len, "<%p>", (void*)AS_CFUNC(*val));
     break;
   case VAL_OBJ:
-    switch (val->obj->type) {
+    switch (AS_OBJ(*val)->type) {
     case OBJ_NULL:
       snprintf(buf, len, "NULL");
       break;
     case OBJ_FUNC: {
-      struct tr_func* fn = (struct tr_func*)val->obj;
+      struct tr_func* fn = (struct tr_func*)AS_OBJ(*val);
       snprintf(buf, len, "<func: %s>", fn->name != NULL ? fn->name->str : "script");
       break;
     }
@@ -55,7 +55,7 @@ void tr_debug_print_val(struct tr_value* val, char* buf, int len) {
 }
 
 const char* tr_debug_value_type(struct tr_value* val) {
-  switch (val->type) {
+  switch (tr_value_type(*val)) {
   case VAL_BOOL:
     return "bool";
   case VAL_DBL:
@@ -71,7 +71,7 @@ const char* tr_debug_value_type(struct tr_value* val) {
   case VAL_CFUNC:
     return "cfunc<??>";
   case VAL_OBJ:
-    switch (val->obj->type) {
+    switch (AS_OBJ(*val)->type) {
     case OBJ_CLOSURE:
       return "object<closure>";
     case OBJ_FUNC:
@@ -84,14 +84,27 @@ const char* tr_debug_value_type(struct tr_value* val) {
   }
 }
 
-static int singleOperandOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+// Big-endian operand of width bytes starting at offset.
+static uint32_t operand(struct tr_chunk* chunk, int offset, int width) {
+  uint32_t v = 0;
+  for (int i = 0; i < width; i++)
+    v = v << 8 | chunk->instructions[offset + i];
+  return v;
+}
+
+static int constantOpcode(const char* name, int width, struct tr_chunk* chunk, int offset) {
+  uint32_t idx = operand(chunk, offset + 1, width);
   printf("%-16s ", name);
-  printf("%03d ", chunk->instructions[offset + 1]);
-  struct tr_value* val = tr_constants_get(&chunk->constants, chunk->instructions[offset + 1]);
+  printf("%03u ", idx);
+  struct tr_value* val = tr_constants_get(&chunk->constants, (int)idx);
   char buf[128];
   tr_debug_print_val(val, buf, sizeof(buf));
   printf("%s\n", buf);
-  return offset + 2;
+  return offset + 1 + width;
+}
+
+static int singleOperandOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+  return constantOpcode(name, 1, chunk, offset);
 }
 
 static int singleByteOpcode(const char* name, struct tr_chunk* chunk, int offset) {
@@ -100,10 +113,59 @@ static int singleByteOpcode(const char* name, struct tr_chunk* chunk, int offset
   return offset + 2;
 }
 
-static int jumpOpcode(const char* name, int sign, struct tr_chunk* chunk, int offset) {
-  uint16_t jump = (uint16_t)(chunk->instructions[offset + 1] << 8);
-  jump |= chunk->instructions[offset + 2];
-  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+static int localConstantOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+  uint8_t slot = chunk->instructions[offset + 1];
+  uint8_t idx  = chunk->instructions[offset + 2];
+  char buf[128];
+  tr_debug_print_val(tr_constants_get(&chunk->constants, idx), buf, sizeof(buf));
+  printf("%-16s %03d %03d %s\n", name, slot, idx, buf);
+  return offset + 3;
+}
+
+static int slotOpcode(const char* name, int width, struct tr_chunk* chunk, int offset) {
+  printf("%-16s %05u\n", name, operand(chunk, offset + 1, width));
+  return offset + 1 + width;
+}
+
+static int globalOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+  return slotOpcode(name, 2, chunk, offset);
+}
+
+static int jumpOpcode(const char* name, int sign, int width, struct tr_chunk* chunk, int offset) {
+  int jump = (int)operand(chunk, offset + 1, width);
+  int next = offset + 1 + width;
+  printf("%-16s %4d -> %d\n", name, offset, next + sign * jump);
+  return next;
+}
+
+// Counted loop step: counter slot, limit (slot or constant), back offset.
+static int forOpcode(const char* name, int width, struct tr_chunk* chunk, int offset) {
+  uint8_t slot = chunk->instructions[offset + 1];
+  int limit    = (int)operand(chunk, offset + 2, width);
+  int next     = offset + 2 + width + 3;
+  int jump     = (int)operand(chunk, offset + 2 + width, 3);
+  printf("%-16s %03d %03d %4d -> %d\n", name, slot, limit, offset, next - jump);
+  return next;
+}
+
+// A switch and its table, one key per line.
+static int switchOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+  int n       = (int)operand(chunk, offset + 1, 2);
+  bool table  = chunk->instructions[offset] == OP_TABLESWITCH;
+  int keys    = offset + 3;
+  int offsets = keys + 4 * (table ? 1 : n);
+  int next    = offsets + 3 * (n + 1);
+  printf("%-16s %d entries\n", name, n);
+  printf("     %12s -> %d\n", "default", next + (int)operand(chunk, offsets, 3));
+  for (int i = 0; i < n; i++) {
+    int32_t key = (int32_t)operand(chunk, table ? keys : keys + 4 * i, 4) + (table ? i : 0);
+    printf("     %12d -> %d\n", key, next + (int)operand(chunk, offsets + 3 * (i + 1), 3));
+  }
+  return next;
+}
+
+static int immediateOpcode(const char* name, struct tr_chunk* chunk, int offset) {
+  printf("%-16s %d\n", name, (int16_t)operand(chunk, offset + 1, 2));
   return offset + 3;
 }
 
@@ -124,19 +186,21 @@ int tr_opcode_dissasemble(struct tr_chunk* chunk, int offset) {
   case OP_GET_LOCAL:
     return singleByteOpcode("OP_GET_LOCAL", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return singleOperandOpcode("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalOpcode("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return singleOperandOpcode("OP_SET_GLOBAL", chunk, offset);
+    return globalOpcode("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return singleOperandOpcode("OP_GET_GLOBAL", chunk, offset);
+    return globalOpcode("OP_GET_GLOBAL", chunk, offset);
   case OP_JMP_FALSE:
-    return jumpOpcode("OP_JMP_FALSE", 1, chunk, offset);
+    return jumpOpcode("OP_JMP_FALSE", 1, 2, chunk, offset);
   case OP_JMP:
-    return jumpOpcode("OP_JMP", 1, chunk, offset);
+    return jumpOpcode("OP_JMP", 1, 2, chunk, offset);
   case OP_LOOP:
-    return jumpOpcode("OP_LOOP", -1, chunk, offset);
+    return jumpOpcode("OP_LOOP", -1, 2, chunk, offset);
   case OP_CALL:
     return singleByteOpcode("OP_CALL",chunk, offset);
+  case OP_TAIL_CALL:
+    return singleByteOpcode("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE: {
     char buf[256];
     offset++;
@@ -173,6 +237,124 @@ int tr_opcode_dissasemble(struct tr_chunk* chunk, int offset) {
     return simpleOpcode("OP_FMUL", offset);
   case OP_CONSTANT:
     return singleOperandOpcode("OP_CONSTANT", chunk, offset);
+  case OP_SET_LOCAL_POP:
+    return singleByteOpcode("OP_SET_LOCAL_POP", chunk, offset);
+  case OP_GET_LOCAL_GET_LOCAL:
+    printf("%-16s %03d %03d\n", "OP_GET_LOCAL_GET_LOCAL", chunk->instructions[offset + 1],
+           chunk->instructions[offset + 2]);
+    return offset + 3;
+  case OP_GET_LOCAL_CONSTANT_IADD:
+    return localConstantOpcode("OP_GET_LOCAL_CONSTANT_IADD", chunk, offset);
+  case OP_GET_LOCAL_CONSTANT_ISUB:
+    return localConstantOpcode("OP_GET_LOCAL_CONSTANT_ISUB", chunk, offset);
+  case OP_CONSTANT_RETURN:
+    return singleOperandOpcode("OP_CONSTANT_RETURN", chunk, offset);
+  case OP_CALL_0:
+    return simpleOpcode("OP_CALL_0", offset);
+  case OP_CALL_1:
+    return simpleOpcode("OP_CALL_1", offset);
+  case OP_CALL_2:
+    return simpleOpcode("OP_CALL_2", offset);
+  case OP_CONSTANT_LONG:
+    return constantOpcode("OP_CONSTANT_LONG", 3, chunk, offset);
+  case OP_CLOSURE_LONG:
+    return constantOpcode("OP_CLOSURE_LONG", 3, chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return slotOpcode("OP_DEFINE_GLOBAL_LONG", 3, chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return slotOpcode("OP_SET_GLOBAL_LONG", 3, chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return slotOpcode("OP_GET_GLOBAL_LONG", 3, chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return slotOpcode("OP_SET_LOCAL_LONG", 2, chunk, offset);
+  case OP_GET_LOCAL_LONG:
+    return slotOpcode("OP_GET_LOCAL_LONG", 2, chunk, offset);
+  case OP_LOOP_LONG:
+    return jumpOpcode("OP_LOOP_LONG", -1, 3, chunk, offset);
+  case OP_JMP_FALSE_LONG:
+    return jumpOpcode("OP_JMP_FALSE_LONG", 1, 3, chunk, offset);
+  case OP_JMP_LONG:
+    return jumpOpcode("OP_JMP_LONG", 1, 3, chunk, offset);
+  case OP_ADD:
+    return simpleOpcode("OP_ADD", offset);
+  case OP_SUB:
+    return simpleOpcode("OP_SUB", offset);
+  case OP_MUL:
+    return simpleOpcode("OP_MUL", offset);
+  case OP_DIV:
+    return simpleOpcode("OP_DIV", offset);
+  case OP_ADD_IMM:
+    return immediateOpcode("OP_ADD_IMM", chunk, offset);
+  case OP_ADD_INT:
+    return simpleOpcode("OP_ADD_INT", offset);
+  case OP_SUB_INT:
+    return simpleOpcode("OP_SUB_INT", offset);
+  case OP_MUL_INT:
+    return simpleOpcode("OP_MUL_INT", offset);
+  case OP_DIV_INT:
+    return simpleOpcode("OP_DIV_INT", offset);
+  case OP_ADD_DBL:
+    return simpleOpcode("OP_ADD_DBL", offset);
+  case OP_SUB_DBL:
+    return simpleOpcode("OP_SUB_DBL", offset);
+  case OP_MUL_DBL:
+    return simpleOpcode("OP_MUL_DBL", offset);
+  case OP_DIV_DBL:
+    return simpleOpcode("OP_DIV_DBL", offset);
+  case OP_ADD_IMM_INT:
+    return immediateOpcode("OP_ADD_IMM_INT", chunk, offset);
+  case OP_CHECK_TYPE:
+    return singleByteOpcode("OP_CHECK_TYPE", chunk, offset);
+  case OP_JMP_IF_GE:
+    return jumpOpcode("OP_JMP_IF_GE", 1, 3, chunk, offset);
+  case OP_JMP_IF_GT:
+    return jumpOpcode("OP_JMP_IF_GT", 1, 3, chunk, offset);
+  case OP_JMP_IF_LE:
+    return jumpOpcode("OP_JMP_IF_LE", 1, 3, chunk, offset);
+  case OP_JMP_IF_LT:
+    return jumpOpcode("OP_JMP_IF_LT", 1, 3, chunk, offset);
+  case OP_JMP_IF_GE_INT:
+    return jumpOpcode("OP_JMP_IF_GE_INT", 1, 3, chunk, offset);
+  case OP_JMP_IF_GT_INT:
+    return jumpOpcode("OP_JMP_IF_GT_INT", 1, 3, chunk, offset);
+  case OP_JMP_IF_LE_INT:
+    return jumpOpcode("OP_JMP_IF_LE_INT", 1, 3, chunk, offset);
+  case OP_JMP_IF_LT_INT:
+    return jumpOpcode("OP_JMP_IF_LT_INT", 1, 3, chunk, offset);
+  case OP_JMP_IF_GE_DBL:
+    return jumpOpcode("OP_JMP_IF_GE_DBL", 1, 3, chunk, offset);
+  case OP_JMP_IF_GT_DBL:
+    return jumpOpcode("OP_JMP_IF_GT_DBL", 1, 3, chunk, offset);
+  case OP_JMP_IF_LE_DBL:
+    return jumpOpcode("OP_JMP_IF_LE_DBL", 1, 3, chunk, offset);
+  case OP_JMP_IF_LT_DBL:
+    return jumpOpcode("OP_JMP_IF_LT_DBL", 1, 3, chunk, offset);
+  case OP_FOR_INC_LT:
+    return forOpcode("OP_FOR_INC_LT", 1, chunk, offset);
+  case OP_FOR_INC_LT_K:
+    return forOpcode("OP_FOR_INC_LT_K", 2, chunk, offset);
+  case OP_TABLESWITCH:
+    return switchOpcode("OP_TABLESWITCH", chunk, offset);
+  case OP_LOOKUPSWITCH:
+    return switchOpcode("OP_LOOKUPSWITCH", chunk, offset);
+  case OP_NOT:
+    return simpleOpcode("OP_NOT", offset);
+  case OP_LT:
+    return simpleOpcode("OP_LT", offset);
+  case OP_LTEQ:
+    return simpleOpcode("OP_LTEQ", offset);
+  case OP_GT:
+    return simpleOpcode("OP_GT", offset);
+  case OP_GTEQ:
+    return simpleOpcode("OP_GTEQ", offset);
+  case OP_PUSH_INT:
+    return immediateOpcode("OP_PUSH_INT", chunk, offset);
+  case OP_IADD_IMM:
+    return immediateOpcode("OP_IADD_IMM", chunk, offset);
+  case OP_GET_LOCAL_IADD_IMM:
+    printf("%-16s %03d %d\n", "OP_GET_LOCAL_IADD_IMM", chunk->instructions[offset + 1],
+           (int16_t)operand(chunk, offset + 2, 2));
+    return offset + 4;
   default:
     printf("Unknown: %03d\n", opcode);
     return offset + 1;
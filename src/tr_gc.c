@@ -0,0 +1,195 @@
+#include "tr_gc.h"
+
+#include "memory.h"
+#include "tr_obj.h"
+#include "tr_vm.h"
+
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t object_size(struct tr_object* obj) {
+  switch (obj->type) {
+  case OBJ_FUNC: {
+    struct tr_func* f = (struct tr_func*)obj;
+    size_t calls      = f->calls != NULL ? sizeof(*f->calls) * (size_t)(f->call_mask + 1) : 0;
+    return sizeof(*f) + f->chunk.capacity +
+           sizeof(struct tr_value) * (size_t)f->chunk.constants.capacity + calls;
+  }
+  case OBJ_CLOSURE:
+    return sizeof(struct tr_closure);
+  default:
+    return sizeof(*obj);
+  }
+}
+
+// The gray stack grows while a collection runs, so it uses mem_try_realloc,
+// which cannot re-enter the trigger. If it cannot grow the object stays
+// marked but off the stack, for trace to pick up.
+static void mark_object(struct tr_gc* gc, struct tr_object* obj) {
+  if (obj == NULL || obj->marked)
+    return;
+  obj->marked = true;
+  if (gc->gray_count == gc->gray_capacity) {
+    int capacity = gc->gray_capacity == 0 ? 64 : gc->gray_capacity * 2;
+    struct tr_object** gray =
+        mem_try_realloc(gc->gray, sizeof(*gc->gray) * gc->gray_capacity, sizeof(*gray) * capacity);
+    if (gray == NULL) {
+      gc->gray_overflow = true;
+      return;
+    }
+    gc->gray          = gray;
+    gc->gray_capacity = capacity;
+  }
+  gc->gray[gc->gray_count++] = obj;
+}
+
+static void mark_value(struct tr_gc* gc, struct tr_value v) {
+  if (IS_OBJ(v))
+    mark_object(gc, AS_OBJ(v));
+}
+
+static void blacken(struct tr_gc* gc, struct tr_object* obj) {
+  switch (obj->type) {
+  case OBJ_FUNC: {
+    struct tr_func* f      = (struct tr_func*)obj;
+    struct tr_constants* k = &f->chunk.constants;
+    for (int i = 0; i < k->count; i++)
+      mark_value(gc, k->values[i]);
+    // Cached callees stay alive, so an address a cache holds always means
+    // the function it checked.
+    for (int i = 0; f->calls != NULL && i <= f->call_mask; i++) {
+      if (f->calls[i].func != NULL)
+        mark_object(gc, &f->calls[i].func->obj);
+    }
+    break;
+  }
+  case OBJ_CLOSURE:
+    mark_object(gc, &((struct tr_closure*)obj)->func->obj);
+    break;
+  default:
+    break;
+  }
+}
+
+// Blackens until nothing gray is left. After an overflow every marked object
+// is blackened again; that is harmless for the ones already done and reaches
+// the ones that were dropped.
+static void trace(struct tr_gc* gc) {
+  for (;;) {
+    while (gc->gray_count > 0)
+      blacken(gc, gc->gray[--gc->gray_count]);
+    if (!gc->gray_overflow)
+      return;
+    gc->gray_overflow = false;
+    for (struct tr_object* obj = gc->objects; obj != NULL; obj = obj->next) {
+      if (obj->marked)
+        blacken(gc, obj);
+    }
+  }
+}
+
+static void mark_roots(struct tr_vm* vm) {
+  struct tr_gc* gc = &vm->gc;
+  for (struct tr_value* v = vm->stack; v < vm->stackTop; v++)
+    mark_value(gc, *v);
+  for (int i = 0; i < vm->frame_count; i++)
+    mark_object(gc, &vm->frames[i].func->obj);
+  for (int i = 0; i < vm->global_count; i++)
+    mark_value(gc, vm->global_values[i]);
+}
+
+static void sweep(struct tr_gc* gc) {
+  struct tr_object** link = &gc->objects;
+  gc->stats.bytes_live    = 0;
+  while (*link != NULL) {
+    struct tr_object* obj = *link;
+    size_t size           = object_size(obj);
+    if (obj->marked) {
+      obj->marked = false;
+      gc->stats.bytes_live += size;
+      link = &obj->next;
+      continue;
+    }
+    *link = obj->next;
+    gc->stats.objects_freed++;
+    gc->stats.bytes_freed += size;
+    tr_object_destroy(obj);
+  }
+}
+
+void tr_gc_collect(struct tr_vm* vm) {
+  struct tr_gc* gc     = &vm->gc;
+  double start         = now();
+  struct mem_ctx* prev = mem_use(&vm->mem);
+
+  mark_roots(vm);
+  trace(gc);
+  sweep(gc);
+  mem_use(prev);
+
+  double pause = now() - start;
+  gc->stats.collections++;
+  gc->stats.pause_total += pause;
+  if (pause > gc->stats.pause_max)
+    gc->stats.pause_max = pause;
+#ifdef TR_DEBUG_STRESS_GC
+  mem_gc_reset(&vm->mem, 0);
+#else
+  // Let the heap double before the next collection.
+  mem_gc_reset(&vm->mem,
+               gc->stats.bytes_live > TR_GC_MIN_HEAP ? gc->stats.bytes_live : TR_GC_MIN_HEAP);
+#endif
+}
+
+static void gc_hook(void* ctx) {
+  struct tr_vm* vm = ctx;
+  if (vm->frame_count > 0)
+    tr_gc_collect(vm);
+}
+
+void tr_gc_init(struct tr_vm* vm) {
+  struct tr_gc* gc = &vm->gc;
+  gc->objects       = NULL;
+  gc->gray          = NULL;
+  gc->gray_count    = 0;
+  gc->gray_capacity = 0;
+  gc->gray_overflow = false;
+  gc->stats         = (struct tr_gc_stats){0};
+  mem_gc_set_hook(&vm->mem, gc_hook, vm);
+#ifdef TR_DEBUG_STRESS_GC
+  mem_gc_reset(&vm->mem, 0);
+#else
+  mem_gc_reset(&vm->mem, TR_GC_MIN_HEAP);
+#endif
+}
+
+void tr_gc_free(struct tr_vm* vm) {
+  struct tr_gc* gc = &vm->gc;
+  mem_gc_set_hook(&vm->mem, NULL, NULL);
+  while (gc->objects != NULL) {
+    struct tr_object* next = gc->objects->next;
+    tr_object_destroy(gc->objects);
+    gc->objects = next;
+  }
+  mem_free(gc->gray, sizeof(*gc->gray) * gc->gray_capacity);
+  gc->gray       = NULL;
+  gc->gray_count = gc->gray_capacity = 0;
+}
+
+void tr_gc_track(struct tr_vm* vm, struct tr_object* obj) {
+  obj->next       = vm->gc.objects;
+  vm->gc.objects  = obj;
+}
+
+void tr_gc_stats_print(const struct tr_gc_stats* s, FILE* fp) {
+  fprintf(fp, "gc: %zu collections\n", s->collections);
+  fprintf(fp, "  freed  %zu objects, %zu bytes\n", s->objects_freed, s->bytes_freed);
+  fprintf(fp, "  live   %zu bytes\n", s->bytes_live);
+  fprintf(fp, "  pause  %.3f ms total, %.3f ms max\n", s->pause_total * 1e3,
+          s->pause_max * 1e3);
+}
@@ -0,0 +1,44 @@
+#ifndef tr_gc_h
+#define tr_gc_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct tr_vm;
+struct tr_object;
+
+// Collections never run with vm->frame_count == 0, i.e. while compiling or
+// between tr_vm_do_chunk calls, so objects the parser creates need no rooting.
+// Strings are interned and live as long as the vm; they are not collected.
+#define TR_GC_MIN_HEAP (1024 * 1024)
+
+struct tr_gc_stats {
+  size_t collections;
+  size_t objects_freed;
+  size_t bytes_freed;
+  size_t bytes_live;  // surviving object bytes after the last collection
+  double pause_total; // seconds
+  double pause_max;
+};
+
+struct tr_gc {
+  struct tr_object* objects;
+  struct tr_object** gray;
+  int gray_count;
+  int gray_capacity;
+  // Set when the gray stack could not grow; some marked objects then still
+  // need blackening and are found by rescanning the heap.
+  bool gray_overflow;
+  struct tr_gc_stats stats;
+};
+
+void tr_gc_init(struct tr_vm* vm);
+// Frees every tracked object, reachable or not.
+void tr_gc_free(struct tr_vm* vm);
+// Hands a freshly initialized object to the collector.
+void tr_gc_track(struct tr_vm* vm, struct tr_object* obj);
+void tr_gc_collect(struct tr_vm* vm);
+void tr_gc_stats_print(const struct tr_gc_stats* stats, FILE* fp);
+
+#endif // tr_gc_h
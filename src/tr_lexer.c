@@ -2,18 +2,53 @@
 #include "memory.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define TR_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The run scanners below look at a whole vector of source bytes at a time.
+// AVX2 needs -mavx2 (TROEL_AVX2 in CMake); define TR_LEXER_NO_SIMD to force
+// the scalar loops.
+#if !defined(TR_LEXER_NO_SIMD) && defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#define TR_VEC_WIDTH 32
+typedef __m256i tr_vec;
+#define vec_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm256_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_and(a, b) _mm256_and_si256(a, b)
+#define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif !defined(TR_LEXER_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TR_VEC_WIDTH 16
+typedef __m128i tr_vec;
+#define vec_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_gt(a, b) _mm_cmpgt_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_and(a, b) _mm_and_si128(a, b)
+#define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+static bool at_end(struct tr_lexer* l) { return l->current >= l->end; }
+
 static struct tr_token make_token(struct tr_lexer* l, token_type type) {
   struct tr_token tok;
-  tok.type           = type;
-  tok.length         = (int)(l->current - l->source);
-  tok.start          = mem_strndup(l->source, tok.length);
-  tok.line           = l->line;
-  l->source[l->size] = '\0';
-  l->size            = 0;
-  l->current         = l->source;
+  tok.type   = type;
+  tok.start  = l->start;
+  tok.length = (int)(l->current - l->start);
+  tok.line   = l->line;
   return tok;
 }
 
@@ -31,57 +66,157 @@ static bool is_alpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
 }
 
-static int advance(struct tr_lexer* l) {
-  l->source[l->size++] = l->getc(l);
-  l->current++;
-  return *(l->current - 1);
+// Most runs (single spaces, short names) end within a few bytes; only switch
+// to vectors once a run is longer than this.
+#define TR_SCAN_SHORT 8
+
+#ifdef TR_VEC_WIDTH
+#define TR_VEC_ALL ((uint32_t)(((uint64_t)1 << TR_VEC_WIDTH) - 1))
+
+// Signed byte compares are fine here: non-ASCII bytes are negative and never
+// fall inside an ASCII range.
+static inline tr_vec vec_range(tr_vec v, char lo, char hi) {
+  return vec_and(vec_gt(v, vec_set1(lo - 1)), vec_gt(vec_set1(hi + 1), v));
+}
+
+static inline uint32_t ws_mask(tr_vec v, uint32_t* newlines) {
+  tr_vec nl = vec_eq(v, vec_set1('\n'));
+  *newlines = vec_mask(nl);
+  tr_vec ws = vec_or(vec_or(vec_eq(v, vec_set1(' ')), vec_eq(v, vec_set1('\t'))),
+                     vec_or(vec_eq(v, vec_set1('\r')), nl));
+  return vec_mask(ws);
+}
+
+static inline uint32_t ident_mask(tr_vec v) {
+  tr_vec m = vec_or(vec_or(vec_range(v, 'a', 'z'), vec_range(v, 'A', 'Z')),
+                    vec_or(vec_range(v, '0', '9'), vec_eq(v, vec_set1('_'))));
+  return vec_mask(m);
 }
+#endif
 
-static int peek(struct tr_lexer* l) { return l->peekc(l, 0); }
-static int peek2(struct tr_lexer* l) { return l->peekc(l, 1); }
+// Returns the first byte that isn't ' ', '\t', '\r' or '\n', counting newlines.
+static const char* scan_space(const char* p, const char* end, int* line) {
+  for (const char* s = end - p > TR_SCAN_SHORT ? p + TR_SCAN_SHORT : end; p < s; p++) {
+    if (*p == '\n')
+      (*line)++;
+    else if (*p != ' ' && *p != '\t' && *p != '\r')
+      return p;
+  }
+#ifdef TR_VEC_WIDTH
+  while (end - p >= TR_VEC_WIDTH) {
+    uint32_t nl;
+    uint32_t stop = ~ws_mask(vec_load(p), &nl) & TR_VEC_ALL;
+    if (stop != 0) {
+      int n = __builtin_ctz(stop);
+      *line += __builtin_popcount(nl & ((1u << n) - 1));
+      return p + n;
+    }
+    *line += __builtin_popcount(nl);
+    p += TR_VEC_WIDTH;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == '\n')
+      (*line)++;
+    else if (*p != ' ' && *p != '\t' && *p != '\r')
+      break;
+  }
+  return p;
+}
+
+// Returns the first byte that can't continue an identifier.
+static const char* scan_ident(const char* p, const char* end) {
+  for (const char* s = end - p > TR_SCAN_SHORT ? p + TR_SCAN_SHORT : end; p < s; p++) {
+    if (!is_alpha(*p) && !is_digit(*p))
+      return p;
+  }
+#ifdef TR_VEC_WIDTH
+  while (end - p >= TR_VEC_WIDTH) {
+    uint32_t stop = ~ident_mask(vec_load(p)) & TR_VEC_ALL;
+    if (stop != 0)
+      return p + __builtin_ctz(stop);
+    p += TR_VEC_WIDTH;
+  }
+#endif
+  while (p < end && (is_alpha(*p) || is_digit(*p)))
+    p++;
+  return p;
+}
+
+static const char* scan_digits(const char* p, const char* end) {
+  for (const char* s = end - p > TR_SCAN_SHORT ? p + TR_SCAN_SHORT : end; p < s; p++) {
+    if (!is_digit(*p))
+      return p;
+  }
+#ifdef TR_VEC_WIDTH
+  while (end - p >= TR_VEC_WIDTH) {
+    uint32_t stop = ~vec_mask(vec_range(vec_load(p), '0', '9')) & TR_VEC_ALL;
+    if (stop != 0)
+      return p + __builtin_ctz(stop);
+    p += TR_VEC_WIDTH;
+  }
+#endif
+  while (p < end && is_digit(*p))
+    p++;
+  return p;
+}
+
+// Returns the closing '"' (or end), counting the newlines inside the literal.
+static const char* scan_quote(const char* p, const char* end, int* line) {
+  for (const char* s = end - p > TR_SCAN_SHORT ? p + TR_SCAN_SHORT : end; p < s; p++) {
+    if (*p == '"')
+      return p;
+    if (*p == '\n')
+      (*line)++;
+  }
+#ifdef TR_VEC_WIDTH
+  while (end - p >= TR_VEC_WIDTH) {
+    tr_vec v      = vec_load(p);
+    uint32_t nl   = vec_mask(vec_eq(v, vec_set1('\n')));
+    uint32_t stop = vec_mask(vec_eq(v, vec_set1('"')));
+    if (stop != 0) {
+      int n = __builtin_ctz(stop);
+      *line += __builtin_popcount(nl & ((1u << n) - 1));
+      return p + n;
+    }
+    *line += __builtin_popcount(nl);
+    p += TR_VEC_WIDTH;
+  }
+#endif
+  for (; p < end && *p != '"'; p++) {
+    if (*p == '\n')
+      (*line)++;
+  }
+  return p;
+}
+
+static int advance(struct tr_lexer* l) { return *l->current++; }
+
+static int peek(struct tr_lexer* l) { return at_end(l) ? '\0' : *l->current; }
+static int peek2(struct tr_lexer* l) { return l->end - l->current < 2 ? '\0' : l->current[1]; }
 
 static bool match(struct tr_lexer* l, int ch) {
-  if (l->eof)
+  if (at_end(l))
     return false;
   if (*l->current != ch)
     return false;
-  l->getc(l);
+  l->current++;
   return true;
 }
 
 static void skip_ws(struct tr_lexer* l) {
   for (;;) {
-    int ch = peek(l);
-    switch (ch) {
-    case ' ':
-    case '\r':
-    case '\t':
-      l->getc(l);
-      break;
-    case '\n':
-      l->line++;
-      l->getc(l);
-      break;
-    case '/':
-      if (peek2(l) == '/') {
-        while (peek(l) != '\n' && !l->eof)
-          l->getc(l);
-      } else {
-        return;
-      }
-    default:
+    l->current = scan_space(l->current, l->end, &l->line);
+    if (peek(l) != '/' || peek2(l) != '/')
       return;
-    }
+    const char* nl = memchr(l->current, '\n', l->end - l->current);
+    l->current     = nl != NULL ? nl : l->end;
   }
 }
 
 static struct tr_token make_string(struct tr_lexer* l) {
-  while (peek(l) != '"' && !l->eof) {
-    if (peek(l) == '\n')
-      l->line++;
-    advance(l);
-  }
-  if (l->eof)
+  l->current = scan_quote(l->current, l->end, &l->line);
+  if (at_end(l))
     return error_token(l, "Unterminated String!");
   advance(l);
   return make_token(l, TOKEN_STRING);
@@ -89,32 +224,39 @@ static struct tr_token make_string(struct tr_lexer* l) {
 
 static struct tr_token make_number(struct tr_lexer* l) {
   token_type type = TOKEN_INT;
-  while (is_digit(peek(l)))
-    advance(l);
+  l->current      = scan_digits(l->current, l->end);
   if (peek(l) == '.' && is_digit(peek2(l))) {
     type = TOKEN_NUMBER;
     advance(l);
+    l->current = scan_digits(l->current, l->end);
   }
-  while (is_digit(peek(l)))
-    advance(l);
-  return make_token(l, TOKEN_INT);
+  return make_token(l, type);
 }
 
 static token_type check_keyword(struct tr_lexer* l, int start, int len, const char* rest,
                                 token_type type) {
-  if (l->current - l->source == start + len && memcmp(l->source + start, rest, len) == 0) {
+  if (l->current - l->start == start + len && memcmp(l->start + start, rest, len) == 0) {
     return type;
   }
   return TOKEN_IDENT;
 }
 static token_type ident_type(struct tr_lexer* l) {
   // clang-format off
-  switch (l->source[0]) {
+  switch (l->start[0]) {
   case 'a': return check_keyword(l, 1, 4, "lass", TOKEN_CLASS);
-  case 's': return check_keyword(l, 1, 4, "uper", TOKEN_SUPER);
+  case 's':
+    if(l->current - l->start > 1) {
+      switch(l->start[1]) {
+      case 'u': return check_keyword(l, 2, 3, "per", TOKEN_SUPER);
+      case 'w': return check_keyword(l, 2, 4, "itch", TOKEN_SWITCH);
+      }
+    }
+    break;
+  case 'c': return check_keyword(l, 1, 3, "ase", TOKEN_CASE);
+  case 'd': return check_keyword(l, 1, 6, "efault", TOKEN_DEFAULT);
   case 't':
-    if(l->current - l->source > 1) {
-      switch(l->source[1]) {
+    if(l->current - l->start > 1) {
+      switch(l->start[1]) {
       case 'h': return check_keyword(l, 2, 2, "is", TOKEN_THIS);
       case 'r': return check_keyword(l, 2, 2, "ue", TOKEN_TRUE);
       }
@@ -122,8 +264,8 @@ static token_type ident_type(struct tr_lexer* l) {
     break;
 
   case 'f':
-    if(l->current - l->source > 1) {
-      switch(l->source[1]) {
+    if(l->current - l->start > 1) {
+      switch(l->start[1]) {
       case 'a': return check_keyword(l, 2, 3, "lse", TOKEN_FALSE);
       case 'o': return check_keyword(l, 2, 1, "r", TOKEN_FOR);
       case 'n': return TOKEN_FUNC;
@@ -145,91 +287,119 @@ static token_type ident_type(struct tr_lexer* l) {
 }
 
 static struct tr_token make_identifier(struct tr_lexer* l) {
-  while (is_alpha(peek(l)) || is_digit(peek(l)))
-    advance(l);
+  l->current = scan_ident(l->current, l->end);
   return make_token(l, ident_type(l));
 }
 
 void tr_lexer_init(struct tr_lexer* lex) {
-  memset(lex->source, 0, sizeof(lex->source));
+  lex->start   = NULL;
   lex->current = NULL;
+  lex->end     = NULL;
   lex->line    = 0;
-  lex->current = lex->source;
-  lex->size    = 0;
-  lex->eof     = false;
+  lex->buf     = NULL;
+  lex->buf_len = 0;
+  lex->kind    = TR_SOURCE_NONE;
 }
 
-int s_getc(struct tr_lexer* l) {
-  char* s = l->user;
-  if (*s == '\0') {
-    l->eof = true;
-    return *s;
-  }
-  s++;
-  l->user = s;
-  return *(s - 1);
+static void lexer_set_source(struct tr_lexer* lex, const char* buf, size_t len,
+                             tr_source_kind kind) {
+  lex->buf     = buf;
+  lex->buf_len = len;
+  lex->kind    = kind;
+  lex->start   = buf;
+  lex->current = buf;
+  lex->end     = buf + len;
 }
 
-int s_peekc(struct tr_lexer* l, int far) {
-  char* s = l->user;
-  for (int i = 0; i <= far; i++) {
-    if (*(s + i) == '\0')
-      return '\0';
-  }
-  return *(s + far);
+int tr_lexer_str_init(struct tr_lexer* lex, const char* string) {
+  tr_lexer_init(lex);
+  lexer_set_source(lex, string, strlen(string), TR_SOURCE_NONE);
+  return 0;
 }
 
-struct f_data {
-  FILE* fp;
-  bool eof;
-};
-
-int f_getc(struct tr_lexer* l) {
-  FILE* fp = (FILE*)l->user;
-  char ch;
-  if (fread(&ch, sizeof(char), 1, fp) != 1) {
-    l->eof = true;
-    return '\0';
+static int read_whole_file(struct tr_lexer* lex, FILE* fp) {
+  // Runs in whatever context is current, so allocations may return NULL.
+  size_t cap = 4096, len = 0;
+  char* buf  = mem_alloc(cap);
+  bool ok    = buf != NULL;
+  while (ok) {
+    len += fread(buf + len, 1, cap - len, fp);
+    if (len < cap)
+      break;
+    char* grown = mem_realloc(buf, cap, cap * 2);
+    ok          = grown != NULL;
+    if (ok) {
+      buf = grown;
+      cap *= 2;
+    }
   }
-  return ch;
-}
-
-int f_peekc(struct tr_lexer* l, int far) {
-  FILE* fp   = l->user;
-  size_t off = ftell(fp);
-  fseek(fp, far, SEEK_CUR);
-  char ch;
-  if (fread(&ch, sizeof(char), 1, fp) != 1) {
-    fseek(fp, off, SEEK_SET);
-    return '\0';
+  // exact size, so tr_lexer_free knows it
+  char* exact = ok && !ferror(fp) ? mem_realloc(buf, cap, len + 1) : NULL;
+  if (exact == NULL) {
+    mem_free(buf, cap);
+    return -1;
   }
-  fseek(fp, off, SEEK_SET);
-  return ch;
+  lexer_set_source(lex, exact, len, TR_SOURCE_HEAP);
+  return 0;
 }
 
-int tr_lexer_str_init(struct tr_lexer* lex, const char* string) {
+int tr_lexer_file_init(struct tr_lexer* lex, const char* file) {
   tr_lexer_init(lex);
-  lex->user  = (void*)string;
-  lex->getc  = s_getc;
-  lex->peekc = s_peekc;
-  return 0;
+#ifdef TR_HAVE_MMAP
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+      lexer_set_source(lex, map, (size_t)st.st_size, TR_SOURCE_MAPPED);
+      return 0;
+    }
+  }
+  close(fd);
+#endif
+  // Empty files, special files and platforms without mmap get one bulk read.
+  FILE* fp = fopen(file, "rb");
+  if (!fp) {
+    return -1;
+  }
+  int res = read_whole_file(lex, fp);
+  fclose(fp);
+  return res;
 }
 
-int tr_lexer_file_init(struct tr_lexer* lex, const char* file) {
+int tr_lexer_stream_init(struct tr_lexer* lex, FILE* fp) {
   tr_lexer_init(lex);
-  FILE* fp = fopen(file, "r");
   if (!fp) {
     return -1;
   }
-  lex->user  = fp;
-  lex->getc  = f_getc;
-  lex->peekc = f_peekc;
-  return 0;
+  return read_whole_file(lex, fp);
+}
+
+void tr_lexer_free(struct tr_lexer* lex) {
+  switch (lex->kind) {
+  case TR_SOURCE_HEAP:
+    mem_free((void*)lex->buf, lex->buf_len + 1);
+    break;
+  case TR_SOURCE_MAPPED:
+#ifdef TR_HAVE_MMAP
+    munmap((void*)lex->buf, lex->buf_len);
+#endif
+    break;
+  case TR_SOURCE_NONE:
+    break;
+  }
+  tr_lexer_init(lex);
 }
 
 struct tr_token tr_lexer_next_token(struct tr_lexer* l) {
   skip_ws(l);
-  if (l->eof)
+  l->start = l->current;
+  if (at_end(l))
     return make_token(l, TOKEN_EOF);
 
   int c = advance(l);
@@ -250,6 +420,7 @@ struct tr_token tr_lexer_next_token(struct tr_lexer* l) {
     case '.': return make_token(l, TOKEN_DOT);
     case '-': return make_token(l, TOKEN_MINUS);
     case ';': return make_token(l, TOKEN_SEMICOLON);
+    case ':': return make_token(l, TOKEN_COLON);
     case '+': return make_token(l, TOKEN_PLUS);
     case '/': return make_token(l, TOKEN_SLASH);
     case '*': return make_token(l, TOKEN_STAR);
@@ -264,12 +435,3 @@ struct tr_token tr_lexer_next_token(struct tr_lexer* l) {
   // clang-format on
   return error_token(l, "Unknown Input");
 }
-
-struct tr_token tr_token_cpy(struct tr_token o) {
-  struct tr_token ret;
-  ret.length = o.length;
-  ret.line   = o.line;
-  ret.type   = o.type;
-  ret.start  = mem_strndup(o.start, o.length);
-  return ret;
-}
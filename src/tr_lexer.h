@@ -2,6 +2,7 @@
 #define tr_lexer_h
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 typedef enum {
@@ -14,6 +15,7 @@ typedef enum {
   TOKEN_MINUS,
   TOKEN_PLUS,
   TOKEN_SEMICOLON,
+  TOKEN_COLON,
   TOKEN_SLASH,
   TOKEN_STAR,
   TOKEN_ASSIGN,
@@ -46,6 +48,9 @@ typedef enum {
   TOKEN_ELSE,
   TOKEN_WHILE,
   TOKEN_FOR,
+  TOKEN_SWITCH,
+  TOKEN_CASE,
+  TOKEN_DEFAULT,
 
   TOKEN_NIL,
   TOKEN_VAR,
@@ -56,33 +61,39 @@ typedef enum {
   TOKEN_EOF
 } token_type;
 
+// A view into the lexer's source buffer; valid for as long as the lexer is.
 struct tr_token {
   token_type type;
-  char *start;
+  const char *start;
   int length;
   int line;
 };
 
+typedef enum {
+  TR_SOURCE_NONE,   // user owns the input string
+  TR_SOURCE_HEAP,   // buf was read into memory and must be freed
+  TR_SOURCE_MAPPED  // buf is an mmap of the file
+} tr_source_kind;
+
 struct tr_lexer {
-  char source[512];
-  int size;
   const char *start;
   const char *current;
+  const char *end;
   int line;
-  bool eof;
 
-  int (*getc)(struct tr_lexer *l);
-  int (*peekc)(struct tr_lexer *l, int far);
-  // int (*eof)(struct tr_lexer *l);
-  void *user;
+  const char *buf;
+  size_t buf_len;
+  tr_source_kind kind;
 };
 
 void tr_lexer(struct tr_lexer *lex);
 
 int tr_lexer_str_init(struct tr_lexer *lex, const char *string);
+// Maps (or bulk reads) the whole file once and lexes it from memory.
 int tr_lexer_file_init(struct tr_lexer *l, const char *file);
+// Reads an open stream to the end, for pipes and stdin.
+int tr_lexer_stream_init(struct tr_lexer *l, FILE *fp);
+void tr_lexer_free(struct tr_lexer *l);
 struct tr_token tr_lexer_next_token(struct tr_lexer *l);
 
-struct tr_token tr_token_cpy(struct tr_token o);
-
 #endif
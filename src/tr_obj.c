@@ -4,6 +4,8 @@
 
 void tr_object_init(struct tr_object* obj, int type) {
   obj->type     = type;
+  obj->marked   = false;
+  obj->next     = NULL;
   obj->destruct = NULL;
 }
 
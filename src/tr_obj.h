@@ -7,8 +7,12 @@ typedef enum {
   OBJ_CLOSURE
 } tr_obj_type;
 
+#include <stdbool.h>
+
 struct tr_object {
   tr_obj_type type;
+  bool marked;              // reached in the current collection
+  struct tr_object *next;   // every object the vm tracks (tr_gc_track)
   void (*destruct)(struct tr_object *object);
 };
 
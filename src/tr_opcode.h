@@ -37,7 +37,93 @@ enum {
   OP_FADD,
   OP_FSUB,
   OP_FDIV,
-  OP_FMUL
+  OP_FMUL,
+  // Generic arithmetic for operands of unknown type: ints stay ints, mixed
+  // with doubles they widen, anything else is a runtime error.
+  OP_ADD,
+  OP_SUB,
+  OP_DIV,
+  OP_MUL,
+  OP_CHECK_TYPE, // VAL_* type; the value must have it (ints widen to double)
+
+  // Wide operands, for chunks that outgrow the short forms above. Constant
+  // and global indices and jump offsets are 24-bit, local slots 16-bit.
+  OP_CONSTANT_LONG,
+  OP_CLOSURE_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_LOCAL_LONG,
+  OP_LOOP_LONG,
+  OP_JMP_FALSE_LONG,
+  OP_JMP_LONG,
+
+  // Signed 16-bit immediates. The adds are emitted only by tr_opt_chunk.
+  OP_PUSH_INT,
+  OP_IADD_IMM,
+  OP_ADD_IMM,
+
+  // Quickened generic ops, written over OP_ADD etc. by the interpreter once
+  // it has seen their operand types. On a miss they revert to the generic op.
+  OP_ADD_INT,
+  OP_SUB_INT,
+  OP_MUL_INT,
+  OP_DIV_INT,
+  OP_ADD_DBL,
+  OP_SUB_DBL,
+  OP_MUL_DBL,
+  OP_DIV_DBL,
+  OP_ADD_IMM_INT,
+
+  // Compare-and-branch: pops two values and jumps (24-bit forward offset)
+  // unless they compare as the condition requires; OP_JMP_IF_GE is what
+  // "a < b" compiles to and also jumps when either is NaN. Generic forms,
+  // then int and double ones in the same order; the generic ones quicken.
+  OP_JMP_IF_GE,
+  OP_JMP_IF_GT,
+  OP_JMP_IF_LE,
+  OP_JMP_IF_LT,
+  OP_JMP_IF_GE_INT,
+  OP_JMP_IF_GT_INT,
+  OP_JMP_IF_LE_INT,
+  OP_JMP_IF_LT_INT,
+  OP_JMP_IF_GE_DBL,
+  OP_JMP_IF_GT_DBL,
+  OP_JMP_IF_LE_DBL,
+  OP_JMP_IF_LT_DBL,
+
+  // Counted loop step: adds 1 to a local and jumps back (24-bit offset)
+  // while it is below the limit, as OP_ADD and OP_LT would.
+  OP_FOR_INC_LT,   // slot, limit slot, offset
+  OP_FOR_INC_LT_K, // slot, limit constant (16-bit), offset
+
+  // Switch dispatch: pops a value and jumps to the case for it. Operands are
+  // an entry count (16-bit), the keys (OP_TABLESWITCH: the 32-bit key of the
+  // first entry, the rest follow on; OP_LOOKUPSWITCH: one sorted 32-bit key
+  // per entry), then 24-bit offsets from the end of the instruction, the
+  // default's first and then one per entry.
+  OP_TABLESWITCH,
+  OP_LOOKUPSWITCH,
+
+  // OP_CALL in tail position (argument count): a closure replaces the
+  // current frame instead of pushing one. Always followed by OP_RETURN,
+  // which returns the result of a C function call.
+  OP_TAIL_CALL,
+
+  // Superinstructions, emitted only by tr_opt_chunk. Picked from opcode pair
+  // counts over bench/scripts (TROEL_PROFILE_OPCODES).
+  OP_SET_LOCAL_POP,            // slot
+  OP_GET_LOCAL_GET_LOCAL,      // slot, slot
+  OP_GET_LOCAL_CONSTANT_IADD,  // slot, constant
+  OP_GET_LOCAL_CONSTANT_ISUB,  // slot, constant
+  OP_GET_LOCAL_IADD_IMM,       // slot, immediate
+  OP_CONSTANT_RETURN,          // constant
+  OP_CALL_0,
+  OP_CALL_1,
+  OP_CALL_2,
+
+  OP_COUNT
 };
 
 #endif // tr_insn_h
@@ -0,0 +1,724 @@
+#include "tr_opt.h"
+
+#include "memory.h"
+#include "tr_opcode.h"
+#include "tr_vm.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+// Passes work on a decoded copy of the chunk: one entry per instruction,
+// jumps refer to instruction indices, and deleted entries are only marked
+// dead until the chunk is re-encoded. Index `count` stands for the chunk end.
+struct insn {
+  uint8_t op;
+  uint8_t args[3];
+  int target;
+  int line;
+  bool live;
+  bool wide; // jumps only: needs the 24-bit form
+  // Switches: a copy of the instruction, and the default's and each entry's
+  // target in the order of its offsets.
+  uint8_t* table;
+  int* targets;
+};
+
+struct opt {
+  struct insn* code;
+  int capacity; // entries allocated for code and is_target
+  int count;
+  int switch_targets; // over all switches
+  bool* is_target;
+  struct tr_opt_stats* stats;
+  struct mem_arena* scratch; // everything above is allocated here
+};
+
+int tr_opcode_size(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVAL:
+  case OP_SET_UPVAL:
+  case OP_CLOSURE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_SET_LOCAL_POP:
+  case OP_CONSTANT_RETURN:
+  case OP_CHECK_TYPE:
+    return 2;
+  case OP_JMP:
+  case OP_JMP_FALSE:
+  case OP_LOOP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_PUSH_INT:
+  case OP_IADD_IMM:
+  case OP_ADD_IMM:
+  case OP_ADD_IMM_INT:
+  case OP_GET_LOCAL_GET_LOCAL:
+  case OP_GET_LOCAL_CONSTANT_IADD:
+  case OP_GET_LOCAL_CONSTANT_ISUB:
+  case OP_TABLESWITCH:
+  case OP_LOOKUPSWITCH:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_LOOP_LONG:
+  case OP_JMP_FALSE_LONG:
+  case OP_JMP_LONG:
+  case OP_GET_LOCAL_IADD_IMM:
+  case OP_JMP_IF_GE:
+  case OP_JMP_IF_GT:
+  case OP_JMP_IF_LE:
+  case OP_JMP_IF_LT:
+  case OP_JMP_IF_GE_INT:
+  case OP_JMP_IF_GT_INT:
+  case OP_JMP_IF_LE_INT:
+  case OP_JMP_IF_LT_INT:
+  case OP_JMP_IF_GE_DBL:
+  case OP_JMP_IF_GT_DBL:
+  case OP_JMP_IF_LE_DBL:
+  case OP_JMP_IF_LT_DBL:
+    return 4;
+  case OP_FOR_INC_LT:
+    return 6;
+  case OP_FOR_INC_LT_K:
+    return 7;
+  default:
+    return 1;
+  }
+}
+
+static bool is_switch(uint8_t op) { return op == OP_TABLESWITCH || op == OP_LOOKUPSWITCH; }
+
+static int switch_entries(const uint8_t* code) { return code[1] << 8 | code[2]; }
+
+// Offset of a switch's first jump offset from its opcode.
+static int switch_offsets(const uint8_t* code) {
+  return 3 + 4 * (code[0] == OP_TABLESWITCH ? 1 : switch_entries(code));
+}
+
+int tr_instruction_size(const uint8_t* code) {
+  if (!is_switch(code[0]))
+    return tr_opcode_size(code[0]);
+  return switch_offsets(code) + 3 * (switch_entries(code) + 1);
+}
+
+// Compare-and-branch ops: always 24-bit, and they pop their operands.
+static bool is_branch(uint8_t op) { return op >= OP_JMP_IF_GE && op <= OP_JMP_IF_LT_DBL; }
+
+// Counted loop steps: operands, then a 24-bit offset back to the loop body.
+static bool is_counted(uint8_t op) { return op == OP_FOR_INC_LT || op == OP_FOR_INC_LT_K; }
+
+// Decoded jumps always carry the short opcode; encode picks the width.
+static bool is_jump(uint8_t op) {
+  return op == OP_JMP || op == OP_JMP_FALSE || op == OP_LOOP || is_branch(op) || is_counted(op);
+}
+static bool is_goto(uint8_t op) { return op == OP_JMP || op == OP_LOOP; }
+
+static uint8_t short_jump(uint8_t op) {
+  switch (op) {
+  case OP_JMP_LONG:
+    return OP_JMP;
+  case OP_JMP_FALSE_LONG:
+    return OP_JMP_FALSE;
+  case OP_LOOP_LONG:
+    return OP_LOOP;
+  default:
+    return op;
+  }
+}
+
+static uint8_t long_jump(uint8_t op) {
+  switch (op) {
+  case OP_JMP:
+    return OP_JMP_LONG;
+  case OP_JMP_FALSE:
+    return OP_JMP_FALSE_LONG;
+  default:
+    return OP_LOOP_LONG;
+  }
+}
+
+static int16_t immediate(const struct insn* in) { return (int16_t)(in->args[0] << 8 | in->args[1]); }
+
+// Pushes with no side effects, which a following OP_POP cancels out.
+static bool is_pure_push(uint8_t op) {
+  switch (op) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_PUSH_INT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static int next_live(struct opt* o, int i) {
+  while (i < o->count && !o->code[i].live)
+    i++;
+  return i;
+}
+
+static void kill(struct opt* o, int i) { o->code[i].live = false; }
+
+static bool decode(struct opt* o, struct tr_chunk* chunk) {
+  int* index_of = mem_arena_alloc(o->scratch, sizeof(int) * (chunk->count + 1));
+  for (int i = 0; i <= chunk->count; i++)
+    index_of[i] = -1;
+
+  o->capacity = chunk->count + 1;
+  o->code     = mem_arena_alloc(o->scratch, sizeof(struct insn) * o->capacity);
+  o->count    = 0;
+  for (int off = 0; off < chunk->count; off += tr_instruction_size(&chunk->instructions[off])) {
+    uint8_t op           = chunk->instructions[off];
+    int size             = tr_instruction_size(&chunk->instructions[off]);
+    struct insn* in      = &o->code[o->count];
+    index_of[off]        = o->count++;
+    in->op               = short_jump(op);
+    in->live             = true;
+    in->wide             = false;
+    in->target           = -1;
+    in->line             = chunk->lines[off];
+    in->table            = NULL;
+    in->targets          = NULL;
+    if (is_switch(op)) {
+      int n       = switch_entries(&chunk->instructions[off]) + 1;
+      int at      = off + switch_offsets(&chunk->instructions[off]);
+      in->table   = mem_arena_alloc(o->scratch, size);
+      in->targets = mem_arena_alloc(o->scratch, sizeof(int) * n);
+      memcpy(in->table, &chunk->instructions[off], size);
+      for (int t = 0; t < n; t++, at += 3) {
+        const uint8_t* d = &chunk->instructions[at];
+        in->targets[t]   = off + size + (d[0] << 16 | d[1] << 8 | d[2]);
+      }
+      o->switch_targets += n;
+    }
+    for (int a = 0; a < 3; a++)
+      in->args[a] = a + 1 < size ? chunk->instructions[off + 1 + a] : 0;
+    if (is_jump(in->op)) {
+      int d = 0;
+      for (int a = is_counted(op) ? size - 3 : 1; a < size; a++)
+        d = d << 8 | chunk->instructions[off + a];
+      bool back  = in->op == OP_LOOP || is_counted(op);
+      in->target = back ? off + size - d : off + size + d;
+    }
+  }
+  index_of[chunk->count] = o->count;
+
+  bool ok = true;
+  for (int i = 0; ok && i < o->count; i++) {
+    struct insn* in = &o->code[i];
+    for (int t = 0; in->targets != NULL && t < switch_entries(in->table) + 1; t++) {
+      int to = in->targets[t];
+      if (to > chunk->count || index_of[to] < 0) {
+        ok = false;
+        break;
+      }
+      in->targets[t] = index_of[to];
+    }
+    if (!is_jump(in->op))
+      continue;
+    if (in->target < 0 || in->target > chunk->count || index_of[in->target] < 0) {
+      ok = false; // jump into the middle of an instruction, leave the chunk alone
+      break;
+    }
+    in->target = index_of[in->target];
+  }
+  o->is_target = mem_arena_alloc(o->scratch, sizeof(bool) * o->capacity);
+  return ok;
+}
+
+static void mark_targets(struct opt* o) {
+  memset(o->is_target, 0, sizeof(bool) * (o->count + 1));
+  for (int i = 0; i < o->count; i++) {
+    struct insn* in = &o->code[i];
+    if (in->live && is_jump(in->op)) {
+      in->target                = next_live(o, in->target);
+      o->is_target[in->target] = true;
+    }
+    for (int t = 0; in->live && in->targets != NULL && t < switch_entries(in->table) + 1; t++) {
+      in->targets[t]               = next_live(o, in->targets[t]);
+      o->is_target[in->targets[t]] = true;
+    }
+  }
+}
+
+static bool remove_push_pop(struct opt* o) {
+  bool changed = false;
+  for (int i = next_live(o, 0); i < o->count;) {
+    int j = next_live(o, i + 1);
+    if (j < o->count && is_pure_push(o->code[i].op) && o->code[j].op == OP_POP &&
+        !o->is_target[j]) {
+      kill(o, i);
+      kill(o, j);
+      o->stats->nil_pops++;
+      changed = true;
+      j       = next_live(o, j + 1);
+    }
+    i = j;
+  }
+  return changed;
+}
+
+static bool thread_jumps(struct opt* o) {
+  bool changed = false;
+  for (int i = 0; i < o->count; i++) {
+    struct insn* in = &o->code[i];
+    if (!in->live || !is_jump(in->op))
+      continue;
+    int t = in->target;
+    for (int hops = 0; hops < 16 && t < o->count && is_goto(o->code[t].op); hops++) {
+      int next = next_live(o, o->code[t].target);
+      if (next == t || (is_counted(in->op) ? next > i : !is_goto(in->op) && next <= i))
+        break; // self loop, or a conditional pointing the way it can't encode
+      t = next;
+    }
+    if (t != in->target) {
+      in->target = t;
+      o->stats->jumps_threaded++;
+      changed = true;
+    }
+    if (is_goto(in->op) && t < o->count && o->code[t].op == OP_RETURN) {
+      in->op = OP_RETURN;
+      o->stats->jumps_threaded++;
+      changed = true;
+    } else if (t == next_live(o, i + 1) && !is_branch(in->op) && !is_counted(in->op)) {
+      kill(o, i); // jump to the next instruction
+      o->stats->jumps_threaded++;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static bool collapse_local_reload(struct opt* o) {
+  bool changed = false;
+  for (int i = next_live(o, 0); i < o->count; i = next_live(o, i + 1)) {
+    if (o->code[i].op != OP_SET_LOCAL)
+      continue;
+    int pop = next_live(o, i + 1);
+    if (pop >= o->count || o->code[pop].op != OP_POP || o->is_target[pop])
+      continue;
+    int get = next_live(o, pop + 1);
+    if (get >= o->count || o->code[get].op != OP_GET_LOCAL ||
+        o->code[get].args[0] != o->code[i].args[0] ||
+        o->is_target[get])
+      continue;
+    kill(o, pop);
+    kill(o, get);
+    o->stats->local_reloads++;
+    changed = true;
+  }
+  return changed;
+}
+
+static bool remove_dead(struct opt* o) {
+  bool* reached = mem_arena_alloc(o->scratch, sizeof(bool) * (o->count + 1));
+  int work_size = 2 * (o->count + 1) + o->switch_targets;
+  int* work     = mem_arena_alloc(o->scratch, sizeof(int) * work_size);
+  memset(reached, 0, sizeof(bool) * (o->count + 1));
+  int top     = 0;
+  work[top++] = next_live(o, 0);
+  while (top > 0) {
+    int i = work[--top];
+    if (i >= o->count || reached[i])
+      continue;
+    reached[i]      = true;
+    struct insn* in = &o->code[i];
+    if (is_jump(in->op))
+      work[top++] = in->target;
+    for (int t = 0; in->targets != NULL && t < switch_entries(in->table) + 1; t++)
+      work[top++] = in->targets[t];
+    if (!is_goto(in->op) && !is_switch(in->op) && in->op != OP_RETURN)
+      work[top++] = next_live(o, i + 1);
+  }
+  bool changed = false;
+  for (int i = 0; i < o->count; i++) {
+    if (o->code[i].live && !reached[i]) {
+      kill(o, i);
+      o->stats->dead_ops++;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// OP_PUSH_INT followed by an add or subtract becomes OP_IADD_IMM, or
+// OP_ADD_IMM for the generic ops.
+static void fold_immediates(struct opt* o) {
+  for (int i = next_live(o, 0); i < o->count; i = next_live(o, i + 1)) {
+    struct insn* push = &o->code[i];
+    int j             = next_live(o, i + 1);
+    if (push->op != OP_PUSH_INT || j >= o->count || o->is_target[j])
+      continue;
+    uint8_t next = o->code[j].op;
+    int k        = immediate(push);
+    if ((next == OP_ISUB || next == OP_SUB) && k != INT16_MIN)
+      k = -k;
+    else if (next != OP_IADD && next != OP_ADD)
+      continue;
+    push->op      = next == OP_IADD || next == OP_ISUB ? OP_IADD_IMM : OP_ADD_IMM;
+    push->args[0] = (k >> 8) & 0xff;
+    push->args[1] = k & 0xff;
+    kill(o, j);
+    o->stats->fused++;
+  }
+}
+
+// Matches a fused sequence starting at i; n gets the number of instructions
+// it replaces. Only the first may be a jump target.
+static bool match_super(struct opt* o, int i, uint8_t* op, int* n) {
+  struct insn* a = &o->code[i];
+  int j          = next_live(o, i + 1);
+  if (j >= o->count || o->is_target[j])
+    j = o->count;
+  struct insn* b = j < o->count ? &o->code[j] : NULL;
+  int k          = b != NULL ? next_live(o, j + 1) : o->count;
+  if (k >= o->count || o->is_target[k])
+    k = o->count;
+  struct insn* c = k < o->count ? &o->code[k] : NULL;
+
+  switch (a->op) {
+  case OP_GET_LOCAL:
+    if (b != NULL && b->op == OP_CONSTANT && c != NULL &&
+        (c->op == OP_IADD || c->op == OP_ISUB)) {
+      *op = c->op == OP_IADD ? OP_GET_LOCAL_CONSTANT_IADD : OP_GET_LOCAL_CONSTANT_ISUB;
+      *n  = 3;
+      return true;
+    }
+    if (b != NULL && b->op == OP_GET_LOCAL) {
+      // Leave b alone if it starts a longer sequence of its own.
+      uint8_t next_op;
+      int next_n;
+      if (match_super(o, j, &next_op, &next_n) && next_n == 3)
+        return false;
+      *op = OP_GET_LOCAL_GET_LOCAL;
+      *n  = 2;
+      return true;
+    }
+    if (b != NULL && b->op == OP_IADD_IMM) {
+      *op = OP_GET_LOCAL_IADD_IMM;
+      *n  = 2;
+      return true;
+    }
+    return false;
+  case OP_SET_LOCAL:
+    if (b != NULL && b->op == OP_POP) {
+      *op = OP_SET_LOCAL_POP;
+      *n  = 2;
+      return true;
+    }
+    return false;
+  case OP_CONSTANT:
+    if (b != NULL && b->op == OP_RETURN) {
+      *op = OP_CONSTANT_RETURN;
+      *n  = 2;
+      return true;
+    }
+    return false;
+  case OP_CALL:
+    if (a->args[0] <= 2) {
+      *op = OP_CALL_0 + a->args[0];
+      *n  = 1;
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+static void fuse(struct opt* o) {
+  for (int i = next_live(o, 0); i < o->count; i = next_live(o, i + 1)) {
+    uint8_t op;
+    int n;
+    if (!match_super(o, i, &op, &n))
+      continue;
+    struct insn* first = &o->code[i];
+    int last           = i;
+    int nargs          = tr_opcode_size(first->op) - 1;
+    for (int m = 1; m < n; m++) {
+      last = next_live(o, last + 1);
+      // Operands follow in the order of the instructions that carried them.
+      for (int a = 0; a < tr_opcode_size(o->code[last].op) - 1; a++)
+        first->args[nargs++] = o->code[last].args[a];
+      kill(o, last);
+    }
+    first->op = op;
+    o->stats->fused++;
+  }
+}
+
+static int encoded_size(const struct insn* in) {
+  if (in->table != NULL)
+    return tr_instruction_size(in->table);
+  if (is_jump(in->op) && !is_branch(in->op) && !is_counted(in->op))
+    return in->wide ? 4 : 3;
+  return tr_opcode_size(in->op);
+}
+
+// Lays out the live instructions into offset; dead entries take the offset
+// of the next live one, so targets resolve. Returns the chunk size.
+static int layout(struct opt* o, int* offset) {
+  int off = 0;
+  for (int i = 0; i < o->count; i++) {
+    offset[i] = off;
+    if (o->code[i].live)
+      off += encoded_size(&o->code[i]);
+  }
+  offset[o->count] = off;
+  return off;
+}
+
+static void encode(struct opt* o, struct tr_chunk* chunk) {
+  // Jumps start short and are widened until every offset fits; widening
+  // only lengthens other jumps, so this settles.
+  int* offset = mem_arena_alloc(o->scratch, sizeof(int) * (o->count + 1));
+  int off;
+  bool widened = true;
+  while (widened) {
+    off     = layout(o, offset);
+    widened = false;
+    for (int i = 0; i < o->count; i++) {
+      struct insn* in = &o->code[i];
+      if (!in->live || !is_jump(in->op) || is_branch(in->op) || is_counted(in->op) || in->wide)
+        continue;
+      int d = offset[in->target] - (offset[i] + encoded_size(in));
+      if (d > UINT16_MAX || d < -UINT16_MAX) {
+        in->wide = true;
+        widened  = true;
+      }
+    }
+  }
+  // Threading can stretch a jump past the short range, so the result may
+  // not fit where the input was.
+  if (off > chunk->capacity)
+    tr_chunk_reserve(chunk, off);
+
+  uint8_t* out = chunk->instructions;
+  int* lines   = chunk->lines;
+  for (int i = 0; i < o->count; i++) {
+    struct insn* in = &o->code[i];
+    if (!in->live)
+      continue;
+    int at   = offset[i];
+    int size = encoded_size(in);
+    for (int a = 0; a < size; a++)
+      lines[at + a] = in->line;
+    if (is_jump(in->op)) {
+      int d = offset[in->target] - (at + size);
+      if (is_goto(in->op))
+        in->op = d >= 0 ? OP_JMP : OP_LOOP;
+      if (d < 0)
+        d = -d;
+      out[at]     = in->wide ? long_jump(in->op) : in->op;
+      int operand = is_counted(in->op) ? size - 3 : 1;
+      for (int a = 1; a < operand; a++)
+        out[at + a] = in->args[a - 1];
+      for (int a = size - 1; a >= operand; a--, d >>= 8)
+        out[at + a] = d & 0xff;
+    } else if (in->table != NULL) {
+      int ops = switch_offsets(in->table);
+      memcpy(&out[at], in->table, ops);
+      for (int t = 0; t < switch_entries(in->table) + 1; t++) {
+        int d      = offset[in->targets[t]] - (at + size);
+        uint8_t* w = &out[at + ops + 3 * t];
+        w[0]       = (d >> 16) & 0xff;
+        w[1]       = (d >> 8) & 0xff;
+        w[2]       = d & 0xff;
+      }
+    } else {
+      out[at] = in->op;
+      for (int a = 1; a < size; a++)
+        out[at + a] = in->args[a - 1];
+    }
+  }
+  chunk->count = off;
+}
+
+void tr_opt_chunk(struct tr_chunk* chunk, struct mem_arena* scratch, struct tr_opt_stats* stats) {
+  struct tr_opt_stats unused;
+  memset(&unused, 0, sizeof(unused));
+  struct opt o = {.stats = stats != NULL ? stats : &unused, .scratch = scratch};
+
+  if (decode(&o, chunk)) {
+    int ops_before = o.count;
+    int bytes      = chunk->count;
+    bool changed   = true;
+    for (int round = 0; changed && round < 8; round++) {
+      mark_targets(&o);
+      changed = remove_dead(&o);
+      changed |= remove_push_pop(&o);
+      mark_targets(&o);
+      changed |= thread_jumps(&o);
+      mark_targets(&o);
+      changed |= collapse_local_reload(&o);
+    }
+    mark_targets(&o);
+    fold_immediates(&o);
+    fuse(&o);
+    encode(&o, chunk);
+
+    int ops_after = 0;
+    for (int i = 0; i < o.count; i++)
+      ops_after += o.code[i].live;
+    o.stats->chunks++;
+    o.stats->bytes_before += bytes;
+    o.stats->bytes_removed += bytes - chunk->count;
+    o.stats->ops_before += ops_before;
+    o.stats->ops_removed += ops_before - ops_after;
+  }
+}
+
+// How the instruction at code changes the stack depth, on every path out of it.
+static int stack_effect(const uint8_t* code) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_UPVAL:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_PUSH_INT:
+  case OP_GET_LOCAL_CONSTANT_IADD:
+  case OP_GET_LOCAL_CONSTANT_ISUB:
+  case OP_GET_LOCAL_IADD_IMM:
+  case OP_CONSTANT_RETURN:
+    return 1;
+  case OP_GET_LOCAL_GET_LOCAL:
+    return 2;
+  case OP_RETURN:
+  case OP_POP:
+  case OP_PRINT:
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_LOCAL_POP:
+  case OP_TABLESWITCH:
+  case OP_LOOKUPSWITCH:
+  case OP_EQUAL:
+  case OP_NEQUAL:
+  case OP_LT:
+  case OP_LTEQ:
+  case OP_GT:
+  case OP_GTEQ:
+  case OP_IADD:
+  case OP_ISUB:
+  case OP_IDIV:
+  case OP_IMUL:
+  case OP_FADD:
+  case OP_FSUB:
+  case OP_FDIV:
+  case OP_FMUL:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_DIV:
+  case OP_MUL:
+  case OP_ADD_INT:
+  case OP_SUB_INT:
+  case OP_MUL_INT:
+  case OP_DIV_INT:
+  case OP_ADD_DBL:
+  case OP_SUB_DBL:
+  case OP_MUL_DBL:
+  case OP_DIV_DBL:
+    return -1;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -code[1];
+  case OP_CALL_0:
+  case OP_CALL_1:
+  case OP_CALL_2:
+    return -(code[0] - OP_CALL_0);
+  default:
+    if (is_branch(code[0]))
+      return -2;
+    return 0; // stores, unary ops, immediates, other jumps
+  }
+}
+
+// Stack depth before each reached instruction, by offset; -1 until reached.
+struct depths {
+  int* at;
+  int* work;
+  int top;
+  int count;
+};
+
+static void reach(struct depths* s, int off, int depth) {
+  if (off >= 0 && off < s->count && s->at[off] < 0) {
+    s->at[off]        = depth;
+    s->work[s->top++] = off;
+  }
+}
+
+int tr_chunk_max_stack(const struct tr_chunk* chunk, int entry, struct mem_arena* scratch) {
+  const uint8_t* code = chunk->instructions;
+  struct depths s     = {mem_arena_alloc(scratch, sizeof(int) * (chunk->count + 1)),
+                         mem_arena_alloc(scratch, sizeof(int) * (chunk->count + 1)), 0,
+                         chunk->count};
+  for (int i = 0; i < chunk->count; i++)
+    s.at[i] = -1;
+  int max = entry;
+  // The compiler leaves the same depth on every path into an instruction,
+  // so the first one to reach it is enough.
+  reach(&s, 0, entry);
+  while (s.top > 0) {
+    int off           = s.work[--s.top];
+    const uint8_t* in = &code[off];
+    int size          = tr_instruction_size(in);
+    int depth         = s.at[off] + stack_effect(in);
+    uint8_t op        = short_jump(in[0]);
+    if (depth > max)
+      max = depth;
+    if (is_switch(op)) {
+      const uint8_t* d = in + switch_offsets(in);
+      for (int t = 0; t < switch_entries(in) + 1; t++, d += 3)
+        reach(&s, off + size + (d[0] << 16 | d[1] << 8 | d[2]), depth);
+      continue;
+    }
+    if (op == OP_RETURN || op == OP_CONSTANT_RETURN)
+      continue;
+    if (is_jump(op)) {
+      int d = 0;
+      for (int a = is_counted(op) ? size - 3 : 1; a < size; a++)
+        d = d << 8 | in[a];
+      bool back = op == OP_LOOP || is_counted(op);
+      reach(&s, back ? off + size - d : off + size + d, depth);
+      if (is_goto(op))
+        continue;
+    }
+    reach(&s, off + size, depth);
+  }
+  return max;
+}
+
+void tr_opt_stats_print(const struct tr_opt_stats* s, FILE* fp) {
+  fprintf(fp, "peephole: %d chunks\n", s->chunks);
+  fprintf(fp, "  bytes  %6d -> %6d  (-%d)\n", s->bytes_before, s->bytes_before - s->bytes_removed,
+          s->bytes_removed);
+  fprintf(fp, "  ops    %6d -> %6d  (-%d)\n", s->ops_before, s->ops_before - s->ops_removed,
+          s->ops_removed);
+  fprintf(fp, "  push/pop pairs %d, jumps threaded %d, dead ops %d, local reloads %d\n",
+          s->nil_pops, s->jumps_threaded, s->dead_ops, s->local_reloads);
+  fprintf(fp, "  superinstructions %d\n", s->fused);
+  fprintf(fp, "  calls inlined %d\n", s->inlined);
+}
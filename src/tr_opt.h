@@ -0,0 +1,44 @@
+#ifndef tr_opt_h
+#define tr_opt_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct tr_chunk;
+struct mem_arena;
+
+// Counters for one or more tr_opt_chunk runs; zero it before the first.
+struct tr_opt_stats {
+  int chunks;
+  int bytes_before;
+  int bytes_removed;
+  int ops_before;
+  int ops_removed;
+
+  int nil_pops;       // push/OP_POP pairs removed
+  int jumps_threaded; // jumps retargeted past other jumps or into returns
+  int dead_ops;       // unreachable instructions dropped
+  int local_reloads;  // OP_SET_LOCAL/OP_POP/OP_GET_LOCAL collapsed
+  int fused;          // superinstructions emitted
+  int inlined;        // calls inlined by the parser
+};
+
+// Size in bytes of the instruction starting with opcode op; for switches only
+// the opcode and entry count, see tr_instruction_size.
+int tr_opcode_size(uint8_t op);
+
+// Size in bytes of the instruction at code, switch tables included.
+int tr_instruction_size(const uint8_t* code);
+
+// Most stack slots a call to chunk's function uses above its frame base, given
+// entry slots (the callee and its arguments) on entry. Working memory comes
+// from scratch, as for tr_opt_chunk.
+int tr_chunk_max_stack(const struct tr_chunk* chunk, int entry, struct mem_arena* scratch);
+
+// Peephole optimizes a finished chunk in place. stats may be NULL. Working
+// memory comes from scratch and is left there for the caller to free, which
+// also reclaims it when an allocation failure abandons the pass.
+void tr_opt_chunk(struct tr_chunk* chunk, struct mem_arena* scratch, struct tr_opt_stats* stats);
+void tr_opt_stats_print(const struct tr_opt_stats* stats, FILE* fp);
+
+#endif // tr_opt_h
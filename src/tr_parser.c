@@ -5,8 +5,12 @@
 #include "tr_opcode.h"
 #include "tr_value.h"
 #include "tr_vm.h"
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 enum {
@@ -27,10 +31,11 @@ struct type_mapping {
   const char* name;
   int type;
 } internal_types[] = {
-    {"int",    VAL_LNG},
-    {"double", VAL_DBL},
-    {"string", VAL_STR},
-    {NULL,     0      }
+    {"int",    VAL_LNG },
+    {"double", VAL_DBL },
+    {"string", VAL_STR },
+    {"bool",   VAL_BOOL},
+    {NULL,     0       }
 };
 
 typedef void (*parse_fn)(struct tr_parser* p, bool canAssign);
@@ -62,27 +67,218 @@ static void error_current(struct tr_parser* p, const char* message) {
 }
 static void error(struct tr_parser* p, const char* message) { error_at(p, &p->previous, message); }
 
+// The declared type named by t, or VAL_ANY if it is not a type name.
+static int type_named(struct tr_token* t) {
+  for (struct type_mapping* m = internal_types; m->name != NULL; m++) {
+    if (t->type == TOKEN_IDENT && (int)strlen(m->name) == t->length &&
+        memcmp(m->name, t->start, t->length) == 0)
+      return m->type;
+  }
+  return VAL_ANY;
+}
+
+static bool is_number_type(int type) { return type == VAL_LNG || type == VAL_DBL; }
+
 static void emit_opcode(struct tr_parser* p, uint8_t opcode) {
-  tr_chunk_add(&p->compiler->function->chunk, opcode);
+  tr_chunk_add(&p->compiler->function->chunk, opcode, p->previous.line);
 }
 
-static int emit_constant(struct tr_parser* p, struct tr_value val) {
-  int id = tr_constants_add(&p->compiler->function->chunk.constants, val);
-  if (id > UINT8_MAX) {
+// Emits op with a one byte operand, or long_op with a 24-bit one when arg does
+// not fit.
+static void emit_indexed(struct tr_parser* p, uint8_t op, uint8_t long_op, int arg) {
+  if (arg <= UINT8_MAX) {
+    emit_opcode(p, op);
+    emit_opcode(p, arg);
+    return;
+  }
+  emit_opcode(p, long_op);
+  emit_opcode(p, (arg >> 16) & 0xff);
+  emit_opcode(p, (arg >> 8) & 0xff);
+  emit_opcode(p, arg & 0xff);
+}
+
+static int check_constant(struct tr_parser* p, int id) {
+  if (id >= CONSTANTS_MAX) {
     error(p, "Too many constants in one chunk (function, etc.)");
     id = 0;
   }
-  emit_opcode(p, OP_CONSTANT);
-  emit_opcode(p, id);
   return id;
 }
 
-static void advance(struct tr_parser* p) {
-  if (p->preprevious.start != NULL) {
-    mem_free(p->preprevious.start);
+static int emit_constant(struct tr_parser* p, struct tr_value val) {
+  struct tr_compiler* c     = p->compiler;
+  struct tr_constants* pool = &c->function->chunk.constants;
+  bool fresh;
+  int id          = check_constant(p, tr_constants_add_unique(pool, &c->constants, val, &fresh));
+  c->last_literal = (struct tr_literal){c->function->chunk.count, fresh};
+  emit_indexed(p, OP_CONSTANT, OP_CONSTANT_LONG, id);
+  return id;
+}
+
+static bool is_small_int(struct tr_value val) {
+  return IS_LNG(val) && AS_LNG(val) >= INT16_MIN && AS_LNG(val) <= INT16_MAX;
+}
+
+// Booleans and small integers are pushed as immediates, anything else
+// through the constant pool.
+static void emit_literal(struct tr_parser* p, struct tr_value val) {
+  struct tr_compiler* c = p->compiler;
+  p->expr_type          = tr_value_type(val);
+  if (IS_BOOL(val)) {
+    c->last_literal = (struct tr_literal){c->function->chunk.count, false};
+    emit_opcode(p, AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+  } else if (is_small_int(val)) {
+    c->last_literal = (struct tr_literal){c->function->chunk.count, false};
+    emit_opcode(p, OP_PUSH_INT);
+    emit_opcode(p, (AS_LNG(val) >> 8) & 0xff);
+    emit_opcode(p, AS_LNG(val) & 0xff);
+  } else {
+    emit_constant(p, val);
   }
-  p->preprevious = p->previous;
-  p->previous    = p->current;
+}
+
+// Pool index of the OP_CONSTANT/OP_CONSTANT_LONG at offset, or -1.
+static int constant_at(struct tr_chunk* chunk, int offset) {
+  uint8_t* code = &chunk->instructions[offset];
+  switch (code[0]) {
+  case OP_CONSTANT:
+    return code[1];
+  case OP_CONSTANT_LONG:
+    return code[1] << 16 | code[2] << 8 | code[3];
+  default:
+    return -1;
+  }
+}
+
+// Reads back the literal pushed at offset, provided it is the last thing in the
+// chunk and no jump lands after its start (it is a complete operand).
+static bool literal_at(struct tr_parser* p, int offset, struct tr_value* out) {
+  struct tr_compiler* c  = p->compiler;
+  struct tr_chunk* chunk = &c->function->chunk;
+  if (offset < 0 || offset != c->last_literal.offset || c->last_target > offset)
+    return false;
+  uint8_t op = chunk->instructions[offset];
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    if (offset + tr_opcode_size(op) != chunk->count)
+      return false;
+    *out = chunk->constants.values[constant_at(chunk, offset)];
+    return IS_LNG(*out) || IS_DBL(*out) || IS_BOOL(*out);
+  case OP_PUSH_INT:
+    if (offset + 3 != chunk->count)
+      return false;
+    *out = INT_VALUE((int16_t)(chunk->instructions[offset + 1] << 8 |
+                               chunk->instructions[offset + 2]));
+    return true;
+  case OP_TRUE:
+  case OP_FALSE:
+    if (offset + 1 != chunk->count)
+      return false;
+    *out = BOOL_VALUE(chunk->instructions[offset] == OP_TRUE);
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Gives back a pool slot that was added only for a literal being folded away.
+static void discard_literal(struct tr_parser* p, struct tr_literal lit) {
+  struct tr_chunk* chunk = &p->compiler->function->chunk;
+  if (lit.fresh && constant_at(chunk, lit.offset) == chunk->constants.count - 1) {
+    chunk->constants.count--;
+  }
+}
+
+static bool fold_unary(token_type op, struct tr_value v, struct tr_value* out) {
+  switch (op) {
+  case TOKEN_EXCL:
+    *out = BOOL_VALUE(tr_value_is_falsey(v));
+    return true;
+  case TOKEN_MINUS:
+    if (IS_LNG(v)) {
+      long l;
+      if (!tr_lng_neg(AS_LNG(v), &l))
+        return false; // leave it to fail at runtime
+      *out = INT_VALUE(l);
+      return true;
+    }
+    if (IS_DBL(v)) {
+      *out = DOUBLE_VALUE(-AS_DBL(v));
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+static bool fold_binary(token_type op, struct tr_value a, struct tr_value b,
+                        struct tr_value* out) {
+  if (IS_BOOL(a) || IS_BOOL(b)) {
+    if (tr_value_type(a) != tr_value_type(b))
+      return false;
+    switch (op) {
+    case TOKEN_EQ:
+      *out = BOOL_VALUE(AS_BOOL(a) == AS_BOOL(b));
+      return true;
+    case TOKEN_NE:
+      *out = BOOL_VALUE(AS_BOOL(a) != AS_BOOL(b));
+      return true;
+    default:
+      return false;
+    }
+  }
+  if (IS_LNG(a) && IS_LNG(b)) {
+    long l = AS_LNG(a), r = AS_LNG(b), res;
+    bool ok;
+    switch (op) {
+    // clang-format off
+    case TOKEN_PLUS:  ok = tr_lng_add(l, r, &res); break;
+    case TOKEN_MINUS: ok = tr_lng_sub(l, r, &res); break;
+    case TOKEN_STAR:  ok = tr_lng_mul(l, r, &res); break;
+    case TOKEN_SLASH:
+      ok = r != 0 && !(l == LONG_MIN && r == -1) && tr_lng_div(l, r, &res);
+      break;
+    case TOKEN_EQ:   *out = BOOL_VALUE(l == r); return true;
+    case TOKEN_NE:   *out = BOOL_VALUE(l != r); return true;
+    case TOKEN_LT:   *out = BOOL_VALUE(l < r);  return true;
+    case TOKEN_LTEQ: *out = BOOL_VALUE(l <= r); return true;
+    case TOKEN_GT:   *out = BOOL_VALUE(l > r);  return true;
+    case TOKEN_GTEQ: *out = BOOL_VALUE(l >= r); return true;
+    // clang-format on
+    default:
+      return false;
+    }
+    if (!ok)
+      return false; // leave it to fail at runtime
+    *out = INT_VALUE(res);
+    return true;
+  }
+  if ((op == TOKEN_EQ || op == TOKEN_NE) && tr_value_type(a) != tr_value_type(b))
+    return false;
+  double x = IS_LNG(a) ? (double)AS_LNG(a) : AS_DBL(a);
+  double y = IS_LNG(b) ? (double)AS_LNG(b) : AS_DBL(b);
+  switch (op) {
+  // clang-format off
+  case TOKEN_PLUS:  *out = DOUBLE_VALUE(x + y); return true;
+  case TOKEN_MINUS: *out = DOUBLE_VALUE(x - y); return true;
+  case TOKEN_STAR:  *out = DOUBLE_VALUE(x * y); return true;
+  case TOKEN_SLASH: *out = DOUBLE_VALUE(x / y); return true;
+  case TOKEN_EQ:    *out = BOOL_VALUE(x == y);  return true;
+  case TOKEN_NE:    *out = BOOL_VALUE(x != y);  return true;
+  case TOKEN_LT:    *out = BOOL_VALUE(x < y);   return true;
+  case TOKEN_LTEQ:  *out = BOOL_VALUE(x <= y);  return true;
+  case TOKEN_GT:    *out = BOOL_VALUE(x > y);   return true;
+  case TOKEN_GTEQ:  *out = BOOL_VALUE(x >= y);  return true;
+  // clang-format on
+  default:
+    return false;
+  }
+}
+
+static void advance(struct tr_parser* p) {
+  p->previous = p->current;
   for (;;) {
     p->current = tr_lexer_next_token(p->lexer);
     if (p->current.type != TOKEN_ERR)
@@ -111,12 +307,19 @@ static void statement(struct tr_parser* p);
 static void declaration(struct tr_parser* p);
 
 void number(struct tr_parser* p, bool canAssign) {
+  // Tokens aren't terminated, copy the digits out before strtod/strtol.
+  char* buf = mem_arena_strndup(&p->arena, p->previous.start, p->previous.length);
   if (p->previous.type == TOKEN_NUMBER) { // Decimal means floating points!!
-    double val = strtod(p->previous.start, NULL);
-    emit_constant(p, (struct tr_value){.type = VAL_DBL, .d = val});
+    double val = strtod(buf, NULL);
+    emit_literal(p, DOUBLE_VALUE(val));
   } else if (p->previous.type == TOKEN_INT) {
-    long val = strtol(p->previous.start, NULL, 0);
-    emit_constant(p, (struct tr_value){.type = VAL_LNG, .l = val});
+    errno    = 0;
+    long val = strtol(buf, NULL, 0);
+    if (errno == ERANGE || !TR_LNG_FITS(val)) {
+      error(p, "Integer literal out of range.");
+      return;
+    }
+    emit_literal(p, INT_VALUE(val));
   }
 }
 
@@ -129,7 +332,7 @@ static void precedence(struct tr_parser* p, int prec) {
   }
   bool canAssign = prec <= PREC_ASSIGN;
   prefixR(p, canAssign);
-  while (prec < tr_parser_get_rule(p->current.type)->precedence) {
+  while (prec <= tr_parser_get_rule(p->current.type)->precedence) {
     advance(p);
     parse_fn infixR = tr_parser_get_rule(p->previous.type)->infix;
     infixR(p, canAssign);
@@ -143,26 +346,89 @@ static void expression(struct tr_parser* p) { precedence(p, PREC_ASSIGN); }
 
 static void unary(struct tr_parser* p, bool canAssign) {
   token_type type = p->previous.type;
+  int operand     = p->compiler->function->chunk.count;
   precedence(p, PREC_UNARY);
+  struct tr_value v, folded;
+  if (literal_at(p, operand, &v) && fold_unary(type, v, &folded)) {
+    discard_literal(p, p->compiler->last_literal);
+    p->compiler->function->chunk.count = operand;
+    emit_literal(p, folded);
+    return;
+  }
   switch (type) {
   case TOKEN_EXCL:
     emit_opcode(p, OP_NOT);
+    p->expr_type = VAL_BOOL;
     break;
   case TOKEN_MINUS:
     emit_opcode(p, OP_NEGATE);
+    if (!is_number_type(p->expr_type))
+      p->expr_type = VAL_ANY;
     break;
   default:
     return;
   }
 }
 
-// TODO: Determine floating point on right hand side ?
+// Emits an instruction making the value on top of the stack, of static type
+// p->expr_type, fit a slot declared as type: nothing if it already does, a
+// runtime check (which also widens ints to doubles) if it might.
+static void coerce(struct tr_parser* p, int type) {
+  int from = p->expr_type;
+  if (type == VAL_ANY || from == type)
+    return;
+  struct tr_value v;
+  struct tr_literal lit = p->compiler->last_literal;
+  if (type == VAL_DBL && from == VAL_LNG && literal_at(p, lit.offset, &v) && IS_LNG(v)) {
+    discard_literal(p, lit);
+    p->compiler->function->chunk.count = lit.offset;
+    emit_literal(p, DOUBLE_VALUE((double)AS_LNG(v)));
+    return;
+  }
+  if (from != VAL_ANY && !(type == VAL_DBL && from == VAL_LNG)) {
+    error(p, "Type mismatch.");
+    return;
+  }
+  emit_opcode(p, OP_CHECK_TYPE);
+  emit_opcode(p, type);
+  p->expr_type = type;
+}
+
+// Arithmetic is specialized when both operand types are known: int op int
+// and double op double directly, double op int after widening the right
+// operand. Everything else goes through the generic, checked op.
+static void arithmetic(struct tr_parser* p, int lhs, uint8_t int_op, uint8_t dbl_op,
+                       uint8_t any_op) {
+  int rhs = p->expr_type;
+  if (lhs == VAL_LNG && rhs == VAL_LNG) {
+    emit_opcode(p, int_op);
+  } else if (lhs == VAL_DBL && is_number_type(rhs)) {
+    coerce(p, VAL_DBL);
+    emit_opcode(p, dbl_op);
+  } else {
+    emit_opcode(p, any_op);
+    p->expr_type = is_number_type(lhs) && is_number_type(rhs) ? VAL_DBL : VAL_ANY;
+    return;
+  }
+  p->expr_type = lhs;
+}
+
 static void binary(struct tr_parser* p, bool canAssign) {
-  token_type left_hand       = p->preprevious.type;
   token_type type            = p->previous.type;
   struct tr_parse_rule* rule = tr_parser_get_rule(type);
+  struct tr_literal lhs      = p->compiler->last_literal;
+  int lhs_type               = p->expr_type;
+  struct tr_value a, b, folded;
+  bool lhs_literal = literal_at(p, lhs.offset, &a);
+  int rhs          = p->compiler->function->chunk.count;
   precedence(p, rule->precedence + 1);
-  bool floating = p->previous.type == TOKEN_NUMBER || left_hand == TOKEN_NUMBER;
+  if (lhs_literal && literal_at(p, rhs, &b) && fold_binary(type, a, b, &folded)) {
+    discard_literal(p, p->compiler->last_literal);
+    discard_literal(p, lhs);
+    p->compiler->function->chunk.count = lhs.offset;
+    emit_literal(p, folded);
+    return;
+  }
   switch (type) {
   case TOKEN_EQ:
     emit_opcode(p, OP_EQUAL);
@@ -171,32 +437,35 @@ static void binary(struct tr_parser* p, bool canAssign) {
     emit_opcode(p, OP_NEQUAL);
     break;
   case TOKEN_GT:
-    emit_opcode(p, OP_GT);
-    break;
   case TOKEN_GTEQ:
-    emit_opcode(p, OP_GTEQ);
-    break;
   case TOKEN_LT:
-    emit_opcode(p, OP_LT);
-    break;
-  case TOKEN_LTEQ:
-    emit_opcode(p, OP_LTEQ);
+  case TOKEN_LTEQ: {
+    int rhs_type = p->expr_type;
+    p->compiler->last_compare =
+        (struct tr_compare){p->compiler->function->chunk.count,
+                            lhs_type == rhs_type && is_number_type(lhs_type) ? lhs_type : VAL_ANY};
+    emit_opcode(p, type == TOKEN_GT     ? OP_GT
+                   : type == TOKEN_GTEQ ? OP_GTEQ
+                   : type == TOKEN_LT   ? OP_LT
+                                        : OP_LTEQ);
     break;
+  }
   case TOKEN_PLUS:
-    emit_opcode(p, floating ? OP_FADD : OP_IADD);
-    break;
+    arithmetic(p, lhs_type, OP_IADD, OP_FADD, OP_ADD);
+    return;
   case TOKEN_MINUS:
-    emit_opcode(p, floating ? OP_FSUB : OP_ISUB);
-    break;
+    arithmetic(p, lhs_type, OP_ISUB, OP_FSUB, OP_SUB);
+    return;
   case TOKEN_STAR:
-    emit_opcode(p, floating ? OP_FMUL : OP_IMUL);
-    break;
+    arithmetic(p, lhs_type, OP_IMUL, OP_FMUL, OP_MUL);
+    return;
   case TOKEN_SLASH:
-    emit_opcode(p, floating ? OP_FDIV : OP_IDIV);
-    break;
+    arithmetic(p, lhs_type, OP_IDIV, OP_FDIV, OP_DIV);
+    return;
   default:
     return;
   }
+  p->expr_type = VAL_BOOL;
 }
 
 static void grouping(struct tr_parser* p, bool canAssign) {
@@ -205,18 +474,18 @@ static void grouping(struct tr_parser* p, bool canAssign) {
 }
 
 static void string(struct tr_parser* p, bool canAssign) {
-  struct tr_string s;
-  tr_string_ncpy(&s, p->previous.start + 1, p->previous.length - 2);
-  emit_constant(p, (struct tr_value){.type = VAL_STR, .s = s});
+  struct tr_string* s = tr_vm_intern(p->vm, p->previous.start + 1, p->previous.length - 2);
+  emit_constant(p, STR_VALUE(s));
+  p->expr_type = VAL_STR;
 }
 
 static void literal(struct tr_parser* p, bool canAssign) {
   switch (p->previous.type) {
   case TOKEN_FALSE:
-    emit_opcode(p, OP_FALSE);
+    emit_literal(p, BOOL_VALUE(false));
     break;
   case TOKEN_TRUE:
-    emit_opcode(p, OP_TRUE);
+    emit_literal(p, BOOL_VALUE(true));
     break;
   default:
     return;
@@ -235,6 +504,7 @@ static void synchronize(struct tr_parser* p) {
     case TOKEN_FOR:
     case TOKEN_IF:
     case TOKEN_WHILE:
+    case TOKEN_SWITCH:
     case TOKEN_RETURN:
       return;
     default:;
@@ -249,26 +519,71 @@ static void expression_statement(struct tr_parser* p) {
   emit_opcode(p, OP_POP);
 }
 
-static uint8_t ident_constant(struct tr_parser* p, struct tr_token* name) {
-  struct tr_string s;
-  tr_string_ncpy(&s, name->start, name->length);
-  int id = tr_constants_add(&p->compiler->function->chunk.constants,
-                            (struct tr_value){.type = VAL_STR, .s = s});
-  if (id > UINT8_MAX) {
-    error(p, "Too many constants in one chunk (function, etc.)");
-    id = 0;
+static int global_slot(struct tr_parser* p, struct tr_token* name) {
+  int slot = tr_vm_global_slot(p->vm, tr_vm_intern(p->vm, name->start, name->length));
+  if (slot < 0) {
+    error(p, "Too many global variables.");
+    slot = 0;
   }
-  return id;
+  return slot;
+}
+
+// Emits a global access, in the 24-bit form when slot needs it.
+static void emit_global(struct tr_parser* p, uint8_t op, int slot) {
+  static const uint8_t long_op[] = {
+      [OP_DEFINE_GLOBAL] = OP_DEFINE_GLOBAL_LONG,
+      [OP_GET_GLOBAL]    = OP_GET_GLOBAL_LONG,
+      [OP_SET_GLOBAL]    = OP_SET_GLOBAL_LONG,
+  };
+  if (slot <= UINT16_MAX) {
+    emit_opcode(p, op);
+  } else {
+    emit_opcode(p, long_op[op]);
+    emit_opcode(p, (slot >> 16) & 0xff);
+  }
+  emit_opcode(p, (slot >> 8) & 0xff);
+  emit_opcode(p, slot & 0xff);
+}
+
+static void emit_local(struct tr_parser* p, uint8_t op, int slot) {
+  if (slot <= UINT8_MAX) {
+    emit_opcode(p, op);
+    emit_opcode(p, slot);
+    return;
+  }
+  emit_opcode(p, op == OP_GET_LOCAL ? OP_GET_LOCAL_LONG : OP_SET_LOCAL_LONG);
+  emit_opcode(p, (slot >> 8) & 0xff);
+  emit_opcode(p, slot & 0xff);
+}
+
+static struct tr_local* push_local(struct tr_parser* p) {
+  struct tr_compiler* c = p->compiler;
+  if (c->local_count == c->local_capacity) {
+    // Arena memory is not freed one block at a time; the old array stays
+    // until the parser is released.
+    int capacity             = c->local_capacity == 0 ? 16 : c->local_capacity * 2;
+    struct tr_local* locals  = mem_arena_alloc(&p->arena, sizeof(*locals) * capacity);
+    if (c->local_count > 0)
+      memcpy(locals, c->locals, sizeof(*locals) * c->local_count);
+    c->locals         = locals;
+    c->local_capacity = capacity;
+  }
+  if (c->local_count + 1 > c->function->max_locals)
+    c->function->max_locals = c->local_count + 1;
+  return &c->locals[c->local_count++];
 }
 
 static void add_local(struct tr_parser* p, struct tr_token name) {
-  if (p->compiler->local_count == UINT8_MAX + 1) {
+  if (p->compiler->local_count == LOCALS_MAX) {
     error(p, "Too many local variables in function.");
     return;
   }
-  struct tr_local* local = &p->compiler->locals[p->compiler->local_count++];
-  local->name            = tr_token_cpy(name);
+  struct tr_local* local = push_local(p);
+  local->name            = name;
+  local->name.start      = mem_arena_strndup(&p->arena, name.start, name.length);
   local->depth           = -1;
+  local->is_captured     = false;
+  local->type            = VAL_ANY;
 }
 
 static bool identifier_equals(struct tr_token* a, struct tr_token* b) {
@@ -300,25 +615,31 @@ static void declare_variable(struct tr_parser* p) {
   add_local(p, *name);
 }
 
-static uint8_t parse_variable(struct tr_parser* p, const char* err) {
+// Declares the variable named by the next token, with static type type
+// (VAL_ANY for var). Returns its global slot, or 0 for a local.
+static int parse_variable(struct tr_parser* p, const char* err, int type) {
   consume(p, TOKEN_IDENT, err);
   declare_variable(p);
-  if (p->compiler->scope_depth > 0)
+  if (p->compiler->scope_depth > 0) {
+    if (!p->panicking)
+      p->compiler->locals[p->compiler->local_count - 1].type = type;
     return 0;
-  return ident_constant(p, &p->previous);
+  }
+  struct tr_string* name = tr_vm_intern(p->vm, p->previous.start, p->previous.length);
+  tr_table_insert(&p->global_types, name, INT_VALUE(type));
+  return global_slot(p, &p->previous);
 }
 
-static void define_global(struct tr_parser* p, uint8_t global) {
+static void define_global(struct tr_parser* p, int global) {
   if (p->compiler->scope_depth > 0) {
     mark_initialized(p);
     return;
   }
-  emit_opcode(p, OP_DEFINE_GLOBAL);
-  emit_opcode(p, global);
+  emit_global(p, OP_DEFINE_GLOBAL, global);
 }
 
 static void var_declaration(struct tr_parser* p) {
-  uint8_t global = parse_variable(p, "Expected a variable name.");
+  int global = parse_variable(p, "Expected a variable name.", VAL_ANY);
   if (match(p, TOKEN_ASSIGN)) {
     expression(p);
   } else {
@@ -328,6 +649,25 @@ static void var_declaration(struct tr_parser* p) {
   define_global(p, global);
 }
 
+// "int a = 1;": the initializer, and every later assignment, must fit the
+// type. Without an initializer the variable starts at the type's zero.
+static void typed_declaration(struct tr_parser* p) {
+  int type   = type_named(&p->previous);
+  int global = parse_variable(p, "Expected a variable name.", type);
+  if (match(p, TOKEN_ASSIGN)) {
+    expression(p);
+    coerce(p, type);
+  } else if (type == VAL_STR) {
+    emit_constant(p, STR_VALUE(tr_vm_intern(p->vm, "", 0)));
+  } else {
+    emit_literal(p, type == VAL_LNG    ? INT_VALUE(0)
+                    : type == VAL_DBL ? DOUBLE_VALUE(0.0)
+                                      : BOOL_VALUE(false));
+  }
+  consume(p, TOKEN_SEMICOLON, "Expected ';' after variable declaration");
+  define_global(p, global);
+}
+
 static int resolve_local_up(struct tr_parser* p, struct tr_compiler* c, struct tr_token* name) {
   for (int i = c->local_count - 1; i >= 0; i--) {
     struct tr_local* local = &c->locals[i];
@@ -359,6 +699,10 @@ static int resolve_upvalue(struct tr_parser* p, struct tr_token* name) {
   if (p->compiler->enclosing == NULL)
     return -1;
   int local = resolve_local_up(p, p->compiler->enclosing, name);
+  if (local > UINT8_MAX) {
+    error(p, "Can't capture a local past the first 256.");
+    return -1;
+  }
   if (local != -1) {
     return add_upvalue(p->compiler, (uint8_t)local, true);
   }
@@ -367,86 +711,139 @@ static int resolve_upvalue(struct tr_parser* p, struct tr_token* name) {
 
 static void variable(struct tr_parser* p, bool canAssign) {
   uint8_t get_op, set_op;
-  int arg = resolve_local(p, &p->previous);
+  // Only locals are typed when read: globals can also be written by code
+  // compiled before their declaration, or from C.
+  int type = VAL_ANY, declared = VAL_ANY;
+  int inline_fn = -1;
+  int arg       = resolve_local(p, &p->previous);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
+    declared = p->compiler->locals[arg].type;
+    type     = declared;
   } else if ((arg = resolve_upvalue(p, &p->previous)) != -1) {
     get_op = OP_GET_UPVAL;
     set_op = OP_SET_UPVAL;
   } else {
-    arg    = ident_constant(p, &p->previous);
+    struct tr_string* name = tr_vm_intern(p->vm, p->previous.start, p->previous.length);
+    struct tr_value t;
+    if (tr_table_get(&p->global_types, name, &t))
+      declared = (int)AS_LNG(t);
+    if (tr_table_get(&p->inlines, name, &t) && IS_LNG(t))
+      inline_fn = (int)AS_LNG(t);
+    arg    = global_slot(p, &p->previous);
     get_op = OP_GET_GLOBAL;
     set_op = OP_SET_GLOBAL;
   }
+  uint8_t op = get_op;
   if (canAssign && match(p, TOKEN_ASSIGN)) {
     expression(p);
-    emit_opcode(p, set_op);
+    coerce(p, declared);
+    type = p->expr_type;
+    op   = set_op;
+  }
+  p->expr_type = type;
+  if (get_op == OP_GET_GLOBAL) {
+    struct tr_compiler* c = p->compiler;
+    c->inline_at          = op == get_op && inline_fn >= 0 ? c->function->chunk.count : -1;
+    c->inline_fn          = inline_fn;
+    emit_global(p, op, arg);
+  } else if (get_op == OP_GET_LOCAL) {
+    emit_local(p, op, arg);
   } else {
-    emit_opcode(p, get_op);
-  }
-  emit_opcode(p, arg);
-}
-
-// static void typed_declaration(struct tr_parser* p) {
-//   char* type_name        = mem_strndup(p->previous.start, p->previous.length);
-//   struct type_mapping* m = internal_types;
-//   while (m->name != NULL) {
-//     if (strcmp(m->name, type_name) == 0) {
-//       break;
-//     }
-//     m++;
-//   }
-//   if (m->name == NULL) {
-//     error(p, "Type not found.");
-//   }
-//   uint8_t local = parse_variable(p, "Expected a variable name");
-//   if (match(p, TOKEN_ASSIGN)) {
-//     expression(p);
-//   } else {
-//     emit_opcode(p, OP_NIL);
-//   }
-//   consume(p, TOKEN_SEMICOLON, "Expected ';' after variable declaration");
-//   emit_opcode(p, OP_DEFINE_GLOBAL);
-//   emit_opcode(p, local);
-// }
+    emit_opcode(p, op);
+    emit_opcode(p, arg);
+  }
+}
+
+#define JUMP_MAX 0xffffff
 
 static void patch_jump(struct tr_parser* p, int jump) {
-  int j = p->compiler->function->chunk.count - jump - 2;
-  if (j > UINT16_MAX) {
+  struct tr_chunk* chunk = &p->compiler->function->chunk;
+  int j                  = chunk->count - jump - 3;
+  if (j > JUMP_MAX) {
     error(p, "Too much code to jump");
   }
-  p->compiler->function->chunk.instructions[jump]     = (j >> 8) & 0xff;
-  p->compiler->function->chunk.instructions[jump + 1] = j & 0xff;
+  chunk->instructions[jump]     = (j >> 16) & 0xff;
+  chunk->instructions[jump + 1] = (j >> 8) & 0xff;
+  chunk->instructions[jump + 2] = j & 0xff;
+  p->compiler->last_target      = chunk->count;
 }
 
+// Forward jumps don't know their distance yet, so they take the 24-bit form
+// (OP_JMP_LONG, OP_JMP_FALSE_LONG); tr_opt_chunk narrows the ones that fit.
 static int emit_jump(struct tr_parser* p, int opcode) {
   emit_opcode(p, opcode);
   emit_opcode(p, 0xff);
   emit_opcode(p, 0xff);
-  return p->compiler->function->chunk.count - 2;
+  emit_opcode(p, 0xff);
+  return p->compiler->function->chunk.count - 3;
+}
+
+// Emits the jump taken when the condition just compiled is false. A
+// comparison ending the condition fuses with it into a compare-and-branch
+// that consumes the operands (*fused); otherwise the condition stays on the
+// stack and the caller pops it on both paths.
+static int emit_condition_jump(struct tr_parser* p, bool* fused) {
+  struct tr_compiler* c  = p->compiler;
+  struct tr_chunk* chunk = &c->function->chunk;
+  struct tr_compare cmp  = c->last_compare;
+  *fused = cmp.offset >= 0 && cmp.offset == chunk->count - 1 && c->last_target <= cmp.offset;
+  if (!*fused)
+    return emit_jump(p, OP_JMP_FALSE_LONG);
+  // Each family lists GE, GT, LE, LT; "a < b" jumps out if a >= b, etc.
+  int rel;
+  switch (chunk->instructions[cmp.offset]) {
+  case OP_LT:
+    rel = 0;
+    break;
+  case OP_LTEQ:
+    rel = 1;
+    break;
+  case OP_GT:
+    rel = 2;
+    break;
+  default:
+    rel = 3;
+    break;
+  }
+  uint8_t base = cmp.type == VAL_LNG   ? OP_JMP_IF_GE_INT
+                 : cmp.type == VAL_DBL ? OP_JMP_IF_GE_DBL
+                                       : OP_JMP_IF_GE;
+  chunk->count    = cmp.offset;
+  c->last_compare = (struct tr_compare){-1, VAL_ANY};
+  return emit_jump(p, base + rel);
 }
 
 static void if_statement(struct tr_parser* p) {
   consume(p, TOKEN_L_PAREN, "Expected '(' after if.");
   expression(p);
   consume(p, TOKEN_R_PAREN, "Expected ')' after condition");
-  int jump = emit_jump(p, OP_JMP_FALSE);
-  emit_opcode(p, OP_POP);
+  bool fused;
+  int jump = emit_condition_jump(p, &fused);
+  if (!fused)
+    emit_opcode(p, OP_POP);
   statement(p);
-  int else_jump = emit_jump(p, OP_JMP);
+  int else_jump = emit_jump(p, OP_JMP_LONG);
   patch_jump(p, jump);
-  emit_opcode(p, OP_POP);
+  if (!fused)
+    emit_opcode(p, OP_POP);
   if (match(p, TOKEN_ELSE))
     statement(p);
   patch_jump(p, else_jump);
 }
 
 static void emit_loop(struct tr_parser* p, int loop_start) {
-  emit_opcode(p, OP_LOOP);
-  int offset = p->compiler->function->chunk.count - loop_start + 2;
-  if (offset > UINT16_MAX)
-    error(p, "loop body too large.");
+  int offset = p->compiler->function->chunk.count - loop_start + 3;
+  if (offset <= UINT16_MAX) {
+    emit_opcode(p, OP_LOOP);
+  } else {
+    offset++;
+    if (offset > JUMP_MAX)
+      error(p, "loop body too large.");
+    emit_opcode(p, OP_LOOP_LONG);
+    emit_opcode(p, (offset >> 16) & 0xFF);
+  }
   emit_opcode(p, (offset >> 8) & 0xFF);
   emit_opcode(p, offset & 0xFF);
 }
@@ -456,24 +853,180 @@ static void while_statement(struct tr_parser* p) {
   consume(p, TOKEN_L_PAREN, "Expecting '(' after while.");
   expression(p);
   consume(p, TOKEN_R_PAREN, "Expecting ')' after expression.");
-  int exit_jump = emit_jump(p, OP_JMP_FALSE);
-  emit_opcode(p, OP_POP);
+  bool fused;
+  int exit_jump = emit_condition_jump(p, &fused);
+  if (!fused)
+    emit_opcode(p, OP_POP);
   statement(p);
   emit_loop(p, loop_start);
   patch_jump(p, exit_jump);
-  emit_opcode(p, OP_POP);
+  if (!fused)
+    emit_opcode(p, OP_POP);
 }
 
-static void begin_scope(struct tr_parser* p) { p->compiler->function->locals.scopeDepth++; }
+static void begin_scope(struct tr_parser* p) { p->compiler->scope_depth++; }
 
 static void end_scope(struct tr_parser* p) {
-  p->compiler->function->locals.scopeDepth--;
-  while (p->compiler->function->locals.local_count > 0 &&
-         p->compiler->function->locals.locals[p->function->locals.local_count - 1].depth >
-             p->compiler->function->locals.scopeDepth) {
+  struct tr_compiler* c = p->compiler;
+  c->scope_depth--;
+  while (c->local_count > 0 && c->locals[c->local_count - 1].depth > c->scope_depth) {
     emit_opcode(p, OP_POP);
-    p->compiler->function->locals.local_count--;
+    c->local_count--;
+  }
+}
+
+// Notes that only the locals are on the stack here, between statements.
+static void mark_stack(struct tr_parser* p) {
+  struct tr_compiler* c = p->compiler;
+  c->stack_mark         = (struct tr_stack_mark){c->function->chunk.count, c->local_count};
+}
+
+// How an instruction the parser emits within an expression changes the
+// stack depth; false for one it does not.
+static bool stack_effect(const uint8_t* code, int* effect) {
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_UPVAL:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_PUSH_INT:
+    *effect = 1;
+    return true;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_LONG:
+  case OP_SET_GLOBAL:
+  case OP_SET_GLOBAL_LONG:
+  case OP_SET_UPVAL:
+  case OP_NEGATE:
+  case OP_NOT:
+  case OP_CHECK_TYPE:
+  case OP_JMP_LONG:
+  case OP_JMP_FALSE_LONG:
+    *effect = 0;
+    return true;
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_NEQUAL:
+  case OP_LT:
+  case OP_LTEQ:
+  case OP_GT:
+  case OP_GTEQ:
+  case OP_IADD:
+  case OP_ISUB:
+  case OP_IMUL:
+  case OP_IDIV:
+  case OP_FADD:
+  case OP_FSUB:
+  case OP_FMUL:
+  case OP_FDIV:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MUL:
+  case OP_DIV:
+    *effect = -1;
+    return true;
+  case OP_CALL:
+    *effect = -code[1];
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Stack depth at offset, counted from the stack mark; -1 if it can't be.
+// Expression code only branches forward to the end of an and/or, where the
+// depth is the same on both paths, so counting in a straight line works.
+static int stack_depth(struct tr_parser* p, int offset) {
+  struct tr_compiler* c = p->compiler;
+  uint8_t* code         = c->function->chunk.instructions;
+  int depth             = c->stack_mark.depth;
+  int off               = c->stack_mark.offset;
+  for (int effect; off < offset; off += tr_opcode_size(code[off])) {
+    if (!stack_effect(&code[off], &effect))
+      return -1;
+    depth += effect;
+  }
+  return off == offset ? depth : -1;
+}
+
+// A for loop that counts a local up by one: "i < limit" compiled at cond
+// (ending in the fused branch at exit_jump) and "i = i + 1;" at inc, where
+// limit is a local or a constant.
+struct tr_counted_loop {
+  uint8_t op; // OP_FOR_INC_LT or OP_FOR_INC_LT_K
+  uint8_t slot;
+  int limit; // local slot or constant index
+};
+
+static bool counted_loop(struct tr_parser* p, int cond, int exit_jump, int inc,
+                         struct tr_counted_loop* out) {
+  struct tr_compiler* c  = p->compiler;
+  struct tr_chunk* chunk = &c->function->chunk;
+  uint8_t* code          = chunk->instructions;
+  uint8_t branch         = code[exit_jump - 1];
+  if (branch != OP_JMP_IF_GE && branch != OP_JMP_IF_GE_INT && branch != OP_JMP_IF_GE_DBL)
+    return false;
+  if (code[cond] != OP_GET_LOCAL || cond + 2 >= exit_jump - 1)
+    return false;
+  out->slot = code[cond + 1];
+
+  const uint8_t step[] = {OP_GET_LOCAL, out->slot, OP_PUSH_INT, 0,  1,
+                          OP_ADD,       OP_SET_LOCAL, out->slot, OP_POP};
+  if (chunk->count - inc != (int)sizeof(step))
+    return false;
+  for (int i = 0; i < (int)sizeof(step); i++) {
+    if (code[inc + i] != step[i] && !(step[i] == OP_ADD && code[inc + i] == OP_IADD))
+      return false;
   }
+
+  int limit     = cond + 2;
+  uint8_t bound = code[limit];
+  if (limit + tr_opcode_size(bound) != exit_jump - 1)
+    return false;
+  out->op = OP_FOR_INC_LT_K;
+  switch (bound) {
+  case OP_GET_LOCAL:
+    out->op    = OP_FOR_INC_LT;
+    out->limit = code[limit + 1];
+    return true;
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    out->limit = constant_at(chunk, limit);
+    return out->limit <= UINT16_MAX;
+  case OP_PUSH_INT: {
+    bool fresh;
+    struct tr_value k = INT_VALUE((int16_t)(code[limit + 1] << 8 | code[limit + 2]));
+    out->limit = tr_constants_add_unique(&chunk->constants, &c->constants, k, &fresh);
+    if (out->limit > UINT16_MAX) {
+      if (fresh)
+        chunk->constants.count--;
+      return false;
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+static void emit_counted_loop(struct tr_parser* p, struct tr_counted_loop* loop, int body) {
+  emit_opcode(p, loop->op);
+  emit_opcode(p, loop->slot);
+  if (loop->op == OP_FOR_INC_LT_K)
+    emit_opcode(p, (loop->limit >> 8) & 0xff);
+  emit_opcode(p, loop->limit & 0xff);
+  int offset = p->compiler->function->chunk.count - body + 3;
+  if (offset > JUMP_MAX)
+    error(p, "loop body too large.");
+  emit_opcode(p, (offset >> 16) & 0xff);
+  emit_opcode(p, (offset >> 8) & 0xff);
+  emit_opcode(p, offset & 0xff);
 }
 
 static void for_statement(struct tr_parser* p) {
@@ -483,60 +1036,273 @@ static void for_statement(struct tr_parser* p) {
 
   } else if (match(p, TOKEN_VAR)) {
     var_declaration(p);
+  } else if (type_named(&p->current) != VAL_ANY) {
+    advance(p);
+    typed_declaration(p);
   } else {
     expression_statement(p);
   }
   int loop_start = p->compiler->function->chunk.count;
   int exit_jump  = -1;
+  bool fused     = false;
+  mark_stack(p);
   if (!match(p, TOKEN_SEMICOLON)) {
     expression(p);
     consume(p, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-    exit_jump = emit_jump(p, OP_JMP_FALSE);
-    emit_opcode(p, OP_POP);
+    exit_jump = emit_condition_jump(p, &fused);
+    if (!fused)
+      emit_opcode(p, OP_POP);
   }
+  struct tr_counted_loop counted;
+  bool is_counted = false;
   if (!match(p, TOKEN_R_PAREN)) {
-    int body_jump       = emit_jump(p, OP_JMP);
+    int body_jump       = emit_jump(p, OP_JMP_LONG);
     int increment_start = p->compiler->function->chunk.count;
+    mark_stack(p);
     expression(p);
     emit_opcode(p, OP_POP);
     consume(p, TOKEN_R_PAREN, "Expect ')' after for clauses.");
 
-    emit_loop(p, loop_start);
-    loop_start = increment_start;
-    patch_jump(p, body_jump);
+    is_counted = fused && counted_loop(p, loop_start, exit_jump, increment_start, &counted);
+    if (is_counted) {
+      // The condition stays as the entry test; the increment moves to the
+      // step op after the body.
+      struct tr_compiler* c    = p->compiler;
+      c->function->chunk.count = body_jump - 1;
+      c->last_literal          = (struct tr_literal){-1, false};
+      c->last_compare          = (struct tr_compare){-1, VAL_ANY};
+    } else {
+      emit_loop(p, loop_start);
+      loop_start = increment_start;
+      patch_jump(p, body_jump);
+    }
   }
+  int body = p->compiler->function->chunk.count;
   statement(p);
-  emit_loop(p, loop_start);
+  if (is_counted)
+    emit_counted_loop(p, &counted, body);
+  else
+    emit_loop(p, loop_start);
   if (exit_jump != -1) {
     patch_jump(p, exit_jump);
-    emit_opcode(p, OP_POP);
+    if (!fused)
+      emit_opcode(p, OP_POP);
   }
   end_scope(p);
 }
 
-static void parser_init_func(struct tr_parser* p, struct tr_func* new, int fn_type) {
-  new->enclosing        = p->compiler->function;
-  p->compiler->function = NULL;
-  p->type               = fn_type;
-  p->compiler->function = new;
+// Grows an arena array of count items of size bytes to fit one more.
+static void* arena_grow(struct tr_parser* p, void* items, int count, int* capacity, size_t size) {
+  if (count < *capacity)
+    return items;
+  *capacity    = *capacity == 0 ? 8 : *capacity * 2;
+  void* bigger = mem_arena_alloc(&p->arena, size * *capacity);
+  if (count > 0)
+    memcpy(bigger, items, size * count);
+  return bigger;
+}
+
+struct tr_case {
+  long key;
+  int target; // offset of the case's code
+};
+
+static int compare_cases(const void* a, const void* b) {
+  long x = ((const struct tr_case*)a)->key, y = ((const struct tr_case*)b)->key;
+  return (x > y) - (x < y);
+}
+
+// A case label: an integer constant expression, folded down to a literal.
+static long case_label(struct tr_parser* p) {
+  struct tr_compiler* c = p->compiler;
+  int start             = c->function->chunk.count;
+  expression(p);
+  struct tr_value v;
+  bool ok = literal_at(p, start, &v) && IS_LNG(v);
+  if (ok)
+    discard_literal(p, c->last_literal);
+  c->function->chunk.count = start;
+  c->last_literal          = (struct tr_literal){-1, false};
+  c->last_compare          = (struct tr_compare){-1, VAL_ANY};
+  if (!ok) {
+    error(p, "Case label must be an integer constant.");
+    return 0;
+  }
+  if (AS_LNG(v) < INT32_MIN || AS_LNG(v) > INT32_MAX)
+    error(p, "Case label out of range.");
+  return AS_LNG(v);
+}
+
+static void put_bytes(uint8_t* at, uint32_t v, int width) {
+  for (int i = width - 1; i >= 0; i--, v >>= 8)
+    at[i] = v & 0xff;
+}
+
+// Inserts the dispatch for the switch body compiled since offset dispatch in
+// front of it: a jump table when the keys are dense, a sorted key list for a
+// binary search otherwise. Jumps in the body are relative, so moving it along
+// is safe.
+static void emit_switch(struct tr_parser* p, int dispatch, struct tr_case* cases, int n,
+                        int default_target, int line) {
+  struct tr_chunk* chunk = &p->compiler->function->chunk;
+  int end                = chunk->count;
+  if (default_target < 0)
+    default_target = end;
+  if (n > 1)
+    qsort(cases, n, sizeof(*cases), compare_cases);
+  for (int i = 1; i < n; i++) {
+    if (cases[i].key == cases[i - 1].key) {
+      error(p, "Duplicate case label.");
+      return;
+    }
+  }
+  if (n > UINT16_MAX) {
+    error(p, "Too many cases in switch.");
+    return;
+  }
+  if (end - dispatch > JUMP_MAX) {
+    error(p, "Too much code to jump");
+    return;
+  }
+  // javac's rule: the table's size plus 3 per dispatch against the key
+  // list's size plus 3 per probe.
+  long range  = n > 0 ? cases[n - 1].key - cases[0].key + 1 : 0;
+  bool table  = n > 0 && range <= UINT16_MAX && range + 10 <= 5L * n;
+  int entries = table ? (int)range : n;
+  int offsets = 3 + 4 * (table ? 1 : n);
+  int size    = offsets + 3 * (entries + 1);
+
+  for (int i = 0; i < size; i++)
+    emit_opcode(p, 0);
+  memmove(&chunk->instructions[dispatch + size], &chunk->instructions[dispatch], end - dispatch);
+  memmove(&chunk->lines[dispatch + size], &chunk->lines[dispatch], sizeof(int) * (end - dispatch));
+  for (int i = 0; i < size; i++)
+    chunk->lines[dispatch + i] = line;
+
+  // Offsets count from the end of the instruction, which the body follows.
+  uint8_t* code = &chunk->instructions[dispatch];
+  code[0]       = table ? OP_TABLESWITCH : OP_LOOKUPSWITCH;
+  put_bytes(&code[1], entries, 2);
+  put_bytes(&code[offsets], default_target - dispatch, 3);
+  if (table) {
+    put_bytes(&code[3], (uint32_t)cases[0].key, 4);
+    for (int k = 0, i = 0; k < entries; k++) {
+      bool hit = cases[i].key == cases[0].key + k;
+      put_bytes(&code[offsets + 3 * (k + 1)], (hit ? cases[i++].target : default_target) - dispatch,
+                3);
+    }
+  } else {
+    for (int i = 0; i < n; i++) {
+      put_bytes(&code[3 + 4 * i], (uint32_t)cases[i].key, 4);
+      put_bytes(&code[offsets + 3 * (i + 1)], cases[i].target - dispatch, 3);
+    }
+  }
+  p->compiler->last_target = chunk->count;
+}
+
+// switch (value) { case 1, 2: ... case 3: ... default: ... }. Cases don't
+// fall through; labels are integer constants, and a value that is not an
+// int only matches default.
+static void switch_statement(struct tr_parser* p) {
+  struct tr_compiler* c = p->compiler;
+  int line              = p->previous.line;
+  consume(p, TOKEN_L_PAREN, "Expected '(' after switch.");
+  expression(p);
+  consume(p, TOKEN_R_PAREN, "Expected ')' after switch value.");
+  consume(p, TOKEN_L_BRACE, "Expected '{' before switch body.");
+
+  int dispatch          = c->function->chunk.count;
+  struct tr_case* cases = NULL;
+  int count = 0, capacity = 0;
+  int* exits     = NULL;
+  int exit_count = 0, exit_capacity = 0;
+  int default_target = -1;
+  while (match(p, TOKEN_CASE) || match(p, TOKEN_DEFAULT)) {
+    do {
+      if (p->previous.type == TOKEN_DEFAULT) {
+        if (default_target >= 0)
+          error(p, "Switch already has a default.");
+        default_target = c->function->chunk.count;
+      } else {
+        do {
+          long key       = case_label(p);
+          cases          = arena_grow(p, cases, count, &capacity, sizeof(*cases));
+          cases[count++] = (struct tr_case){key, c->function->chunk.count};
+        } while (match(p, TOKEN_COMMA));
+      }
+      consume(p, TOKEN_COLON, "Expected ':' after case label.");
+    } while (match(p, TOKEN_CASE) || match(p, TOKEN_DEFAULT));
+
+    begin_scope(p);
+    while (!check(p, TOKEN_CASE) && !check(p, TOKEN_DEFAULT) && !check(p, TOKEN_R_BRACE) &&
+           !check(p, TOKEN_EOF))
+      declaration(p);
+    end_scope(p);
+    if (check(p, TOKEN_CASE) || check(p, TOKEN_DEFAULT)) {
+      exits               = arena_grow(p, exits, exit_count, &exit_capacity, sizeof(*exits));
+      exits[exit_count++] = emit_jump(p, OP_JMP_LONG);
+    }
+  }
+  consume(p, TOKEN_R_BRACE, "Expected 'case', 'default' or '}' in switch.");
+  for (int i = 0; i < exit_count; i++)
+    patch_jump(p, exits[i]);
+  if (!p->error)
+    emit_switch(p, dispatch, cases, count, default_target, line);
+}
+
+static void parser_init_func(struct tr_parser* p, struct tr_compiler* c, int fn_type) {
+  c->enclosing      = p->compiler;
+  c->function       = tr_func_new(p->vm);
+  c->function->type = fn_type;
+  c->type           = fn_type;
+  c->locals         = NULL;
+  c->local_count    = 0;
+  c->local_capacity = 0;
+  c->scope_depth    = 0;
+  c->last_literal   = (struct tr_literal){-1, false};
+  c->last_compare   = (struct tr_compare){-1, VAL_ANY};
+  c->last_call      = -1;
+  c->last_target    = 0;
+  c->stack_mark     = (struct tr_stack_mark){0, 1};
+  c->inline_at      = -1;
+  c->inline_fn      = -1;
+  p->compiler       = c;
+  p->type           = fn_type;
+  tr_constants_index_init(&c->constants, &p->arena);
   if (fn_type != TYPE_SCRIPT) {
-    p->compiler->function->name = tr_string_new_ncpy(p->previous.start, p->previous.length);
+    c->function->name = tr_vm_intern(p->vm, p->previous.start, p->previous.length);
   }
-  struct tr_local* local = &p->compiler->function->locals.locals[p->function->locals.local_count++];
+  struct tr_local* local = push_local(p);
   local->depth           = 0;
-  // local->isCaptured      = 0;
+  local->is_captured     = false;
+  local->type            = VAL_ANY;
+  local->name.start      = NULL;
+  local->name.length     = 0;
 }
 
-static void parser_end_func(struct tr_parser* p) {
+static struct tr_func* parser_end_func(struct tr_parser* p) {
+  struct tr_compiler* c = p->compiler;
   emit_opcode(p, OP_NIL);
   emit_opcode(p, OP_RETURN);
+  if (!p->error) {
+    struct tr_func* f = c->function;
+    if (p->optimize)
+      tr_opt_chunk(&f->chunk, &p->scratch, &p->opt_stats);
+    f->max_stack = tr_chunk_max_stack(&f->chunk, f->arity + 1, &p->scratch);
+    mem_arena_free(&p->scratch);
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!p->error) {
-    tr_chunk_disassemble(&p->compiler->function->chunk,
-                         p->compiler->function->name != NULL ? p->function->name->str : "<script>");
+    tr_chunk_disassemble(&c->function->chunk,
+                         c->function->name != NULL ? c->function->name->str : "<script>");
   }
 #endif
-  p->compiler->function = p->function->enclosing;
+  p->compiler = c->enclosing;
+  if (p->compiler != NULL) {
+    c->function->enclosing = p->compiler->function;
+    p->type                = p->compiler->type;
+  }
+  return c->function;
 }
 
 static void block(struct tr_parser* p) {
@@ -546,9 +1312,71 @@ static void block(struct tr_parser* p) {
   consume(p, TOKEN_R_BRACE, "Expected } after block.");
 }
 
-static void function(struct tr_parser* p, int function_type) {
-  struct tr_func* func = tr_func_new();
-  parser_init_func(p, func, function_type);
+static int make_constant(struct tr_parser* p, struct tr_value val) {
+  return check_constant(p, tr_constants_add(&p->compiler->function->chunk.constants, val));
+}
+
+// A function body that calls can be replaced with: its code up to the final
+// OP_RETURN (or all of it, to return nil), which leaves the arguments and
+// locals under the result.
+struct tr_inline {
+  struct tr_func* func; // for its constants, arity and locals
+  uint8_t* code;
+  int size;
+  bool returns; // the code is followed by an OP_RETURN
+  int locals;   // argument and local slots live at the end
+};
+
+// Copies out the function being compiled, before it is terminated and
+// optimized, if calls to it can be inlined: a leaf (no calls, upvalues or
+// closures) that fits p->inline_max, returning only at its very end.
+static bool inline_body(struct tr_parser* p, struct tr_inline* out) {
+  struct tr_compiler* c  = p->compiler;
+  struct tr_chunk* chunk = &c->function->chunk;
+  uint8_t* code          = chunk->instructions;
+  int ret = -1, last = -1;
+  for (int off = 0; off < chunk->count; off += tr_instruction_size(&code[off])) {
+    switch (code[off]) {
+    case OP_RETURN:
+      if (ret >= 0)
+        return false;
+      ret = off;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+    case OP_GET_UPVAL:
+    case OP_SET_UPVAL:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_TABLESWITCH:
+    case OP_LOOKUPSWITCH:
+      return false;
+    default:
+      break;
+    }
+    last = off;
+  }
+  if (ret >= 0 && ret != last)
+    return false;
+  int size = ret >= 0 ? ret : chunk->count;
+  if (size > p->inline_max)
+    return false;
+  out->func    = c->function;
+  out->code    = mem_arena_alloc(&p->arena, size > 0 ? size : 1);
+  out->size    = size;
+  out->returns = ret >= 0;
+  out->locals  = c->local_count - 1;
+  memcpy(out->code, code, size);
+  return true;
+}
+
+// Compiles a function and emits its closure. With body set, also copies the
+// function into it if it can be inlined, and says whether it could.
+static bool function(struct tr_parser* p, int function_type, struct tr_inline* body) {
+  struct tr_compiler compiler;
+  parser_init_func(p, &compiler, function_type);
   begin_scope(p);
   consume(p, TOKEN_L_PAREN, "Expected ( after function name");
   if (!check(p, TOKEN_R_PAREN)) {
@@ -557,23 +1385,38 @@ static void function(struct tr_parser* p, int function_type) {
       if (p->compiler->function->arity > 255) {
         error_current(p, "Can't have more than 255 parameters, you mad man.");
       }
-      uint8_t constant = parse_variable(p, "Expect parameter name");
+      int constant = parse_variable(p, "Expect parameter name", VAL_ANY);
       define_global(p, constant);
     } while (match(p, TOKEN_COMMA));
   }
   consume(p, TOKEN_R_PAREN, "Expected ) after function name");
   consume(p, TOKEN_L_BRACE, "Expected  { before function body");
   block(p);
-  parser_end_func(p);
-  emit_opcode(p, OP_CLOSURE);
-  emit_opcode(p, emit_constant(p, OBJ_VALUE(func)));
+  bool inlinable       = body != NULL && !p->error && inline_body(p, body);
+  struct tr_func* func = parser_end_func(p);
+  emit_indexed(p, OP_CLOSURE, OP_CLOSURE_LONG, make_constant(p, OBJ_VALUE(func)));
+  return inlinable;
 }
 
+// Calls are only inlined for a function declared at the top of the script
+// whose global nothing else declares or assigns (see scan_globals), so every
+// call compiled after the declaration reaches it.
 static void func_declaration(struct tr_parser* p) {
-  uint8_t global = parse_variable(p, "Expected function name");
+  int global             = parse_variable(p, "Expected function name", VAL_ANY);
+  struct tr_string* name = tr_vm_intern(p->vm, p->previous.start, p->previous.length);
+  struct tr_value v;
+  bool top = p->compiler == &p->root && p->compiler->scope_depth == 0 &&
+             tr_table_get(&p->inlines, name, &v) && IS_LNG(v);
   mark_initialized(p);
-  function(p, TYPE_FUNC);
+  struct tr_inline body;
+  bool inlinable = function(p, TYPE_FUNC, top ? &body : NULL);
   define_global(p, global);
+  if (inlinable) {
+    p->inline_bodies = arena_grow(p, p->inline_bodies, p->inline_count, &p->inline_capacity,
+                                  sizeof(*p->inline_bodies));
+    p->inline_bodies[p->inline_count] = body;
+    tr_table_insert(&p->inlines, name, INT_VALUE(p->inline_count++));
+  }
 }
 
 static uint8_t argument_list(struct tr_parser* p) {
@@ -591,10 +1434,133 @@ static uint8_t argument_list(struct tr_parser* p) {
   return count;
 }
 
+// Number of arguments to the call whose '(' was just consumed, counted ahead
+// on a copy of the lexer; -1 if the list does not end.
+static int count_arguments(struct tr_parser* p) {
+  if (check(p, TOKEN_R_PAREN))
+    return 0;
+  struct tr_lexer lex = *p->lexer;
+  int n = 1, depth = 0;
+  for (struct tr_token t = p->current; t.type != TOKEN_EOF; t = tr_lexer_next_token(&lex)) {
+    if (t.type == TOKEN_L_PAREN) {
+      depth++;
+    } else if (t.type == TOKEN_R_PAREN) {
+      if (depth-- == 0)
+        return n;
+    } else if (t.type == TOKEN_COMMA && depth == 0) {
+      n++;
+    }
+  }
+  return -1;
+}
+
+// Rewrites an instruction copied from fn's body for a call whose arguments
+// start at slot base: local slots move up, constants move to this chunk's
+// pool. False if a constant index no longer fits its operand, which would
+// change the instruction's size and so the body's jumps.
+static bool relocate(struct tr_parser* p, struct tr_inline* fn, int base, uint8_t* code) {
+  struct tr_compiler* c = p->compiler;
+  int at = 1, width;
+  switch (code[0]) {
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    code[1] += base - 1;
+    return true;
+  case OP_FOR_INC_LT:
+    code[1] += base - 1;
+    code[2] += base - 1;
+    return true;
+  case OP_FOR_INC_LT_K:
+    code[1] += base - 1;
+    at    = 2;
+    width = 2;
+    break;
+  case OP_CONSTANT:
+    width = 1;
+    break;
+  case OP_CONSTANT_LONG:
+    width = 3;
+    break;
+  default:
+    return true;
+  }
+  uint32_t k = 0;
+  for (int i = 0; i < width; i++)
+    k = k << 8 | code[at + i];
+  bool fresh;
+  int id = tr_constants_add_unique(&c->function->chunk.constants, &c->constants,
+                                   fn->func->chunk.constants.values[k], &fresh);
+  if (id >= 1 << 8 * width)
+    return false;
+  put_bytes(&code[at], id, width);
+  return true;
+}
+
+// Compiles the call whose '(' was just consumed into a copy of the callee's
+// body, if the callee was pushed by the instruction just before it and is a
+// function that can be inlined. The callee push is dropped, so the arguments
+// land at base, the slot the body's first parameter is moved to; its other
+// locals follow, and the result is moved down over them at the end.
+static bool inline_call(struct tr_parser* p) {
+  struct tr_compiler* c  = p->compiler;
+  struct tr_chunk* chunk = &c->function->chunk;
+  int at                 = c->inline_at;
+  if (at < 0 || at + tr_opcode_size(chunk->instructions[at]) != chunk->count ||
+      c->last_target > at ||
+      (chunk->instructions[at] != OP_GET_GLOBAL && chunk->instructions[at] != OP_GET_GLOBAL_LONG))
+    return false;
+  struct tr_inline* fn = &p->inline_bodies[c->inline_fn];
+  int base             = stack_depth(p, at);
+  if (base < 0 || count_arguments(p) != fn->func->arity ||
+      base + fn->func->max_locals - 2 > UINT8_MAX)
+    return false;
+  // Check every instruction can be moved first; the constants this adds to
+  // the pool get the same indices again below.
+  for (int off = 0; off < fn->size; off += tr_opcode_size(fn->code[off])) {
+    uint8_t insn[8];
+    memcpy(insn, &fn->code[off], tr_opcode_size(fn->code[off]));
+    if (!relocate(p, fn, base, insn))
+      return false;
+  }
+
+  chunk->count = at;
+  argument_list(p);
+  for (int off = 0; off < fn->size; off += tr_opcode_size(fn->code[off])) {
+    int start = chunk->count;
+    for (int i = 0; i < tr_opcode_size(fn->code[off]); i++)
+      emit_opcode(p, fn->code[off + i]);
+    relocate(p, fn, base, &chunk->instructions[start]);
+  }
+  if (!fn->returns)
+    emit_opcode(p, OP_NIL);
+  if (fn->locals > 0) {
+    emit_local(p, OP_SET_LOCAL, base);
+    for (int i = 0; i < fn->locals; i++)
+      emit_opcode(p, OP_POP);
+  }
+
+  if (base + fn->func->max_locals - 1 > c->function->max_locals)
+    c->function->max_locals = base + fn->func->max_locals - 1;
+  // Nothing may fuse with or fold into the body's last instructions.
+  c->last_literal = (struct tr_literal){-1, false};
+  c->last_compare = (struct tr_compare){-1, VAL_ANY};
+  c->last_call    = -1;
+  c->last_target  = chunk->count;
+  c->inline_at    = -1;
+  c->stack_mark   = (struct tr_stack_mark){chunk->count, base + 1};
+  p->expr_type    = VAL_ANY;
+  p->opt_stats.inlined++;
+  return true;
+}
+
 static void call(struct tr_parser* p, bool ca) {
-  uint8_t arg_count = argument_list(p);
+  if (inline_call(p))
+    return;
+  uint8_t arg_count      = argument_list(p);
+  p->compiler->last_call = p->compiler->function->chunk.count;
   emit_opcode(p, OP_CALL);
   emit_opcode(p, arg_count);
+  p->expr_type = VAL_ANY;
 }
 
 static void emit_return(struct tr_parser* p) {
@@ -603,22 +1569,32 @@ static void emit_return(struct tr_parser* p) {
 }
 
 static void return_statement(struct tr_parser* p) {
-  if (p->compiler->function->type == TYPE_SCRIPT) {
+  if (p->compiler->type == TYPE_SCRIPT) {
     error(p, "Can't return from the script lol");
   }
   if (match(p, TOKEN_SEMICOLON)) {
     emit_return(p);
   } else {
+    struct tr_chunk* chunk = &p->compiler->function->chunk;
+    int start              = chunk->count;
     expression(p);
     consume(p, TOKEN_SEMICOLON, "Expected ; after return val");
+    // A call that produces the return value is a tail call.
+    int call = p->compiler->last_call;
+    if (call >= start && call == chunk->count - 2)
+      chunk->instructions[call] = OP_TAIL_CALL;
     emit_opcode(p, OP_RETURN);
   }
 }
 static void declaration(struct tr_parser* p) {
+  mark_stack(p);
   if (match(p, TOKEN_FUNC)) {
     func_declaration(p);
   } else if (match(p, TOKEN_VAR)) {
     var_declaration(p);
+  } else if (type_named(&p->current) != VAL_ANY) {
+    advance(p);
+    typed_declaration(p);
   } else if (match(p, TOKEN_FOR)) {
     for_statement(p);
   } else if (match(p, TOKEN_IF)) {
@@ -627,6 +1603,8 @@ static void declaration(struct tr_parser* p) {
     return_statement(p);
   } else if (match(p, TOKEN_WHILE)) {
     while_statement(p);
+  } else if (match(p, TOKEN_SWITCH)) {
+    switch_statement(p);
   } else {
     statement(p);
   }
@@ -635,6 +1613,7 @@ static void declaration(struct tr_parser* p) {
 }
 
 static void statement(struct tr_parser* p) {
+  mark_stack(p);
   if (match(p, TOKEN_L_BRACE)) {
     begin_scope(p);
     block(p);
@@ -644,21 +1623,29 @@ static void statement(struct tr_parser* p) {
   }
 }
 
+// The result of and/or is one of the operands, so its type is only known
+// when both have the same one.
 static void and_(struct tr_parser* p, bool c) {
-  int end_jump = emit_jump(p, OP_JMP_FALSE);
+  int lhs      = p->expr_type;
+  int end_jump = emit_jump(p, OP_JMP_FALSE_LONG);
   emit_opcode(p, OP_POP);
   precedence(p, PREC_AND);
   patch_jump(p, end_jump);
+  if (p->expr_type != lhs)
+    p->expr_type = VAL_ANY;
 }
 
 static void or_(struct tr_parser* p, bool ca) {
-  int else_jump = emit_jump(p, OP_JMP_FALSE);
-  int end_jump  = emit_jump(p, OP_JMP);
+  int lhs       = p->expr_type;
+  int else_jump = emit_jump(p, OP_JMP_FALSE_LONG);
+  int end_jump  = emit_jump(p, OP_JMP_LONG);
   patch_jump(p, else_jump);
   emit_opcode(p, OP_POP);
 
   precedence(p, PREC_OR);
   patch_jump(p, end_jump);
+  if (p->expr_type != lhs)
+    p->expr_type = VAL_ANY;
 }
 
 static struct tr_parse_rule rules[] = {
@@ -671,6 +1658,7 @@ static struct tr_parse_rule rules[] = {
     [TOKEN_MINUS]     = {unary,    binary, PREC_TERM  },
     [TOKEN_PLUS]      = {NULL,     binary, PREC_TERM  },
     [TOKEN_SEMICOLON] = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_COLON]     = {NULL,     NULL,   PREC_NONE  },
     [TOKEN_SLASH]     = {NULL,     binary, PREC_FACTOR},
     [TOKEN_STAR]      = {NULL,     binary, PREC_FACTOR},
     [TOKEN_EXCL]      = {unary,    NULL,   PREC_NONE  },
@@ -695,48 +1683,105 @@ static struct tr_parse_rule rules[] = {
     [TOKEN_NIL]       = {NULL,     NULL,   PREC_NONE  },
     [TOKEN_OR]        = {NULL,     NULL,   PREC_NONE  },
  //[TOKEN_PRINT] = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_RETURN] = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_SUPER]  = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_THIS]   = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_TRUE]   = {literal,  NULL,   PREC_NONE  },
-    [TOKEN_VAR]    = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_WHILE]  = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_ERR]    = {NULL,     NULL,   PREC_NONE  },
-    [TOKEN_EOF]    = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_RETURN]  = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_SUPER]   = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_THIS]    = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_TRUE]    = {literal,  NULL,   PREC_NONE  },
+    [TOKEN_VAR]     = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_WHILE]   = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_SWITCH]  = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_CASE]    = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_DEFAULT] = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_ERR]     = {NULL,     NULL,   PREC_NONE  },
+    [TOKEN_EOF]     = {NULL,     NULL,   PREC_NONE  },
 };
 
 static struct tr_parse_rule* tr_parser_get_rule(token_type type) { return &rules[type]; }
 
-void tr_parser_init(struct tr_parser* p, struct tr_lexer* l) {
-  p->lexer = l;
-  p->error = p->panicking     = false;
-  p->compiler->function       = tr_func_new();
-  p->compiler->function->type = TYPE_SCRIPT;
-  memset(&p->preprevious, 0, sizeof(p->preprevious));
-  memset(&p->previous, 0, sizeof(p->current));
+void tr_parser_init(struct tr_parser* p, struct tr_lexer* l, struct tr_vm* vm) {
+  p->lexer    = l;
+  p->vm       = vm;
+  p->error    = p->panicking = false;
+  p->compiler = NULL;
+  p->function = NULL;
+  memset(&p->previous, 0, sizeof(p->previous));
   memset(&p->current, 0, sizeof(p->current));
+  mem_arena_init(&p->arena);
+  mem_arena_init(&p->scratch);
+  p->optimize        = true;
+  p->inline_max      = TR_INLINE_MAX;
+  p->inline_bodies   = NULL;
+  p->inline_count    = 0;
+  p->inline_capacity = 0;
+  p->expr_type       = VAL_ANY;
+  memset(&p->opt_stats, 0, sizeof(p->opt_stats));
+  tr_table_init(&p->global_types);
+  tr_table_init(&p->inlines);
+}
 
-  struct tr_local* local = &p->compiler->locals[p->compiler->local_count++];
-  local->depth           = 0;
-  local->name.start      = "";
-  local->name.length     = 0;
+// Looks ahead through the whole source for the functions whose calls may be
+// inlined: those declared once by a top level func, and never assigned or
+// declared as a variable. Any name followed by '=' counts as assigned, even
+// if it is a local that shadows the global.
+static void scan_globals(struct tr_parser* p) {
+  struct tr_lexer lex  = *p->lexer;
+  struct tr_token prev = {TOKEN_EOF, NULL, 0, 0};
+  int depth            = 0;
+  for (struct tr_token t; (t = tr_lexer_next_token(&lex)).type != TOKEN_EOF; prev = t) {
+    struct tr_token* name = NULL;
+    bool declared         = false;
+    if (t.type == TOKEN_L_BRACE) {
+      depth++;
+    } else if (t.type == TOKEN_R_BRACE) {
+      depth--;
+    } else if (t.type == TOKEN_ASSIGN && prev.type == TOKEN_IDENT) {
+      name = &prev;
+    } else if (t.type == TOKEN_IDENT && depth == 0) {
+      if (prev.type == TOKEN_FUNC)
+        declared = true;
+      if (declared || prev.type == TOKEN_VAR || type_named(&prev) != VAL_ANY)
+        name = &t;
+    }
+    if (name == NULL)
+      continue;
+    struct tr_string* s = tr_vm_intern(p->vm, name->start, name->length);
+    struct tr_value v;
+    bool seen = tr_table_get(&p->inlines, s, &v);
+    tr_table_insert(&p->inlines, s, declared && !seen ? INT_VALUE(-1) : BOOL_VALUE(false));
+  }
 }
 
 bool tr_parser_compile(struct tr_parser* parser) {
-  advance(parser);
-  while (!match(parser, TOKEN_EOF)) {
-    declaration(parser);
-  }
-  emit_opcode(parser, OP_NIL);
-  emit_opcode(parser, OP_RETURN);
-#ifdef DEBUG_PRINT_CODE
-  if (!parser->error) {
-    tr_chunk_disassemble(&parser->compiler->function->chunk,
-                         parser->compiler->function->name != NULL
-                             ? parser->compiler->function->name->str
-                             : "<script>");
+  // Compiled functions belong to the VM, so they are allocated (and limited)
+  // like its other memory.
+  struct mem_ctx* prev = mem_use(&parser->vm->mem);
+  jmp_buf* outer       = parser->vm->mem.on_error;
+  jmp_buf on_error;
+  if (setjmp(on_error) != 0) {
+    fprintf(stderr, "Out of memory while compiling.\n");
+    parser->function = NULL;
+    parser->error    = true;
+  } else {
+    parser->vm->mem.on_error = &on_error;
+    if (parser->inline_max > 0)
+      scan_globals(parser);
+    parser_init_func(parser, &parser->root, TYPE_SCRIPT);
+    advance(parser);
+    while (!match(parser, TOKEN_EOF)) {
+      declaration(parser);
+    }
+    parser->function = parser_end_func(parser);
   }
-#endif
-  consume(parser, TOKEN_EOF, "Epected EOF after expression");
+  parser->vm->mem.on_error = outer;
+  mem_use(prev);
   return !parser->error;
 }
+
+void tr_parser_free(struct tr_parser* p) {
+  struct mem_ctx* prev = mem_use(&p->vm->mem);
+  mem_arena_free(&p->arena);
+  mem_arena_free(&p->scratch);
+  tr_table_free(&p->global_types);
+  tr_table_free(&p->inlines);
+  mem_use(prev);
+}
@@ -1,19 +1,33 @@
 #ifndef tr_parser_h
 #define tr_parser_h
 
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
+#endif
 
+#include "memory.h"
 #include "tr_debug.h"
 #include "tr_lexer.h"
+#include "tr_opt.h"
 #include "tr_vm.h"
 #include <stdbool.h>
 
 #define UINT8_COUNT UINT8_MAX + 1
+// Local slots are addressed by a 16-bit operand (8-bit in the short forms).
+#define LOCALS_MAX (UINT16_MAX + 1)
+
+// Static type of an expression or variable that can hold anything.
+#define VAL_ANY (-1)
+
+// Default size limit, in bytes of bytecode, of a function inlined into its
+// callers.
+#define TR_INLINE_MAX 32
 
 struct tr_local {
   struct tr_token name;
   int depth;
   bool is_captured;
+  int type; // declared VAL_* type, VAL_ANY for var
 };
 
 struct tr_upvalue {
@@ -21,13 +35,48 @@ struct tr_upvalue {
   bool is_local;
 };
 
+// The most recently emitted literal push (OP_CONSTANT, OP_PUSH_INT etc.), used
+// by constant folding to find literal operands at the end of the chunk.
+struct tr_literal {
+  int offset;
+  bool fresh; // its constant was appended to the pool for this literal alone
+};
+
+// The most recent relational op (OP_LT etc.) and its operands' static type,
+// which a following condition jump can fuse with.
+struct tr_compare {
+  int offset;
+  int type;
+};
+
+// A point in the chunk where the stack held depth values: the locals and
+// whatever the code emitted since then leaves on top of them.
+struct tr_stack_mark {
+  int offset;
+  int depth;
+};
+
+struct tr_inline;
+
 struct tr_compiler {
   struct tr_compiler* enclosing;
   struct tr_func* function;
   int type;
 
-  struct tr_local locals[UINT8_COUNT];
+  struct tr_constants_index constants;
+  struct tr_literal last_literal;
+  struct tr_compare last_compare;
+  int last_call; // offset of the most recent OP_CALL
+  int last_target; // furthest forward jump target patched so far
+  struct tr_stack_mark stack_mark; // start of the current statement, or later
+  // The most recent OP_GET_GLOBAL of a function that can be inlined, and its
+  // index in the parser's inline_bodies.
+  int inline_at;
+  int inline_fn;
+
+  struct tr_local* locals; // from the parser's arena
   int local_count;
+  int local_capacity;
 
   struct tr_upvalue upvalues[UINT8_COUNT];
   int scope_depth;
@@ -35,18 +84,40 @@ struct tr_compiler {
 
 struct tr_parser {
   struct tr_lexer* lexer;
+  struct tr_vm* vm; // owns the interned strings the constants refer to
   struct tr_compiler* compiler;
+  struct tr_compiler root;
+  struct tr_func* function;
   tr_func_type type;
-  struct tr_token preprevious;
   struct tr_token previous;
   struct tr_token current;
+  int expr_type; // static type of the expression just compiled
+  // Types of the globals declared so far, by name.
+  struct tr_table global_types;
+  // Compile-lifetime storage (local names etc.), released by tr_parser_free.
+  struct mem_arena arena;
+  // Working memory for the optimizer and the stack depth pass, emptied after
+  // each function.
+  struct mem_arena scratch;
+
+  bool optimize; // run the peephole pass on each finished function
+  // Inline calls to functions of up to this many bytes; 0 disables inlining.
+  int inline_max;
+  // Globals by name: an index into inline_bodies for a function whose calls
+  // are inlined, -1 for one that may be, false for any that must not.
+  struct tr_table inlines;
+  struct tr_inline* inline_bodies; // from the arena
+  int inline_count;
+  int inline_capacity;
+  struct tr_opt_stats opt_stats;
 
   bool error;
   bool panicking;
 };
 
-void tr_parser_init(struct tr_parser* p, struct tr_lexer* l);
+void tr_parser_init(struct tr_parser* p, struct tr_lexer* l, struct tr_vm* vm);
 
 bool tr_parser_compile(struct tr_parser* parser);
+void tr_parser_free(struct tr_parser* p);
 
 #endif // tr_parser_h
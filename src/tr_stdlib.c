@@ -19,7 +19,6 @@ struct tr_value tr_clock(struct tr_vm* vm, int args, struct tr_value* vals) {
   return DOUBLE_VALUE((double)clock() / CLOCKS_PER_SEC);
 }
 
-void tr_stdlib_open(struct tr_vm* vm) {
-  tr_vm_add_cfunc(vm, "print", tr_print);
-  tr_vm_add_cfunc(vm, "clock", tr_clock);
+bool tr_stdlib_open(struct tr_vm* vm) {
+  return tr_vm_add_cfunc(vm, "print", tr_print) && tr_vm_add_cfunc(vm, "clock", tr_clock);
 }
@@ -1,6 +1,7 @@
 #ifndef tr_stdlib_h
 #define tr_stdlib_h
 #include "tr_vm.h"
-void tr_stdlib_open(struct tr_vm *vm);
+// Returns false if it ran out of memory.
+bool tr_stdlib_open(struct tr_vm *vm);
 
 #endif // tr_stdlib_h
\ No newline at end of file
@@ -12,7 +12,7 @@ void tr_table_init(struct tr_table* t) {
 }
 
 void tr_table_free(struct tr_table* t) {
-  mem_free(t->entries);
+  mem_free(t->entries, sizeof(struct tr_tbl_entry) * t->capacity);
   tr_table_init(t);
 }
 
@@ -23,13 +23,13 @@ static struct tr_tbl_entry* tr_table_find_entry(struct tr_tbl_entry* entries, in
   for (;;) {
     struct tr_tbl_entry* entry = &entries[index];
     if (entry->key == NULL) {
-      if (entry->value.type == VAL_NIL) {
+      if (IS_NIL(entry->value)) {
         return tombstone != NULL ? tombstone : entry;
       } else {
         if (tombstone == NULL)
           tombstone = entry;
       }
-    } else if (strcmp(entry->key->str, s->str) == 0) {
+    } else if (entry->key == s) {
       return entry;
     }
     index = (index + 1) % capacity;
@@ -55,7 +55,7 @@ static void table_adjust_capacity(struct tr_table* t, int cap) {
     dest->value = entry->value;
     t->count++;
   }
-  mem_free(t->entries);
+  mem_free(t->entries, sizeof(struct tr_tbl_entry) * t->capacity);
   t->entries  = entries;
   t->capacity = cap;
 }
@@ -69,17 +69,22 @@ void tr_table_insert_all(struct tr_table* from, struct tr_table* to) {
   }
 }
 
+void tr_table_reserve(struct tr_table* t, int n) {
+  if (t->count + n <= t->capacity * TABLE_MAX_LOAD)
+    return;
+  int cap = t->capacity * 2 + 8;
+  while (t->count + n > cap * TABLE_MAX_LOAD)
+    cap = cap * 2 + 8;
+  table_adjust_capacity(t, cap);
+}
+
 bool tr_table_insert(struct tr_table* t, struct tr_string* s, struct tr_value val) {
-  if (t->count + 1 > t->capacity * TABLE_MAX_LOAD) {
-    int cap = t->capacity * 2 + 8;
-    table_adjust_capacity(t, cap);
-    t->capacity = cap;
-  }
+  tr_table_reserve(t, 1);
   struct tr_tbl_entry* entry = tr_table_find_entry(t->entries, t->capacity, s);
   bool newKey                = entry->key == NULL;
-  if (newKey && entry->value.type == VAL_NIL)
+  if (newKey && IS_NIL(entry->value))
     t->count++;
-  entry->key   = tr_string_new_cpy(s);
+  entry->key   = s;
   entry->value = val;
   return newKey;
 }
@@ -100,8 +105,25 @@ bool tr_table_delete(struct tr_table* t, struct tr_string* s) {
   struct tr_tbl_entry* entry = tr_table_find_entry(t->entries, t->capacity, s);
   if (entry->key == NULL)
     return false;
-  tr_string_free(entry->key);
   entry->key   = NULL;
-  entry->value = (struct tr_value){.type = VAL_LNG, .l = 0xdeadbeef};
+  entry->value = INT_VALUE(0xdeadbeef);
   return true;
-}
\ No newline at end of file
+}
+
+struct tr_string* tr_table_find_string(struct tr_table* t, const char* chars, int len,
+                                       uint32_t hash) {
+  if (t->count == 0)
+    return NULL;
+  uint32_t index = hash % t->capacity;
+  for (;;) {
+    struct tr_tbl_entry* entry = &t->entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value))
+        return NULL;
+    } else if (entry->key->hash == hash && entry->key->len == len &&
+               memcmp(entry->key->str, chars, len) == 0) {
+      return entry->key;
+    }
+    index = (index + 1) % t->capacity;
+  }
+}
@@ -21,7 +21,12 @@ void tr_table_init(struct tr_table *t);
 void tr_table_free(struct tr_table *t);
 bool tr_table_insert(struct tr_table *t, struct tr_string *s,
                      struct tr_value val);
+// Makes room for n more keys, so that inserting them allocates nothing.
+void tr_table_reserve(struct tr_table *t, int n);
 bool tr_table_get(struct tr_table *t, struct tr_string *s, struct tr_value *v);
 bool tr_table_delete(struct tr_table *t, struct tr_string *s);
+// Looks a key up by contents rather than identity; used to intern strings.
+struct tr_string *tr_table_find_string(struct tr_table *t, const char *chars, int len,
+                                       uint32_t hash);
 
 #endif // tr_table_h
\ No newline at end of file
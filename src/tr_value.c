@@ -5,40 +5,17 @@
 
 extern inline bool tr_value_is_falsey(struct tr_value v);
 extern inline bool tr_value_eq(struct tr_value a, struct tr_value b);
-
-void tr_string_cpy(struct tr_string* s, const char* str) {
-  s->str = mem_strdup(str);
-  tr_string_hash(s);
-}
-
-void tr_string_ncpy(struct tr_string* s, const char* str, int len) {
-  s->str = mem_strndup(str, len);
-  tr_string_hash(s);
-}
-
-void tr_string_new(struct tr_string* s, int capacity) {
-  s->str = mem_realloc(NULL, 0, sizeof(char) * capacity);
-  memset(s->str, 0, sizeof(char) * capacity);
-  s->hash = 0;
-}
-
-struct tr_string* tr_string_new_ncpy(const char* str, int len) {
-  struct tr_string* n = mem_alloc(sizeof(*n));
-  n->str              = mem_strndup(str, len);
-  tr_string_hash(n);
-  return n;
-}
-
-struct tr_string* tr_string_new_cpy(struct tr_string* s) {
-  if (s == NULL)
-    return NULL;
-  struct tr_string* ret = mem_alloc(sizeof(*ret));
-  ret->str              = mem_strdup(s->str);
-  ret->hash             = s->hash;
-  return ret;
-}
-
-void tr_string_free(struct tr_string* s) { mem_free(s->str); }
+extern inline bool tr_lng_add(long a, long b, long* out);
+extern inline bool tr_lng_sub(long a, long b, long* out);
+extern inline bool tr_lng_mul(long a, long b, long* out);
+extern inline bool tr_lng_div(long a, long b, long* out);
+extern inline bool tr_lng_neg(long a, long* out);
+#ifdef TR_NAN_BOXING
+extern inline int tr_value_type(struct tr_value v);
+extern inline struct tr_value tr__nan_box(uint64_t top, uint64_t payload);
+extern inline double tr__nan_dbl(struct tr_value v);
+extern inline struct tr_value tr__nan_from_dbl(double d);
+#endif
 
 uint32_t tr_string__hash(const char* key, uint32_t len, uint32_t seed) {
   uint32_t c1            = 0xcc9e2d51;
@@ -63,7 +40,7 @@ uint32_t tr_string__hash(const char* key, uint32_t len, uint32_t seed) {
   // for each 4 byte chunk of `key'
   for (i = -l; i != 0; ++i) {
     // next 4 byte chunk of `key'
-    k = chunks[i];
+    memcpy(&k, &chunks[i], sizeof(k)); // key may be unaligned (source text)
 
     // encode next 4 byte chunk of `key'
     k *= c1;
@@ -104,4 +81,4 @@ uint32_t tr_string__hash(const char* key, uint32_t len, uint32_t seed) {
   return h;
 }
 
-void tr_string_hash(struct tr_string* s) { s->hash = tr_string__hash(s->str, strlen(s->str), 0); }
+void tr_string_hash(struct tr_string* s) { s->hash = tr_string__hash(s->str, s->len, 0); }
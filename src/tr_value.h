@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 struct tr_vm;
 struct tr_value;
@@ -11,15 +12,20 @@ typedef struct tr_value (*tr_cfunc)(struct tr_vm* vm, int args, struct tr_value*
 
 enum { VAL_NIL, VAL_STR, VAL_LNG, VAL_DBL, VAL_PTR, VAL_BOOL, VAL_CFUNC, VAL_OBJ };
 
+// Strings the VM sees are interned (tr_vm_intern), so two strings are equal
+// exactly when the pointers are. str follows the header in the same block.
 struct tr_string {
   char* str;
+  int len;
   uint32_t hash;
 };
 
+#ifndef TR_NAN_BOXING
+
 struct tr_value {
   int type;
   union {
-    struct tr_string s;
+    struct tr_string* s;
     bool b;
     long l;
     double d;
@@ -29,57 +35,221 @@ struct tr_value {
   };
 };
 
+#define tr_value_type(v) ((v).type)
+
+#define IS_NIL(v) ((v).type == VAL_NIL)
+#define IS_STR(v) ((v).type == VAL_STR)
+#define IS_LNG(v) ((v).type == VAL_LNG)
+#define IS_DBL(v) ((v).type == VAL_DBL)
+#define IS_BOOL(v) ((v).type == VAL_BOOL)
+#define IS_OBJ(v) ((v).type == VAL_OBJ)
+#define IS_CFUNC(v) ((v).type == VAL_CFUNC)
+#define IS_PTR(v) ((v).type == VAL_PTR)
+
+#define AS_STR(v) ((v).s)
+#define AS_BOOL(v) ((v).b)
+#define AS_LNG(v) ((v).l)
+#define AS_DBL(v) ((v).d)
+#define AS_PTR(v) ((v).p)
+#define AS_OBJ(v) ((v).obj)
+#define AS_CFUNC(v) ((v).func)
+
 #define OBJ_VALUE(val)                                                                             \
   (struct tr_value) { .type = VAL_OBJ, .obj = (struct tr_object*)val }
 #define INT_VALUE(val)                                                                             \
   (struct tr_value) { .type = VAL_LNG, .l = val }
 #define DOUBLE_VALUE(val)                                                                          \
   (struct tr_value) { .type = VAL_DBL, .d = val }
+#define BOOL_VALUE(val)                                                                            \
+  (struct tr_value) { .type = VAL_BOOL, .b = val }
+#define STR_VALUE(val)                                                                             \
+  (struct tr_value) { .type = VAL_STR, .s = val }
+#define PTR_VALUE(val)                                                                             \
+  (struct tr_value) { .type = VAL_PTR, .p = val }
+#define CFUNC_VALUE(val)                                                                           \
+  (struct tr_value) { .type = VAL_CFUNC, .func = val }
 
 #define NIL_VAL                                                                                    \
   (struct tr_value) { .type = VAL_NIL }
 
+#else // TR_NAN_BOXING
+
+// A value is one 64-bit word. Anything whose top 16 bits are not one of the
+// tags below (quiet NaNs with bits 48-50 set) is a double; the tagged patterns
+// carry a 48-bit payload: a pointer, a bool, or a long truncated to 48 bits and
+// sign-extended on the way out. Hardware NaNs never carry a tag, so every
+// double round-trips.
+struct tr_value {
+  uint64_t bits;
+};
+
+_Static_assert(sizeof(double) == sizeof(uint64_t), "NaN boxing needs 64-bit doubles");
+
+#define TR_NAN_PAYLOAD 0x0000ffffffffffffULL
+
+// Top 16 bits of each tagged type.
+#define TR_NAN_NIL 0x7ff9
+#define TR_NAN_STR 0x7ffa
+#define TR_NAN_LNG 0x7ffb
+#define TR_NAN_PTR 0x7ffc
+#define TR_NAN_BOOL 0x7ffd
+#define TR_NAN_CFUNC 0x7ffe
+#define TR_NAN_OBJ 0x7fff
+
+#define TR_NAN_TOP(v) ((unsigned)((v).bits >> 48))
+
+inline int tr_value_type(struct tr_value v) {
+  switch (TR_NAN_TOP(v)) {
+  case TR_NAN_NIL:
+    return VAL_NIL;
+  case TR_NAN_STR:
+    return VAL_STR;
+  case TR_NAN_LNG:
+    return VAL_LNG;
+  case TR_NAN_PTR:
+    return VAL_PTR;
+  case TR_NAN_BOOL:
+    return VAL_BOOL;
+  case TR_NAN_CFUNC:
+    return VAL_CFUNC;
+  case TR_NAN_OBJ:
+    return VAL_OBJ;
+  default:
+    return VAL_DBL;
+  }
+}
+
+inline struct tr_value tr__nan_box(uint64_t top, uint64_t payload) {
+  return (struct tr_value){top << 48 | (payload & TR_NAN_PAYLOAD)};
+}
+
+inline double tr__nan_dbl(struct tr_value v) {
+  double d;
+  memcpy(&d, &v.bits, sizeof(d));
+  return d;
+}
+
+inline struct tr_value tr__nan_from_dbl(double d) {
+  struct tr_value v;
+  memcpy(&v.bits, &d, sizeof(d));
+  return v;
+}
+
+#define AS_STR(v) ((struct tr_string*)(uintptr_t)((v).bits & TR_NAN_PAYLOAD))
+#define AS_BOOL(v) ((bool)((v).bits & 1))
+#define AS_LNG(v) ((long)((int64_t)((v).bits << 16) >> 16))
+#define AS_DBL(v) tr__nan_dbl(v)
+#define AS_PTR(v) ((void*)(uintptr_t)((v).bits & TR_NAN_PAYLOAD))
+#define AS_OBJ(v) ((struct tr_object*)(uintptr_t)((v).bits & TR_NAN_PAYLOAD))
+#define AS_CFUNC(v) ((tr_cfunc)(uintptr_t)((v).bits & TR_NAN_PAYLOAD))
+
+#define OBJ_VALUE(val) tr__nan_box(TR_NAN_OBJ, (uintptr_t)(struct tr_object*)(val))
+#define INT_VALUE(val) tr__nan_box(TR_NAN_LNG, (uint64_t)(long)(val))
+#define DOUBLE_VALUE(val) tr__nan_from_dbl(val)
+#define BOOL_VALUE(val) tr__nan_box(TR_NAN_BOOL, (val) ? 1 : 0)
+#define STR_VALUE(val) tr__nan_box(TR_NAN_STR, (uintptr_t)(val))
+#define PTR_VALUE(val) tr__nan_box(TR_NAN_PTR, (uintptr_t)(val))
+#define CFUNC_VALUE(val) tr__nan_box(TR_NAN_CFUNC, (uintptr_t)(val))
+
+#define NIL_VAL                                                                                    \
+  (struct tr_value) { (uint64_t)TR_NAN_NIL << 48 }
+
+#define IS_NIL(v) (TR_NAN_TOP(v) == TR_NAN_NIL)
+#define IS_STR(v) (TR_NAN_TOP(v) == TR_NAN_STR)
+#define IS_LNG(v) (TR_NAN_TOP(v) == TR_NAN_LNG)
+#define IS_DBL(v) (TR_NAN_TOP(v) - TR_NAN_NIL > TR_NAN_OBJ - TR_NAN_NIL)
+#define IS_BOOL(v) (TR_NAN_TOP(v) == TR_NAN_BOOL)
+#define IS_OBJ(v) (TR_NAN_TOP(v) == TR_NAN_OBJ)
+#define IS_CFUNC(v) (TR_NAN_TOP(v) == TR_NAN_CFUNC)
+#define IS_PTR(v) (TR_NAN_TOP(v) == TR_NAN_PTR)
+
+#endif // TR_NAN_BOXING
+
+// Whether a long survives INT_VALUE. Under NaN boxing only the 48-bit payload
+// does; anything wider would come back truncated.
+#ifdef TR_NAN_BOXING
+#define TR_LNG_MIN (-(1L << 47))
+#define TR_LNG_MAX ((1L << 47) - 1)
+#define TR_LNG_FITS(l) ((l) >= TR_LNG_MIN && (l) <= TR_LNG_MAX)
+#else
+#define TR_LNG_FITS(l) true
+#endif
+
+// Integer arithmetic as scripts see it: wraps like the machine, except that
+// a result that does not fit a value is an overflow. Each returns false on
+// overflow. tr_lng_div expects the caller to have ruled out a zero divisor
+// and LONG_MIN / -1.
+inline bool tr_lng_add(long a, long b, long* out) {
+  *out = (long)((unsigned long)a + (unsigned long)b);
+  return TR_LNG_FITS(*out);
+}
+
+inline bool tr_lng_sub(long a, long b, long* out) {
+  *out = (long)((unsigned long)a - (unsigned long)b);
+  return TR_LNG_FITS(*out);
+}
+
+inline bool tr_lng_mul(long a, long b, long* out) {
+#ifdef TR_NAN_BOXING
+  // A wrapped 64-bit product can land back inside 48 bits.
+  return !__builtin_mul_overflow(a, b, out) && TR_LNG_FITS(*out);
+#else
+  *out = (long)((unsigned long)a * (unsigned long)b);
+  return true;
+#endif
+}
+
+inline bool tr_lng_div(long a, long b, long* out) {
+  *out = a / b;
+  return TR_LNG_FITS(*out);
+}
+
+inline bool tr_lng_neg(long a, long* out) {
+  *out = (long)(0UL - (unsigned long)a);
+  return TR_LNG_FITS(*out);
+}
+
+// Held by global slots that have a name but no definition yet. Scripts cannot
+// make pointer values, so no value they store looks like it.
+#define UNDEF_VAL PTR_VALUE(NULL)
+#define IS_UNDEF(v) IS_PTR(v)
+
 inline bool tr_value_is_falsey(struct tr_value v) {
-  switch (v.type) {
+  switch (tr_value_type(v)) {
   case VAL_NIL:
     return true;
   case VAL_LNG:
-    return v.l == 0;
+    return AS_LNG(v) == 0;
   case VAL_DBL:
-    return v.d == 0;
+    return AS_DBL(v) == 0;
   case VAL_PTR:
-    return v.p == NULL;
+    return AS_PTR(v) == NULL;
   case VAL_BOOL:
-    return v.b;
+    return !AS_BOOL(v);
   default:
     return false;
   }
 }
 
 inline bool tr_value_eq(struct tr_value a, struct tr_value b) {
-  if (a.type != b.type)
+  if (tr_value_type(a) != tr_value_type(b))
     return false;
-  switch (a.type) {
+  switch (tr_value_type(a)) {
   case VAL_NIL:
     return true;
   case VAL_BOOL:
-    return a.b == b.b;
+    return AS_BOOL(a) == AS_BOOL(b);
   case VAL_LNG:
-    return a.l == b.l;
+    return AS_LNG(a) == AS_LNG(b);
   case VAL_DBL:
-    return a.d == b.d;
+    return AS_DBL(a) == AS_DBL(b);
   case VAL_STR:
-    return a.s.hash == b.s.hash;
+    return AS_STR(a) == AS_STR(b);
   default:
     return false;
   }
 }
 
-void tr_string_cpy(struct tr_string* s, const char* str);
-void tr_string_ncpy(struct tr_string* s, const char* str, int len);
-void tr_string_new(struct tr_string* s, int capacity);
-struct tr_string* tr_string_new_cpy(struct tr_string* s);
-struct tr_string* tr_string_new_ncpy(const char* str, int len);
-void tr_string_free(struct tr_string* s);
 void tr_string_hash(struct tr_string* s);
+uint32_t tr_string__hash(const char* key, uint32_t len, uint32_t seed);
 #endif
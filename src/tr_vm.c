@@ -1,12 +1,16 @@
 #include "tr_vm.h"
 
 #include "memory.h"
+#include "tr_cache.h"
 #include "tr_debug.h"
 #include "tr_opcode.h"
+#include "tr_opt.h"
 #include "tr_value.h"
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 static int tr_vm_do_call_frame(struct tr_vm* vm, struct tr_call_frame* frame);
 
@@ -14,21 +18,37 @@ void tr_chunk_init(struct tr_chunk* chunk) {
   chunk->count        = 0;
   chunk->capacity     = 0;
   chunk->instructions = NULL;
+  chunk->lines        = NULL;
   tr_constants_init(&chunk->constants);
 }
 
 void tr_chunk_free(struct tr_chunk* chunk) {
-  mem_free(chunk->instructions);
+  if (chunk->capacity > 0)
+    mem_free(chunk->lines, (sizeof(int) + 1) * chunk->capacity);
+  tr_constants_free(&chunk->constants);
   tr_chunk_init(chunk);
 }
 
-void tr_chunk_add(struct tr_chunk* chunk, uint8_t instruction) {
-  if (chunk->capacity < chunk->count + 1) {
-    int new = chunk->capacity == 0 ? 8 : chunk->capacity * 2;
-    chunk->instructions =
-        mem_realloc(chunk->instructions, sizeof(uint8_t) * chunk->capacity, sizeof(uint8_t) * new);
-    chunk->capacity = new;
+// Lines and instructions share one block, so growing is a single allocation
+// and a failed one leaves the chunk as it was.
+void tr_chunk_reserve(struct tr_chunk* chunk, int capacity) {
+  int* lines            = mem_alloc((sizeof(int) + 1) * capacity);
+  uint8_t* instructions = (uint8_t*)(lines + capacity);
+  if (chunk->count > 0) {
+    memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+    memcpy(instructions, chunk->instructions, chunk->count);
   }
+  if (chunk->capacity > 0)
+    mem_free(chunk->lines, (sizeof(int) + 1) * chunk->capacity);
+  chunk->lines        = lines;
+  chunk->instructions = instructions;
+  chunk->capacity     = capacity;
+}
+
+void tr_chunk_add(struct tr_chunk* chunk, uint8_t instruction, int line) {
+  if (chunk->capacity < chunk->count + 1)
+    tr_chunk_reserve(chunk, chunk->capacity == 0 ? 8 : chunk->capacity * 2);
+  chunk->lines[chunk->count]          = line;
   chunk->instructions[chunk->count++] = instruction;
 }
 
@@ -38,12 +58,7 @@ void tr_constants_init(struct tr_constants* constants) {
   constants->values   = NULL;
 }
 void tr_constants_free(struct tr_constants* constants) {
-  for (int i = 0; i < constants->count; i++) {
-    if (constants->values[i].type == VAL_STR) {
-      mem_free(constants->values[i].s.str);
-    }
-  }
-  mem_free(constants->values);
+  mem_free(constants->values, sizeof(struct tr_value) * constants->capacity);
 }
 int tr_constants_add(struct tr_constants* constants, struct tr_value val) {
   if (constants->capacity < constants->count + 1) {
@@ -59,6 +74,103 @@ int tr_constants_add(struct tr_constants* constants, struct tr_value val) {
   return ret;
 }
 
+static bool constant_dedups(struct tr_value v) {
+  switch (tr_value_type(v)) {
+  case VAL_LNG:
+  case VAL_DBL:
+  case VAL_BOOL:
+  case VAL_STR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Doubles are compared bitwise, so 0.0 and -0.0 stay distinct.
+static uint64_t constant_bits(struct tr_value v) {
+  uint64_t bits = 0;
+  switch (tr_value_type(v)) {
+  case VAL_LNG:
+    bits = (uint64_t)AS_LNG(v);
+    break;
+  case VAL_DBL: {
+    double d = AS_DBL(v);
+    memcpy(&bits, &d, sizeof(d));
+    break;
+  }
+  case VAL_BOOL:
+    bits = AS_BOOL(v);
+    break;
+  case VAL_STR:
+    bits = (uint64_t)(uintptr_t)AS_STR(v);
+    break;
+  }
+  return bits;
+}
+
+static uint32_t constant_hash(struct tr_value v) {
+  uint64_t h = (constant_bits(v) ^ (uint64_t)tr_value_type(v) << 59) * 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)(h >> 32);
+}
+
+static bool constant_eq(struct tr_value a, struct tr_value b) {
+  return tr_value_type(a) == tr_value_type(b) && constant_bits(a) == constant_bits(b);
+}
+
+void tr_constants_index_init(struct tr_constants_index* index, struct mem_arena* arena) {
+  index->slots    = NULL;
+  index->capacity = 0;
+  index->count    = 0;
+  index->arena    = arena;
+}
+
+static void index_put(struct tr_constants_index* index, uint32_t hash, int id) {
+  uint32_t mask = (uint32_t)index->capacity - 1;
+  uint32_t i    = hash & mask;
+  while (index->slots[i] != 0)
+    i = (i + 1) & mask;
+  index->slots[i] = id + 1;
+  index->count++;
+}
+
+// Rebuilt from the pool, which also drops stale entries.
+static void index_grow(struct tr_constants_index* index, struct tr_constants* constants) {
+  int capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+  while (constants->count * 4 >= capacity * 3)
+    capacity *= 2;
+  index->slots    = mem_arena_alloc(index->arena, sizeof(int) * capacity);
+  index->capacity = capacity;
+  index->count    = 0;
+  memset(index->slots, 0, sizeof(int) * capacity);
+  for (int i = 0; i < constants->count; i++) {
+    if (constant_dedups(constants->values[i]))
+      index_put(index, constant_hash(constants->values[i]), i);
+  }
+}
+
+int tr_constants_add_unique(struct tr_constants* constants, struct tr_constants_index* index,
+                            struct tr_value val, bool* fresh) {
+  *fresh = true;
+  if (!constant_dedups(val))
+    return tr_constants_add(constants, val);
+  uint32_t hash = constant_hash(val);
+  if (index->capacity > 0) {
+    uint32_t mask = (uint32_t)index->capacity - 1;
+    for (uint32_t i = hash & mask; index->slots[i] != 0; i = (i + 1) & mask) {
+      int id = index->slots[i] - 1;
+      if (id < constants->count && constant_eq(constants->values[id], val)) {
+        *fresh = false;
+        return id;
+      }
+    }
+  }
+  if ((index->count + 1) * 4 > index->capacity * 3)
+    index_grow(index, constants);
+  int id = tr_constants_add(constants, val);
+  index_put(index, hash, id);
+  return id;
+}
+
 struct tr_value* tr_constants_get(struct tr_constants* constants, int index) {
   if (index < 0 || index >= constants->count) {
     return NULL;
@@ -66,64 +178,239 @@ struct tr_value* tr_constants_get(struct tr_constants* constants, int index) {
   return &constants->values[index];
 }
 
-struct tr_func* tr_func_new() {
+struct tr_func* tr_func_new(struct tr_vm* vm) {
   struct tr_func* func = mem_alloc(sizeof(*func));
   tr_object_init(&func->obj, OBJ_FUNC);
   func->obj.destruct = tr_func_destroy;
   func->arity        = 0;
   func->name         = NULL;
   func->type         = TYPE_FUNC;
+  func->upvalue_count = 0;
+  func->max_locals   = 0;
+  func->max_stack    = 0;
+  func->enclosing    = NULL;
+  func->calls        = NULL;
+  func->call_mask    = 0;
   tr_chunk_init(&func->chunk);
-  memset(func->locals.locals, 0, sizeof(struct tr_local) * (UINT8_MAX + 1));
-  func->locals.localCount = 0;
-  func->locals.scopeDepth = 0;
+  tr_gc_track(vm, &func->obj);
   return func;
 }
 
 void tr_func_destroy(struct tr_object* obj) {
   struct tr_func* func = (struct tr_func*)obj;
+  if (func->calls != NULL)
+    mem_free(func->calls, sizeof(*func->calls) * (func->call_mask + 1));
   tr_chunk_free(&func->chunk);
-  if (func->name != NULL) {
-    tr_string_free(func->name);
-  }
-  for (int i = 1; i < func->locals.localCount; i++) {
-    mem_free(func->locals.locals[i].name.start);
-  }
-  mem_free(func);
+  mem_free(func, sizeof(*func));
 }
 
-struct tr_closure* tr_closure_new(struct tr_func* func) {
+struct tr_closure* tr_closure_new(struct tr_vm* vm, struct tr_func* func) {
   struct tr_closure* c = mem_alloc(sizeof(*c));
   tr_object_init(&c->obj, OBJ_CLOSURE);
-  c->func = func;
-  c->obj.destruct = tr_closure_free;
+  c->func         = func;
+  c->obj.destruct = (void (*)(struct tr_object*))tr_closure_free;
+  tr_gc_track(vm, &c->obj);
   return c;
 }
-void tr_closure_free(struct tr_closure* c) { mem_free(c); }
+void tr_closure_free(struct tr_closure* c) { mem_free(c, sizeof(*c)); }
 
-static void vm_reset_stack(struct tr_vm* vm) { vm->stackTop = vm->stack; }
+static void vm_reset_stack(struct tr_vm* vm) {
+  vm->stackTop    = vm->stack;
+  vm->frame_count = 0;
+}
+
+// Both arrays move when they grow. Frames hold pointers into the stack, so
+// those (and stackTop) are rebased; callers reload any copies they keep.
+static void vm_grow_stack(struct tr_vm* vm, int capacity) {
+  struct tr_value* old = vm->stack;
+  vm->stack          = mem_realloc(old, sizeof(*old) * vm->stack_capacity, sizeof(*old) * capacity);
+  vm->stack_capacity = capacity;
+#define REBASE(p) ((struct tr_value*)((char*)vm->stack + ((char*)(p) - (char*)old)))
+  vm->stackTop = REBASE(vm->stackTop);
+  for (int i = 0; i < vm->frame_count; i++)
+    vm->frames[i].slots = REBASE(vm->frames[i].slots);
+#undef REBASE
+}
 
-void tr_vm_add_cfunc(struct tr_vm* vm, const char* s, tr_cfunc func) {
-  struct tr_value v = (struct tr_value){.type = VAL_CFUNC, .func = func};
-  struct tr_string k;
-  tr_string_cpy(&k, s);
-  tr_table_insert(&vm->globals, &k, v);
-  tr_string_free(&k);
+static void vm_grow_frames(struct tr_vm* vm, int capacity) {
+  vm->frames         = mem_realloc(vm->frames, sizeof(*vm->frames) * vm->frame_capacity,
+                                   sizeof(*vm->frames) * capacity);
+  vm->frame_capacity = capacity;
 }
 
-struct tr_vm* tr_vm_new() {
-  struct tr_vm* vm = mem_alloc(sizeof(*vm));
-  tr_vm_init(vm);
+// Runs fn in vm's context. From the host an allocation failure makes this
+// return false; inside a compile or run (which have their own on_error) it
+// goes to that handler as usual.
+static bool vm_protect(struct tr_vm* vm, void (*fn)(void* arg), void* arg) {
+  if (vm->mem.on_error == NULL)
+    return mem_protect(&vm->mem, fn, arg);
+  struct mem_ctx* prev = mem_use(&vm->mem);
+  fn(arg);
+  mem_use(prev);
+  return true;
+}
+
+bool tr_vm_add_cfunc(struct tr_vm* vm, const char* s, tr_cfunc func) {
+  struct tr_string* name = tr_vm_intern(vm, s, strlen(s));
+  int slot               = name != NULL ? tr_vm_global_slot(vm, name) : -1;
+  if (slot < 0)
+    return false;
+  vm->global_values[slot] = CFUNC_VALUE(func);
+  return true;
+}
+
+struct global_slot_args {
+  struct tr_vm* vm;
+  struct tr_string* name;
+  int slot;
+};
+
+// Each allocation below comes before anything it would leave half done, so
+// a failure can abandon it at any point.
+static void add_global(void* arg) {
+  struct global_slot_args* a = arg;
+  struct tr_vm* vm           = a->vm;
+  if (vm->global_count == vm->global_capacity) {
+    // Values and names share one block, so growing is a single allocation.
+    int old                  = vm->global_capacity;
+    int cap                  = old == 0 ? 8 : old * 2;
+    size_t each              = sizeof(*vm->global_values) + sizeof(*vm->global_names);
+    struct tr_value* values  = mem_alloc(each * cap);
+    struct tr_string** names = (struct tr_string**)(values + cap);
+    if (old > 0) {
+      memcpy(values, vm->global_values, sizeof(*values) * vm->global_count);
+      memcpy(names, vm->global_names, sizeof(*names) * vm->global_count);
+    }
+    mem_free(vm->global_values, each * old);
+    vm->global_values   = values;
+    vm->global_names    = names;
+    vm->global_capacity = cap;
+  }
+  int idx = vm->global_count;
+  tr_table_insert(&vm->globals, a->name, INT_VALUE(idx));
+  vm->global_values[idx] = UNDEF_VAL;
+  vm->global_names[idx]  = a->name;
+  vm->global_count++;
+  a->slot = idx;
+}
+
+int tr_vm_global_slot(struct tr_vm* vm, struct tr_string* name) {
+  struct tr_value slot;
+  if (tr_table_get(&vm->globals, name, &slot))
+    return (int)AS_LNG(slot);
+  if (vm->global_count == GLOBALS_MAX)
+    return -1;
+  struct global_slot_args a = {vm, name, -1};
+  vm_protect(vm, add_global, &a);
+  return a.slot;
+}
+
+struct intern_args {
+  struct tr_vm* vm;
+  const char* chars;
+  int len;
+  uint32_t hash;
+  struct tr_string* s;
+};
+
+static void intern(void* arg) {
+  struct intern_args* a = arg;
+  // Room in the table first: once the string exists nothing may fail. The
+  // characters share the header's block.
+  tr_table_reserve(&a->vm->strings, 1);
+  struct tr_string* s = mem_alloc(sizeof(*s) + a->len + 1);
+  s->str              = (char*)(s + 1);
+  s->len              = a->len;
+  s->hash             = a->hash;
+  memcpy(s->str, a->chars, a->len);
+  s->str[a->len] = '\0';
+  tr_table_insert(&a->vm->strings, s, NIL_VAL);
+  a->s = s;
+}
+
+struct tr_string* tr_vm_intern(struct tr_vm* vm, const char* chars, int len) {
+  uint32_t hash       = tr_string__hash(chars, len, 0);
+  struct tr_string* s = tr_table_find_string(&vm->strings, chars, len, hash);
+  if (s != NULL)
+    return s;
+  struct intern_args a = {vm, chars, len, hash, NULL};
+  vm_protect(vm, intern, &a);
+  return a.s;
+}
+
+static void vm_init_stacks(void* arg) {
+  struct tr_vm* vm = arg;
+  // Calls, the script's own included, grow these as they need.
+  vm_grow_stack(vm, STACK_INIT);
+  vm_grow_frames(vm, FRAMES_INIT);
+}
+
+struct tr_vm* tr_vm_new(const struct mem_allocator* alloc) {
+  // The struct itself comes from the allocator too, so it is counted. Without
+  // one it is a libc block, since the vm's own slabs live inside it.
+  struct mem_allocator a = alloc != NULL ? *alloc : mem_default_allocator;
+  struct tr_vm* vm       = a.alloc(a.ud, sizeof(*vm));
+  if (vm == NULL)
+    return NULL;
+  mem_ctx_init(&vm->mem, alloc);
+  vm->mem.live = vm->mem.peak = sizeof(*vm);
+  vm->stack                   = NULL;
+  vm->stackTop                = NULL;
+  vm->stack_capacity          = 0;
+  vm->frames                  = NULL;
+  vm->frame_capacity          = 0;
+  vm->frame_count             = 0;
+  tr_table_init(&vm->globals);
+  vm->global_values   = NULL;
+  vm->global_names    = NULL;
+  vm->global_count    = 0;
+  vm->global_capacity = 0;
+  vm->images          = NULL;
+  memset(&vm->call_stats, 0, sizeof(vm->call_stats));
+  tr_table_init(&vm->strings);
+  tr_gc_init(vm);
+  if (!mem_protect(&vm->mem, vm_init_stacks, vm)) {
+    tr_vm_free(vm);
+    return NULL;
+  }
+  vm_reset_stack(vm);
   return vm;
 }
 
-void tr_vm_init(struct tr_vm* vm) {
-  vm->frame_count = 0;
+void tr_vm_free(struct tr_vm* vm) {
+  struct mem_ctx* prev = mem_use(&vm->mem);
+  tr_gc_free(vm);
+  tr_cache_release(vm);
+  tr_table_free(&vm->globals);
+  mem_free(vm->global_values,
+           (sizeof(*vm->global_values) + sizeof(*vm->global_names)) * vm->global_capacity);
+  for (int i = 0; i < vm->strings.capacity; i++) {
+    struct tr_string* s = vm->strings.entries[i].key;
+    if (s != NULL)
+      mem_free(s, sizeof(*s) + s->len + 1);
+  }
+  tr_table_free(&vm->strings);
+  mem_free(vm->stack, sizeof(*vm->stack) * vm->stack_capacity);
+  mem_free(vm->frames, sizeof(*vm->frames) * vm->frame_capacity);
+  mem_use(prev);
+  struct mem_allocator a = vm->mem.allocator;
+  if (a.ud == &vm->mem.slabs)
+    a = mem_default_allocator;
+  mem_ctx_free(&vm->mem);
+  a.free(a.ud, vm, sizeof(*vm));
+}
+
+void tr_vm_reset(struct tr_vm* vm) {
+  for (int i = 0; i < vm->global_count; i++)
+    vm->global_values[i] = UNDEF_VAL;
   vm_reset_stack(vm);
-  tr_table_init(&vm->globals);
 }
 
-void tr_vm_free(struct tr_vm* vm) { tr_vm_init(vm); }
+void tr_vm_set_memory_limit(struct tr_vm* vm, size_t bytes) { vm->mem.limit = bytes; }
+
+size_t tr_vm_memory_live(struct tr_vm* vm) { return vm->mem.live; }
+
+size_t tr_vm_memory_peak(struct tr_vm* vm) { return vm->mem.peak; }
 
 void tr_vm_push(struct tr_vm* vm, struct tr_value val) {
   *vm->stackTop = val;
@@ -132,7 +419,7 @@ void tr_vm_push(struct tr_vm* vm, struct tr_value val) {
 
 struct tr_value tr_vm_pop(struct tr_vm* vm) {
   if (vm->stackTop == vm->stack) {
-    return (struct tr_value){.type = VAL_PTR, .p = NULL};
+    return PTR_VALUE(NULL);
   }
   vm->stackTop--;
   return *vm->stackTop;
@@ -146,79 +433,323 @@ static void tr_vm_runtime_err(struct tr_vm* vm, const char* format, ...) {
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
+  for (int i = vm->frame_count - 1; i >= 0; i--) {
+    struct tr_call_frame* f = &vm->frames[i];
+    struct tr_func* fn      = f->func->func;
+    int at                  = (int)(f->ip - fn->chunk.instructions) - 1;
+    fprintf(stderr, "[%d] in %s\n", fn->chunk.lines[at < 0 ? 0 : at],
+            fn->name != NULL ? fn->name->str : "script");
+  }
   vm_reset_stack(vm);
 }
 
-static inline long tr_vm_ipop(struct tr_vm* vm) { return tr_vm_pop(vm).l; }
-static inline double tr_vm_fpop(struct tr_vm* vm) { return tr_vm_pop(vm).d; }
+// The interpreter loop keeps ip, slots and the stack top in locals (ip, slots,
+// sp); these macros work on those copies. SAVE_STATE/LOAD_STATE sync them with
+// the frame and vm around calls, returns and errors.
+#ifndef TR_NO_STATE_CACHE
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define SYNC_STATE() ((void)0)
+#else
+// For comparison only (bench_vm_nocache): the costs of the loop before the
+// state was cached. Pushes and pops are calls through the stack top in memory,
+// and ip is stored to and reloaded from the frame around every instruction.
+#ifdef __GNUC__
+#define TR_NOINLINE __attribute__((noinline))
+#else
+#define TR_NOINLINE
+#endif
+static TR_NOINLINE void slow_push(struct tr_value** sp, struct tr_value v) { *(*sp)++ = v; }
+static TR_NOINLINE struct tr_value slow_pop(struct tr_value** sp) { return *--*sp; }
+#define PUSH(v) slow_push(&sp, (v))
+#define POP() slow_pop(&sp)
+#define SYNC_STATE()                                                                               \
+  (*(uint8_t* volatile*)&frame->ip = ip, ip = *(uint8_t* volatile*)&frame->ip)
+#endif
+#define PEEK(n) (sp[-1 - (n)])
 
-#define IBINARY_OP(op)                                                                             \
+// dst = fn(a, b) for one of the tr_lng_* helpers, raising if it overflowed.
+#define INT_OP(dst, fn, a, b)                                                                      \
   do {                                                                                             \
-    long a = tr_vm_ipop(vm);                                                                       \
-    long b = tr_vm_ipop(vm);                                                                       \
-    tr_vm_push(vm, (struct tr_value){.type = VAL_LNG, .l = a op b});                               \
+    long res;                                                                                      \
+    if (!fn((a), (b), &res))                                                                       \
+      RUNTIME_ERROR("Integer overflow.");                                                          \
+    (dst) = INT_VALUE(res);                                                                        \
+  } while (0)
+
+#define IBINARY_OP(fn)                                                                             \
+  do {                                                                                             \
+    long b = AS_LNG(POP());                                                                        \
+    INT_OP(sp[-1], fn, AS_LNG(sp[-1]), b);                                                         \
   } while (0)
 
 #define FBINARY_OP(op)                                                                             \
   do {                                                                                             \
-    double a = tr_vm_fpop(vm);                                                                     \
-    double b = tr_vm_fpop(vm);                                                                     \
-    tr_vm_push(vm, (struct tr_value){.type = VAL_DBL, .d = (double)((double)a op(double) b)});     \
+    double b = AS_DBL(POP());                                                                      \
+    sp[-1]   = DOUBLE_VALUE(AS_DBL(sp[-1]) op b);                                                  \
   } while (0)
 
-#define VALUE_OP(op)                                                                               \
+// Type feedback: a generic op that just saw operands of one type rewrites
+// its opcode byte (n bytes back from ip) into the form specialized for it.
+#ifdef TR_NO_QUICKEN
+#define QUICKEN(n, op) ((void)0)
+#else
+#define QUICKEN(n, op) (ip[-(n)] = (op))
+#endif
+
+// Generic arithmetic: int with int stays int, numbers otherwise go through
+// double. Expands inside the interpreter loop, so it can raise errors.
+#define ARITH_OP(op, int_fn, int_op, dbl_op)                                                       \
   do {                                                                                             \
-    if (a.type != b.type)                                                                          \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = false});                             \
-    break;                                                                                         \
-    switch (a.type) {                                                                              \
-    case VAL_BOOL:                                                                                 \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = a.l op b.l});                        \
-      break;                                                                                       \
-    case VAL_LNG:                                                                                  \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = a.l op b.l});                        \
-      break;                                                                                       \
-    case VAL_DBL:                                                                                  \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = a.d op b.d});                        \
-      break;                                                                                       \
-    case VAL_STR:                                                                                  \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = a.s.hash op b.s.hash});              \
-      break;                                                                                       \
-    default:                                                                                       \
-      tr_vm_push(vm, (struct tr_value){.type = VAL_BOOL, .b = false});                             \
-      break;                                                                                       \
+    struct tr_value b = POP();                                                                     \
+    struct tr_value a = sp[-1];                                                                    \
+    if (IS_LNG(a) && IS_LNG(b)) {                                                                  \
+      INT_OP(sp[-1], int_fn, AS_LNG(a), AS_LNG(b));                                                \
+      QUICKEN(1, int_op);                                                                          \
+    } else if (IS_DBL(a) && IS_DBL(b)) {                                                           \
+      sp[-1] = DOUBLE_VALUE(AS_DBL(a) op AS_DBL(b));                                               \
+      QUICKEN(1, dbl_op);                                                                          \
+    } else if (is_number(a) && is_number(b)) {                                                     \
+      sp[-1] = DOUBLE_VALUE(as_double(a) op as_double(b));                                         \
+    } else {                                                                                       \
+      RUNTIME_ERROR("Operands must be numbers.");                                                  \
     }                                                                                              \
   } while (0)
 
+// A quickened op: runs if both operands pass is, otherwise reverts to
+// generic and backs ip up so the generic op handles this execution.
+#define QUICK_OP(is, as, make, op, generic)                                                        \
+  do {                                                                                             \
+    if (is(sp[-2]) && is(sp[-1])) {                                                                \
+      sp[-2] = make(as(sp[-2]) op as(sp[-1]));                                                     \
+      sp--;                                                                                        \
+    } else {                                                                                       \
+      ip[-1] = (generic);                                                                          \
+      ip--;                                                                                        \
+    }                                                                                              \
+  } while (0)
 
-static bool call(struct tr_vm* vm, struct tr_closure* c, int arg_count) {
-  if (arg_count != c->func->arity) {
-    tr_vm_runtime_err(vm, "Expected %d arguments recieved %d.", c->func->arity, arg_count);
+// QUICK_OP for ints, computing through fn so overflow is caught.
+#define QUICK_IOP(fn, generic)                                                                     \
+  do {                                                                                             \
+    if (IS_LNG(sp[-2]) && IS_LNG(sp[-1])) {                                                        \
+      INT_OP(sp[-2], fn, AS_LNG(sp[-2]), AS_LNG(sp[-1]));                                          \
+      sp--;                                                                                        \
+    } else {                                                                                       \
+      ip[-1] = (generic);                                                                          \
+      ip--;                                                                                        \
+    }                                                                                              \
+  } while (0)
+
+// Generic comparison of numbers, leaving the result in holds.
+#define COMPARE(a, b, rel, holds)                                                                  \
+  do {                                                                                             \
+    if (IS_LNG(a) && IS_LNG(b))                                                                    \
+      holds = AS_LNG(a) rel AS_LNG(b);                                                             \
+    else if (is_number(a) && is_number(b))                                                         \
+      holds = as_double(a) rel as_double(b);                                                       \
+    else                                                                                           \
+      RUNTIME_ERROR("Operands must be numbers.");                                                  \
+  } while (0)
+
+#define COMPARE_OP(rel)                                                                            \
+  do {                                                                                             \
+    struct tr_value b = POP();                                                                     \
+    bool holds;                                                                                    \
+    COMPARE(sp[-1], b, rel, holds);                                                                \
+    sp[-1] = BOOL_VALUE(holds);                                                                    \
+  } while (0)
+
+// Generic compare-and-branch; quickens to the int or double form.
+#define BRANCH_OP(rel, int_op, dbl_op)                                                             \
+  do {                                                                                             \
+    struct tr_value a = sp[-2], b = sp[-1];                                                        \
+    uint32_t offset   = READ_LONG();                                                               \
+    bool holds;                                                                                    \
+    COMPARE(a, b, rel, holds);                                                                     \
+    if (IS_LNG(a) && IS_LNG(b))                                                                    \
+      QUICKEN(4, int_op);                                                                          \
+    else if (IS_DBL(a) && IS_DBL(b))                                                               \
+      QUICKEN(4, dbl_op);                                                                          \
+    sp -= 2;                                                                                       \
+    if (!holds)                                                                                    \
+      ip += offset;                                                                                \
+  } while (0)
+
+// Typed compare-and-branch; operands of another type revert it to generic.
+#define QUICK_BRANCH(is, as, rel, generic)                                                         \
+  do {                                                                                             \
+    if (is(sp[-2]) && is(sp[-1])) {                                                                \
+      uint32_t offset = READ_LONG();                                                               \
+      bool holds      = as(sp[-2]) rel as(sp[-1]);                                                 \
+      sp -= 2;                                                                                     \
+      if (!holds)                                                                                  \
+        ip += offset;                                                                              \
+    } else {                                                                                       \
+      ip[-1] = (generic);                                                                          \
+      ip--;                                                                                        \
+    }                                                                                              \
+  } while (0)
+
+// Counted loop step: counter += 1, then back to the body while counter <
+// limit. limit is evaluated after the increment, as the loop condition was.
+#define FOR_INC_LT(counter, limit)                                                                 \
+  do {                                                                                             \
+    struct tr_value* i = (counter);                                                                \
+    uint32_t offset    = READ_LONG();                                                              \
+    bool holds;                                                                                    \
+    if (IS_LNG(*i))                                                                                \
+      INT_OP(*i, tr_lng_add, AS_LNG(*i), 1);                                                       \
+    else if (IS_DBL(*i))                                                                           \
+      *i = DOUBLE_VALUE(AS_DBL(*i) + 1);                                                           \
+    else                                                                                           \
+      RUNTIME_ERROR("Operands must be numbers.");                                                  \
+    struct tr_value n = (limit);                                                                   \
+    COMPARE(*i, n, <, holds);                                                                      \
+    if (holds)                                                                                     \
+      ip -= offset;                                                                                \
+  } while (0)
+
+static int32_t read_i32(const uint8_t* p) {
+  return (int32_t)((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+// Index of key among a switch's n sorted keys, or -1.
+static int lookup_key(const uint8_t* keys, int n, long key) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    long k  = read_i32(keys + 4 * mid);
+    if (k == key)
+      return mid;
+    if (k < key)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return -1;
+}
+
+static bool is_number(struct tr_value v) { return IS_LNG(v) || IS_DBL(v); }
+
+static double as_double(struct tr_value v) { return IS_LNG(v) ? (double)AS_LNG(v) : AS_DBL(v); }
+
+// Integer a / b that C leaves undefined; the interpreter raises an error.
+static const char* int_div_error(struct tr_value a, struct tr_value b) {
+  if (!IS_LNG(a) || !IS_LNG(b))
+    return NULL;
+  if (AS_LNG(b) == 0)
+    return "Division by zero.";
+  if (AS_LNG(b) == -1 && AS_LNG(a) == LONG_MIN)
+    return "Integer overflow in division.";
+  return NULL;
+}
+
+static bool values_equal(struct tr_value a, struct tr_value b) {
+  if (tr_value_type(a) != tr_value_type(b))
     return false;
+  switch (tr_value_type(a)) {
+  case VAL_NIL:
+    return true;
+  case VAL_BOOL:
+    return AS_BOOL(a) == AS_BOOL(b);
+  case VAL_LNG:
+    return AS_LNG(a) == AS_LNG(b);
+  case VAL_DBL:
+    return AS_DBL(a) == AS_DBL(b);
+  case VAL_STR: // interned
+    return AS_STR(a) == AS_STR(b);
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b);
+  case VAL_CFUNC:
+    return AS_CFUNC(a) == AS_CFUNC(b);
+  default:
+    return AS_PTR(a) == AS_PTR(b);
+  }
+}
+
+static const char* type_name(int type) {
+  switch (type) {
+  case VAL_LNG:
+    return "int";
+  case VAL_DBL:
+    return "double";
+  case VAL_STR:
+    return "string";
+  case VAL_BOOL:
+    return "bool";
+  default:
+    return "value";
   }
+}
+
+// Pushes a frame for c, whose arguments have been checked.
+static bool push_frame(struct tr_vm* vm, struct tr_closure* c, int arg_count) {
   if (vm->frame_count == FRAMES_MAX) {
     tr_vm_runtime_err(vm, "Stack Overflow.");
     return false;
   }
+  if (vm->frame_count == vm->frame_capacity)
+    vm_grow_frames(vm, vm->frame_capacity * 2);
+  int base = (int)(vm->stackTop - vm->stack) - arg_count - 1;
+  int need = base + c->func->max_stack;
+  if (need > vm->stack_capacity) {
+    int capacity = vm->stack_capacity * 2;
+    while (need > capacity)
+      capacity *= 2;
+    vm_grow_stack(vm, capacity);
+  }
   struct tr_call_frame* frame = &vm->frames[vm->frame_count++];
   frame->func                 = c;
   frame->ip                   = c->func->chunk.instructions;
-  frame->slots                = vm->stackTop - arg_count - 1;
+  frame->slots                = vm->stack + base;
+  return true;
+}
+
+static bool call(struct tr_vm* vm, struct tr_closure* c, int arg_count) {
+  if (arg_count != c->func->arity) {
+    tr_vm_runtime_err(vm, "Expected %d arguments recieved %d.", c->func->arity, arg_count);
+    return false;
+  }
+  return push_frame(vm, c, arg_count);
+}
+
+// Calls c in place of the running frame: the callee and its arguments move
+// down over the frame's slots, so chains of tail calls run in constant stack.
+static bool tail_call(struct tr_vm* vm, struct tr_closure* c, int arg_count) {
+  if (arg_count != c->func->arity) {
+    tr_vm_runtime_err(vm, "Expected %d arguments recieved %d.", c->func->arity, arg_count);
+    return false;
+  }
+  struct tr_call_frame* frame = &vm->frames[vm->frame_count - 1];
+  int base                    = (int)(frame->slots - vm->stack);
+  int need                    = base + c->func->max_stack;
+  if (need > vm->stack_capacity) {
+    int capacity = vm->stack_capacity * 2;
+    while (need > capacity)
+      capacity *= 2;
+    vm_grow_stack(vm, capacity);
+  }
+  memmove(vm->stack + base, vm->stackTop - arg_count - 1, sizeof(*vm->stack) * (arg_count + 1));
+  vm->stackTop = vm->stack + base + arg_count + 1;
+  frame->func  = c;
+  frame->ip    = c->func->chunk.instructions;
+  frame->slots = vm->stack + base;
   return true;
 }
 
 static bool call_value(struct tr_vm* vm, struct tr_value func, int args) {
   // Bound c function
-  if (func.type == VAL_CFUNC) {
-    struct tr_value ret = func.func(vm, args, vm->stackTop - args);
+  if (IS_CFUNC(func)) {
+    struct tr_value ret = AS_CFUNC(func)(vm, args, vm->stackTop - args);
     vm->stackTop -= args + 1;
     tr_vm_push(vm, ret);
     return true;
   }
-  if (func.type == VAL_OBJ) {
-    switch (func.obj->type) {
+  if (IS_OBJ(func)) {
+    switch (AS_OBJ(func)->type) {
     case OBJ_CLOSURE:
-      return call(vm, (struct tr_closure*)(func.obj), args);
+      return call(vm, (struct tr_closure*)AS_OBJ(func), args);
     /*case OBJ_FUNC:
       return call(vm, (struct tr_func*)(func.obj), args);*/
     default:
@@ -229,194 +760,766 @@ static bool call_value(struct tr_vm* vm, struct tr_value func, int args) {
   return false;
 }
 
-int tr_vm_do_chunk(struct tr_vm* vm, struct tr_func* func) {
-  tr_vm_push(vm, (struct tr_value){.type = VAL_OBJ, .obj = (struct tr_object*)func});
-  struct tr_closure* c = tr_closure_new(func);
+static bool is_call(uint8_t op) { return op == OP_CALL || (op >= OP_CALL_0 && op <= OP_CALL_2); }
+
+// Sizes f's call cache table to twice its call sites, so probes stay short.
+// May allocate, and so collect.
+static void call_cache_init(struct tr_vm* vm, struct tr_func* f) {
+  struct tr_chunk* chunk = &f->chunk;
+  int sites              = 0;
+  for (int off = 0; off < chunk->count; off += tr_instruction_size(&chunk->instructions[off]))
+    sites += is_call(chunk->instructions[off]);
+  int capacity = 2;
+  while (capacity < 2 * sites)
+    capacity *= 2;
+  struct tr_call_cache* calls = mem_alloc(sizeof(*calls) * capacity);
+  for (int i = 0; i < capacity; i++)
+    calls[i] = (struct tr_call_cache){-1, 0, NULL, NULL};
+  f->calls     = calls;
+  f->call_mask = capacity - 1;
+  vm->call_stats.sites += sites;
+}
+
+static struct tr_call_cache* call_cache(struct tr_func* f, int offset) {
+  int i = offset & f->call_mask;
+  while (f->calls[i].offset != offset && f->calls[i].offset != -1)
+    i = (i + 1) & f->call_mask;
+  f->calls[i].offset = offset;
+  return &f->calls[i];
+}
+
+// OP_CALL through the site's cache: a callee seen last time skips the type
+// and arity checks; any other is called the slow way and, if it is callable
+// with these arguments, cached unless the site has changed callee too often.
+static bool call_site(struct tr_vm* vm, struct tr_call_cache* ic, int arg_count) {
+  struct tr_value callee = vm->stackTop[-arg_count - 1];
+  if (ic->func != NULL && IS_OBJ(callee) && AS_OBJ(callee)->type == OBJ_CLOSURE &&
+      ((struct tr_closure*)AS_OBJ(callee))->func == ic->func) {
+    vm->call_stats.hits++;
+    return push_frame(vm, (struct tr_closure*)AS_OBJ(callee), arg_count);
+  }
+  if (ic->cfunc != NULL && IS_CFUNC(callee) && AS_CFUNC(callee) == ic->cfunc) {
+    vm->call_stats.hits++;
+    struct tr_value ret = ic->cfunc(vm, arg_count, vm->stackTop - arg_count);
+    vm->stackTop -= arg_count + 1;
+    tr_vm_push(vm, ret);
+    return true;
+  }
+  vm->call_stats.misses++;
+  if (ic->misses < TR_CALL_POLY) {
+    bool seen = ic->func != NULL || ic->cfunc != NULL;
+    ic->func  = NULL;
+    ic->cfunc = NULL;
+    if (seen && ++ic->misses == TR_CALL_POLY) {
+      vm->call_stats.polymorphic++;
+    } else if (IS_CFUNC(callee)) {
+      ic->cfunc = AS_CFUNC(callee);
+    } else if (IS_OBJ(callee) && AS_OBJ(callee)->type == OBJ_CLOSURE &&
+               ((struct tr_closure*)AS_OBJ(callee))->func->arity == arg_count) {
+      ic->func = ((struct tr_closure*)AS_OBJ(callee))->func;
+    }
+  }
+  return call_value(vm, callee, arg_count);
+}
+
+void tr_call_stats_print(const struct tr_call_stats* s, FILE* fp) {
+  size_t calls = s->hits + s->misses;
+  fprintf(fp, "call caches: %zu sites, %zu polymorphic\n", s->sites, s->polymorphic);
+  fprintf(fp, "  hits %zu, misses %zu (%.1f%% hit)\n", s->hits, s->misses,
+          calls > 0 ? 100.0 * s->hits / calls : 0.0);
+}
+
+struct do_chunk_args {
+  struct tr_vm* vm;
+  struct tr_func* func;
+  int ret;
+};
+
+static void do_chunk(void* arg) {
+  struct do_chunk_args* a = arg;
+  struct tr_vm* vm        = a->vm;
+  tr_vm_push(vm, OBJ_VALUE(a->func));
+  struct tr_closure* c = tr_closure_new(vm, a->func);
   call(vm, c, 0);
-  return tr_vm_do_call_frame(vm, &vm->frames[vm->frame_count - 1]);
+  a->ret = tr_vm_do_call_frame(vm, &vm->frames[vm->frame_count - 1]);
+}
+
+int tr_vm_do_chunk(struct tr_vm* vm, struct tr_func* func) {
+  // Catches out of memory even under an outer handler, to report it here.
+  struct do_chunk_args a = {vm, func, TR_VM_E_OK};
+  if (!mem_protect(&vm->mem, do_chunk, &a)) {
+    tr_vm_runtime_err(vm, "Out of memory (limit %zu bytes).", vm->mem.limit);
+    return TR_VM_E_RUNTIME;
+  }
+  return a.ret;
 }
 
 
-#define STRING_CONSTANT() (chunk->constants.values[READ_BYTE()].s)
+#ifdef TR_PROFILE_OPCODES
+// Process-wide counts of adjacent opcode pairs, to pick superinstructions from.
+static uint64_t op_pairs[256][256];
+#define PROFILE_OP(prev, op) (op_pairs[(prev)][(op)]++, (prev) = (op))
+#else
+#define PROFILE_OP(prev, op) ((void)0)
+#endif
+
+#ifdef TR_PROFILE_OPCODES
+struct op_pair {
+  uint64_t count;
+  uint8_t a, b;
+};
+
+static int op_pair_cmp(const void* x, const void* y) {
+  uint64_t cx = ((const struct op_pair*)x)->count, cy = ((const struct op_pair*)y)->count;
+  return cx < cy ? 1 : cx > cy ? -1 : 0;
+}
+#endif
+
+void tr_vm_dump_op_profile(FILE* fp, int top) {
+#ifdef TR_PROFILE_OPCODES
+  struct op_pair* pairs = mem_alloc(sizeof(struct op_pair) * 256 * 256);
+  uint64_t total        = 0;
+  for (int i = 0; i < 256 * 256; i++) {
+    pairs[i] = (struct op_pair){op_pairs[i / 256][i % 256], i / 256, i % 256};
+    total += pairs[i].count;
+  }
+  qsort(pairs, 256 * 256, sizeof(struct op_pair), op_pair_cmp);
+  fprintf(fp, "opcode pairs (%llu dispatches):\n", (unsigned long long)total);
+  for (int i = 0; i < top && pairs[i].count > 0; i++) {
+    fprintf(fp, "  %6.2f%%  %3d %3d\n", 100.0 * pairs[i].count / total, pairs[i].a, pairs[i].b);
+  }
+  mem_free(pairs, sizeof(struct op_pair) * 256 * 256);
+#else
+  fprintf(fp, "opcode profiling not compiled in (TR_PROFILE_OPCODES)\n");
+#endif
+}
+
+// Direct threading through a label table where the compiler supports
+// labels-as-values; a plain switch otherwise (or with TR_NO_COMPUTED_GOTO, or
+// TR_NO_STATE_CACHE).
+#if defined(__GNUC__) && !defined(TR_NO_COMPUTED_GOTO) && !defined(TR_NO_STATE_CACHE)
+#define TR_COMPUTED_GOTO
+#endif
+
+#ifdef TR_DEBUG_TRACE
+static void trace_op(struct tr_vm* vm, struct tr_value* sp, struct tr_chunk* chunk, uint8_t* ip) {
+  printf("STACK:\n");
+  int i = 0;
+  char buf[256];
+  for (struct tr_value* slot = vm->stack; slot < sp; slot++) {
+    tr_debug_print_val(slot, buf, sizeof(buf));
+    printf("\t[%d] value [%s] %s\n", i, tr_debug_value_type(slot), buf);
+    i++;
+  }
+  printf("\n");
+  tr_opcode_dissasemble(chunk, (int)(ip - chunk->instructions));
+}
+#define TRACE_OP() trace_op(vm, sp, chunk, ip)
+#else
+#define TRACE_OP() ((void)0)
+#endif
 
 static int tr_vm_do_call_frame(struct tr_vm* vm, struct tr_call_frame* fr) {
   struct tr_call_frame* frame = fr;
   struct tr_chunk* chunk      = &frame->func->func->chunk;
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+  uint8_t* ip                 = frame->ip;
+  struct tr_value* slots      = frame->slots;
+  struct tr_value* sp         = vm->stackTop;
+  uint8_t op;
+#ifdef TR_PROFILE_OPCODES
+  uint8_t prev_op = OP_NO;
+#endif
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define SAVE_STATE() (frame->ip = ip, vm->stackTop = sp)
+#define LOAD_STATE()                                                                               \
+  (frame = &vm->frames[vm->frame_count - 1], chunk = &frame->func->func->chunk, ip = frame->ip,    \
+   slots = frame->slots, sp = vm->stackTop)
+#define RUNTIME_ERROR(...)                                                                         \
+  do {                                                                                             \
+    SAVE_STATE();                                                                                  \
+    tr_vm_runtime_err(vm, __VA_ARGS__);                                                            \
+    return TR_VM_E_RUNTIME;                                                                        \
+  } while (0)
+
+#ifdef TR_COMPUTED_GOTO
+  static void* dispatch[256] = {
+      [0 ... 255]                  = &&L_UNKNOWN,
+      [OP_NIL]                     = &&L_OP_NIL,
+      [OP_TRUE]                    = &&L_OP_TRUE,
+      [OP_FALSE]                   = &&L_OP_FALSE,
+      [OP_RETURN]                  = &&L_OP_RETURN,
+      [OP_CONSTANT_RETURN]         = &&L_OP_CONSTANT_RETURN,
+      [OP_CLOSURE]                 = &&L_OP_CLOSURE,
+      [OP_CALL]                    = &&L_OP_CALL,
+      [OP_CALL_0]                  = &&L_OP_CALL_0,
+      [OP_CALL_1]                  = &&L_OP_CALL_1,
+      [OP_CALL_2]                  = &&L_OP_CALL_2,
+      [OP_JMP_FALSE]               = &&L_OP_JMP_FALSE,
+      [OP_JMP]                     = &&L_OP_JMP,
+      [OP_LOOP]                    = &&L_OP_LOOP,
+      [OP_POP]                     = &&L_OP_POP,
+      [OP_NEGATE]                  = &&L_OP_NEGATE,
+      [OP_DEFINE_GLOBAL]           = &&L_OP_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL]              = &&L_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL]              = &&L_OP_SET_GLOBAL,
+      [OP_GET_LOCAL]               = &&L_OP_GET_LOCAL,
+      [OP_SET_LOCAL]               = &&L_OP_SET_LOCAL,
+      [OP_SET_LOCAL_POP]           = &&L_OP_SET_LOCAL_POP,
+      [OP_GET_LOCAL_GET_LOCAL]     = &&L_OP_GET_LOCAL_GET_LOCAL,
+      [OP_GET_LOCAL_CONSTANT_IADD] = &&L_OP_GET_LOCAL_CONSTANT_IADD,
+      [OP_GET_LOCAL_CONSTANT_ISUB] = &&L_OP_GET_LOCAL_CONSTANT_ISUB,
+      [OP_NOT]                     = &&L_OP_NOT,
+      [OP_EQUAL]                   = &&L_OP_EQUAL,
+      [OP_NEQUAL]                  = &&L_OP_NEQUAL,
+      [OP_LT]                      = &&L_OP_LT,
+      [OP_LTEQ]                    = &&L_OP_LTEQ,
+      [OP_GT]                      = &&L_OP_GT,
+      [OP_GTEQ]                    = &&L_OP_GTEQ,
+      [OP_JMP_IF_GE]               = &&L_OP_JMP_IF_GE,
+      [OP_JMP_IF_GT]               = &&L_OP_JMP_IF_GT,
+      [OP_JMP_IF_LE]               = &&L_OP_JMP_IF_LE,
+      [OP_JMP_IF_LT]               = &&L_OP_JMP_IF_LT,
+      [OP_JMP_IF_GE_INT]           = &&L_OP_JMP_IF_GE_INT,
+      [OP_JMP_IF_GT_INT]           = &&L_OP_JMP_IF_GT_INT,
+      [OP_JMP_IF_LE_INT]           = &&L_OP_JMP_IF_LE_INT,
+      [OP_JMP_IF_LT_INT]           = &&L_OP_JMP_IF_LT_INT,
+      [OP_JMP_IF_GE_DBL]           = &&L_OP_JMP_IF_GE_DBL,
+      [OP_JMP_IF_GT_DBL]           = &&L_OP_JMP_IF_GT_DBL,
+      [OP_JMP_IF_LE_DBL]           = &&L_OP_JMP_IF_LE_DBL,
+      [OP_JMP_IF_LT_DBL]           = &&L_OP_JMP_IF_LT_DBL,
+      [OP_FOR_INC_LT]              = &&L_OP_FOR_INC_LT,
+      [OP_FOR_INC_LT_K]            = &&L_OP_FOR_INC_LT_K,
+      [OP_TABLESWITCH]             = &&L_OP_TABLESWITCH,
+      [OP_LOOKUPSWITCH]            = &&L_OP_LOOKUPSWITCH,
+      [OP_TAIL_CALL]               = &&L_OP_TAIL_CALL,
+      [OP_IADD]                    = &&L_OP_IADD,
+      [OP_ISUB]                    = &&L_OP_ISUB,
+      [OP_IDIV]                    = &&L_OP_IDIV,
+      [OP_IMUL]                    = &&L_OP_IMUL,
+      [OP_FADD]                    = &&L_OP_FADD,
+      [OP_FSUB]                    = &&L_OP_FSUB,
+      [OP_FDIV]                    = &&L_OP_FDIV,
+      [OP_FMUL]                    = &&L_OP_FMUL,
+      [OP_ADD]                     = &&L_OP_ADD,
+      [OP_SUB]                     = &&L_OP_SUB,
+      [OP_MUL]                     = &&L_OP_MUL,
+      [OP_DIV]                     = &&L_OP_DIV,
+      [OP_ADD_IMM]                 = &&L_OP_ADD_IMM,
+      [OP_ADD_INT]                 = &&L_OP_ADD_INT,
+      [OP_SUB_INT]                 = &&L_OP_SUB_INT,
+      [OP_MUL_INT]                 = &&L_OP_MUL_INT,
+      [OP_DIV_INT]                 = &&L_OP_DIV_INT,
+      [OP_ADD_DBL]                 = &&L_OP_ADD_DBL,
+      [OP_SUB_DBL]                 = &&L_OP_SUB_DBL,
+      [OP_MUL_DBL]                 = &&L_OP_MUL_DBL,
+      [OP_DIV_DBL]                 = &&L_OP_DIV_DBL,
+      [OP_ADD_IMM_INT]             = &&L_OP_ADD_IMM_INT,
+      [OP_CHECK_TYPE]              = &&L_OP_CHECK_TYPE,
+      [OP_CONSTANT]                = &&L_OP_CONSTANT,
+      [OP_CONSTANT_LONG]           = &&L_OP_CONSTANT_LONG,
+      [OP_CLOSURE_LONG]            = &&L_OP_CLOSURE_LONG,
+      [OP_DEFINE_GLOBAL_LONG]      = &&L_OP_DEFINE_GLOBAL_LONG,
+      [OP_GET_GLOBAL_LONG]         = &&L_OP_GET_GLOBAL_LONG,
+      [OP_SET_GLOBAL_LONG]         = &&L_OP_SET_GLOBAL_LONG,
+      [OP_GET_LOCAL_LONG]          = &&L_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL_LONG]          = &&L_OP_SET_LOCAL_LONG,
+      [OP_JMP_FALSE_LONG]          = &&L_OP_JMP_FALSE_LONG,
+      [OP_JMP_LONG]                = &&L_OP_JMP_LONG,
+      [OP_LOOP_LONG]               = &&L_OP_LOOP_LONG,
+      [OP_PUSH_INT]                = &&L_OP_PUSH_INT,
+      [OP_IADD_IMM]                = &&L_OP_IADD_IMM,
+      [OP_GET_LOCAL_IADD_IMM]      = &&L_OP_GET_LOCAL_IADD_IMM,
+  };
+#define CASE(name) L_##name:
+#define DEFAULT L_UNKNOWN:
+#define DISPATCH()                                                                                 \
+  do {                                                                                             \
+    TRACE_OP();                                                                                    \
+    op = READ_BYTE();                                                                              \
+    PROFILE_OP(prev_op, op);                                                                       \
+    goto* dispatch[op];                                                                            \
+  } while (0)
+#define NEXT() DISPATCH()
+
+  DISPATCH();
+  {
+#else
+#define CASE(name) case name:
+#define DEFAULT default:
+#define NEXT() break
+
   for (;;) {
-#ifdef TR_DEBUG_TRACE
-    printf("STACK:\n");
-    int i = 0;
-    char buf[256];
-    for (struct tr_value* slot = vm->stack; slot < vm->stackTop; slot++) {
-      tr_debug_print_val(slot, buf, sizeof(buf));
-      printf("\t[%d] value [%s] %s\n", i, tr_debug_value_type(slot), buf);
-      i++;
-    }
-    printf("\n");
-    tr_opcode_dissasemble(chunk, (int)(frame->ip - chunk->instructions));
+    SYNC_STATE();
+    TRACE_OP();
+    op = READ_BYTE();
+    PROFILE_OP(prev_op, op);
+    switch (op) {
 #endif
-    uint8_t op;
-    switch (op = READ_BYTE()) {
-    case OP_NIL:
-      tr_vm_push(vm, NIL_VAL);
-      break;
-    case OP_RETURN: {
-      struct tr_value res = tr_vm_pop(vm);
+    CASE(OP_NIL) {
+      PUSH(NIL_VAL);
+      NEXT();
+    }
+    CASE(OP_TRUE) {
+      PUSH(BOOL_VALUE(true));
+      NEXT();
+    }
+    CASE(OP_FALSE) {
+      PUSH(BOOL_VALUE(false));
+      NEXT();
+    }
+    CASE(OP_CONSTANT_RETURN) {
+      PUSH(chunk->constants.values[READ_BYTE()]);
+      goto do_return;
+    }
+    CASE(OP_RETURN) {
+    do_return:;
+      struct tr_value res = POP();
       vm->frame_count--;
       if (vm->frame_count == 0) {
-        tr_vm_pop(vm);
+        vm->stackTop = sp - 1;
         return TR_VM_E_OK;
       }
-      vm->stackTop = frame->slots;
-      tr_vm_push(vm, res);
+      sp = slots;
+      PUSH(res);
       frame = &vm->frames[vm->frame_count - 1];
       chunk = &frame->func->func->chunk;
-      break;
+      ip    = frame->ip;
+      slots = frame->slots;
+      NEXT();
     }
-    case OP_CLOSURE: {
-      uint8_t idx       = READ_BYTE();
-      struct tr_func* f = chunk->constants.values[idx].obj;
-      struct tr_closure* c = tr_closure_new(f);
-      tr_vm_push(vm, OBJ_VALUE(c));
-      break;
+    CASE(OP_CLOSURE_LONG)
+    CASE(OP_CLOSURE) {
+      uint32_t idx         = op == OP_CLOSURE ? READ_BYTE() : READ_LONG();
+      struct tr_func* f    = (struct tr_func*)AS_OBJ(chunk->constants.values[idx]);
+      SAVE_STATE(); // may collect
+      struct tr_closure* c = tr_closure_new(vm, f);
+      PUSH(OBJ_VALUE(c));
+      NEXT();
     }
-    case OP_CALL: {
-      uint8_t arg_count = READ_BYTE();
-      if (!call_value(vm, tr_vm_peek(vm, arg_count), arg_count)) {
+    CASE(OP_CALL_0)
+    CASE(OP_CALL_1)
+    CASE(OP_CALL_2)
+    CASE(OP_CALL) {
+      struct tr_func* f = frame->func->func;
+      int site          = (int)(ip - 1 - chunk->instructions);
+      uint8_t arg_count = op == OP_CALL ? READ_BYTE() : op - OP_CALL_0;
+      SAVE_STATE();
+      if (f->calls == NULL)
+        call_cache_init(vm, f);
+      if (!call_site(vm, call_cache(f, site), arg_count)) {
         return TR_VM_E_RUNTIME;
       }
-      frame = &vm->frames[vm->frame_count - 1];
-      chunk = &frame->func->func->chunk;
-      break;
+      LOAD_STATE();
+      NEXT();
     }
-    case OP_JMP_FALSE: {
+    CASE(OP_TAIL_CALL) {
+      uint8_t arg_count    = READ_BYTE();
+      struct tr_value func = PEEK(arg_count);
+      SAVE_STATE();
+      bool ok = IS_OBJ(func) && AS_OBJ(func)->type == OBJ_CLOSURE
+                    ? tail_call(vm, (struct tr_closure*)AS_OBJ(func), arg_count)
+                    : call_value(vm, func, arg_count);
+      if (!ok)
+        return TR_VM_E_RUNTIME;
+      LOAD_STATE();
+      NEXT();
+    }
+    CASE(OP_JMP_FALSE) {
       uint16_t offt = READ_SHORT();
-      if (tr_value_is_falsey(tr_vm_peek(vm, 0)))
-        frame->ip += offt;
-      break;
+      if (tr_value_is_falsey(PEEK(0)))
+        ip += offt;
+      NEXT();
     }
-    case OP_JMP: {
+    CASE(OP_JMP) {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      NEXT();
     }
-    case OP_LOOP: {
+    CASE(OP_LOOP) {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+      NEXT();
     }
-    case OP_POP:
-      tr_vm_pop(vm);
-      break;
-    case OP_NEGATE: {
-      struct tr_value* val = vm->stackTop;
-      if (val->type == VAL_LNG) {
-        val->l = -val->l;
-        break;
-      } else if (val->type == VAL_DBL) {
-        val->d = -val->d;
-        break;
-      } else if (val->type == VAL_PTR || val->type == VAL_STR) {
-        tr_vm_runtime_err(vm, "Attempted to negate non number type");
-        return TR_VM_E_RUNTIME;
+    CASE(OP_JMP_FALSE_LONG) {
+      uint32_t offset = READ_LONG();
+      if (tr_value_is_falsey(PEEK(0)))
+        ip += offset;
+      NEXT();
+    }
+    CASE(OP_JMP_LONG) {
+      uint32_t offset = READ_LONG();
+      ip += offset;
+      NEXT();
+    }
+    CASE(OP_LOOP_LONG) {
+      uint32_t offset = READ_LONG();
+      ip -= offset;
+      NEXT();
+    }
+    CASE(OP_POP) {
+      sp--;
+      NEXT();
+    }
+    CASE(OP_NEGATE) {
+      struct tr_value* val = &sp[-1];
+      if (IS_LNG(*val)) {
+        long res;
+        if (!tr_lng_neg(AS_LNG(*val), &res))
+          RUNTIME_ERROR("Integer overflow.");
+        *val = INT_VALUE(res);
+      } else if (IS_DBL(*val)) {
+        *val = DOUBLE_VALUE(-AS_DBL(*val));
+      } else {
+        RUNTIME_ERROR("Attempted to negate non number type");
       }
+      NEXT();
     }
-    case OP_DEFINE_GLOBAL: {
-      uint8_t idx        = READ_BYTE();
-      struct tr_string s = chunk->constants.values[idx].s;
-      tr_table_insert(&vm->globals, &s, tr_vm_peek(vm, 0));
-      tr_vm_pop(vm);
-      break;
+    CASE(OP_DEFINE_GLOBAL_LONG)
+    CASE(OP_DEFINE_GLOBAL) {
+      uint32_t slot           = op == OP_DEFINE_GLOBAL ? READ_SHORT() : READ_LONG();
+      vm->global_values[slot] = POP();
+      NEXT();
     }
-    case OP_GET_GLOBAL: {
-      uint8_t idx        = READ_BYTE();
-      struct tr_string s = chunk->constants.values[idx].s;
-      struct tr_value v;
-      if (!tr_table_get(&vm->globals, &s, &v)) {
-        tr_vm_runtime_err(vm, "Undefined global variable: %s", s.str);
-        return TR_VM_E_RUNTIME;
+    CASE(OP_GET_GLOBAL_LONG)
+    CASE(OP_GET_GLOBAL) {
+      uint32_t slot     = op == OP_GET_GLOBAL ? READ_SHORT() : READ_LONG();
+      struct tr_value v = vm->global_values[slot];
+      if (IS_UNDEF(v)) {
+        RUNTIME_ERROR("Undefined global variable: %s", vm->global_names[slot]->str);
       }
-      tr_vm_push(vm, v);
-      break;
+      PUSH(v);
+      NEXT();
     }
-    case OP_SET_GLOBAL: {
-      struct tr_string s = STRING_CONSTANT();
-      if (tr_table_insert(&vm->globals, &s, tr_vm_peek(vm, 0))) {
-        tr_table_delete(&vm->globals, &s);
-        tr_vm_runtime_err(vm, "Attempted to assign to undeclared global");
-        return TR_VM_E_RUNTIME;
+    CASE(OP_SET_GLOBAL_LONG)
+    CASE(OP_SET_GLOBAL) {
+      uint32_t slot = op == OP_SET_GLOBAL ? READ_SHORT() : READ_LONG();
+      if (IS_UNDEF(vm->global_values[slot])) {
+        RUNTIME_ERROR("Attempted to assign to undeclared global");
       }
-      break;
+      vm->global_values[slot] = PEEK(0);
+      NEXT();
     }
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      tr_vm_push(vm, frame->slots[slot]);
-      break;
+      PUSH(slots[slot]);
+      NEXT();
     }
-    case OP_SET_LOCAL: {
-      uint8_t slot       = READ_BYTE();
-      frame->slots[slot] = tr_vm_peek(vm, 0);
-      break;
+    CASE(OP_SET_LOCAL) {
+      uint8_t slot = READ_BYTE();
+      slots[slot]  = PEEK(0);
+      NEXT();
     }
-    case OP_NOT:
-      switch (tr_vm_peek(vm, 0).type) {
-      case VAL_BOOL:
-        vm->stackTop->b = !vm->stackTop->b;
-      case VAL_LNG: {
-        if (vm->stackTop->l == 0) {
-          vm->stackTop->l = 1;
-        } else {
-          vm->stackTop->l = 0;
-        }
-        break;
-      }
-      }
-      break;
-    case OP_EQUAL: {
-      struct tr_value b = tr_vm_pop(vm);
-      struct tr_value a = tr_vm_pop(vm);
-      tr_value_eq(a, b);
-      VALUE_OP(==);
-      break;
+    CASE(OP_GET_LOCAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      PUSH(slots[slot]);
+      NEXT();
     }
-    case OP_NEQUAL: {
-      struct tr_value b = tr_vm_pop(vm);
-      struct tr_value a = tr_vm_pop(vm);
-      VALUE_OP(!=);
-      break;
+    CASE(OP_SET_LOCAL_LONG) {
+      uint16_t slot = READ_SHORT();
+      slots[slot]   = PEEK(0);
+      NEXT();
     }
-    case OP_IADD:
-      IBINARY_OP(+);
-      break;
-    case OP_ISUB:
-      IBINARY_OP(-);
-      break;
-    case OP_IDIV:
-      IBINARY_OP(/);
-      break;
-    case OP_IMUL:
-      IBINARY_OP(*);
-      break;
-    case OP_FADD:
+    CASE(OP_SET_LOCAL_POP) {
+      uint8_t slot = READ_BYTE();
+      slots[slot]  = POP();
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL_GET_LOCAL) {
+      uint8_t a = READ_BYTE();
+      uint8_t b = READ_BYTE();
+      PUSH(slots[a]);
+      PUSH(slots[b]);
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL_CONSTANT_IADD) {
+      long a = AS_LNG(slots[READ_BYTE()]);
+      long b = AS_LNG(chunk->constants.values[READ_BYTE()]);
+      INT_OP(sp[0], tr_lng_add, a, b);
+      sp++;
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL_CONSTANT_ISUB) {
+      long a = AS_LNG(slots[READ_BYTE()]);
+      long b = AS_LNG(chunk->constants.values[READ_BYTE()]);
+      INT_OP(sp[0], tr_lng_sub, a, b);
+      sp++;
+      NEXT();
+    }
+    CASE(OP_GET_LOCAL_IADD_IMM) {
+      long a = AS_LNG(slots[READ_BYTE()]);
+      INT_OP(sp[0], tr_lng_add, a, (int16_t)READ_SHORT());
+      sp++;
+      NEXT();
+    }
+    CASE(OP_NOT) {
+      sp[-1] = BOOL_VALUE(tr_value_is_falsey(sp[-1]));
+      NEXT();
+    }
+    CASE(OP_EQUAL) {
+      struct tr_value b = POP();
+      sp[-1]            = BOOL_VALUE(values_equal(sp[-1], b));
+      NEXT();
+    }
+    CASE(OP_NEQUAL) {
+      struct tr_value b = POP();
+      sp[-1]            = BOOL_VALUE(!values_equal(sp[-1], b));
+      NEXT();
+    }
+    CASE(OP_LT) {
+      COMPARE_OP(<);
+      NEXT();
+    }
+    CASE(OP_LTEQ) {
+      COMPARE_OP(<=);
+      NEXT();
+    }
+    CASE(OP_GT) {
+      COMPARE_OP(>);
+      NEXT();
+    }
+    CASE(OP_GTEQ) {
+      COMPARE_OP(>=);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GE) {
+      BRANCH_OP(<, OP_JMP_IF_GE_INT, OP_JMP_IF_GE_DBL);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GT) {
+      BRANCH_OP(<=, OP_JMP_IF_GT_INT, OP_JMP_IF_GT_DBL);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LE) {
+      BRANCH_OP(>, OP_JMP_IF_LE_INT, OP_JMP_IF_LE_DBL);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LT) {
+      BRANCH_OP(>=, OP_JMP_IF_LT_INT, OP_JMP_IF_LT_DBL);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GE_INT) {
+      QUICK_BRANCH(IS_LNG, AS_LNG, <, OP_JMP_IF_GE);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GT_INT) {
+      QUICK_BRANCH(IS_LNG, AS_LNG, <=, OP_JMP_IF_GT);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LE_INT) {
+      QUICK_BRANCH(IS_LNG, AS_LNG, >, OP_JMP_IF_LE);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LT_INT) {
+      QUICK_BRANCH(IS_LNG, AS_LNG, >=, OP_JMP_IF_LT);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GE_DBL) {
+      QUICK_BRANCH(IS_DBL, AS_DBL, <, OP_JMP_IF_GE);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_GT_DBL) {
+      QUICK_BRANCH(IS_DBL, AS_DBL, <=, OP_JMP_IF_GT);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LE_DBL) {
+      QUICK_BRANCH(IS_DBL, AS_DBL, >, OP_JMP_IF_LE);
+      NEXT();
+    }
+    CASE(OP_JMP_IF_LT_DBL) {
+      QUICK_BRANCH(IS_DBL, AS_DBL, >=, OP_JMP_IF_LT);
+      NEXT();
+    }
+    CASE(OP_FOR_INC_LT) {
+      struct tr_value* counter = &slots[READ_BYTE()];
+      struct tr_value* limit   = &slots[READ_BYTE()];
+      FOR_INC_LT(counter, *limit);
+      NEXT();
+    }
+    CASE(OP_FOR_INC_LT_K) {
+      struct tr_value* counter = &slots[READ_BYTE()];
+      uint16_t idx             = READ_SHORT();
+      FOR_INC_LT(counter, chunk->constants.values[idx]);
+      NEXT();
+    }
+    CASE(OP_TABLESWITCH) {
+      struct tr_value v      = POP();
+      uint16_t n             = READ_SHORT();
+      long low               = read_i32(ip);
+      uint8_t* offsets       = ip + 4;
+      ip                     = offsets + 3 * (n + 1);
+      int entry              = 0; // default
+      if (IS_LNG(v) && (unsigned long)AS_LNG(v) - (unsigned long)low < n)
+        entry = 1 + (int)(AS_LNG(v) - low);
+      offsets += 3 * entry;
+      ip += offsets[0] << 16 | offsets[1] << 8 | offsets[2];
+      NEXT();
+    }
+    CASE(OP_LOOKUPSWITCH) {
+      struct tr_value v      = POP();
+      uint16_t n             = READ_SHORT();
+      uint8_t* offsets       = ip + 4 * n;
+      int entry              = IS_LNG(v) ? lookup_key(ip, n, AS_LNG(v)) + 1 : 0;
+      ip                     = offsets + 3 * (n + 1);
+      offsets += 3 * entry;
+      ip += offsets[0] << 16 | offsets[1] << 8 | offsets[2];
+      NEXT();
+    }
+    CASE(OP_IADD) {
+      IBINARY_OP(tr_lng_add);
+      NEXT();
+    }
+    CASE(OP_IADD_IMM) {
+      INT_OP(sp[-1], tr_lng_add, AS_LNG(sp[-1]), (int16_t)READ_SHORT());
+      NEXT();
+    }
+    CASE(OP_ISUB) {
+      IBINARY_OP(tr_lng_sub);
+      NEXT();
+    }
+    CASE(OP_IDIV) {
+      const char* err = int_div_error(sp[-2], sp[-1]);
+      if (err != NULL)
+        RUNTIME_ERROR("%s", err);
+      IBINARY_OP(tr_lng_div);
+      NEXT();
+    }
+    CASE(OP_IMUL) {
+      IBINARY_OP(tr_lng_mul);
+      NEXT();
+    }
+    CASE(OP_FADD) {
       FBINARY_OP(+);
-      break;
-    case OP_FSUB:
+      NEXT();
+    }
+    CASE(OP_FSUB) {
       FBINARY_OP(-);
-      break;
-    case OP_FDIV:
+      NEXT();
+    }
+    CASE(OP_FDIV) {
       FBINARY_OP(/);
-      break;
-    case OP_FMUL:
+      NEXT();
+    }
+    CASE(OP_FMUL) {
       FBINARY_OP(*);
-      break;
-    case OP_CONSTANT: {
+      NEXT();
+    }
+    CASE(OP_ADD) {
+      ARITH_OP(+, tr_lng_add, OP_ADD_INT, OP_ADD_DBL);
+      NEXT();
+    }
+    CASE(OP_SUB) {
+      ARITH_OP(-, tr_lng_sub, OP_SUB_INT, OP_SUB_DBL);
+      NEXT();
+    }
+    CASE(OP_MUL) {
+      ARITH_OP(*, tr_lng_mul, OP_MUL_INT, OP_MUL_DBL);
+      NEXT();
+    }
+    CASE(OP_DIV) {
+      const char* err = int_div_error(sp[-2], sp[-1]);
+      if (err != NULL)
+        RUNTIME_ERROR("%s", err);
+      ARITH_OP(/, tr_lng_div, OP_DIV_INT, OP_DIV_DBL);
+      NEXT();
+    }
+    CASE(OP_ADD_INT) {
+      QUICK_IOP(tr_lng_add, OP_ADD);
+      NEXT();
+    }
+    CASE(OP_SUB_INT) {
+      QUICK_IOP(tr_lng_sub, OP_SUB);
+      NEXT();
+    }
+    CASE(OP_MUL_INT) {
+      QUICK_IOP(tr_lng_mul, OP_MUL);
+      NEXT();
+    }
+    CASE(OP_DIV_INT) {
+      const char* err = int_div_error(sp[-2], sp[-1]);
+      if (err != NULL)
+        RUNTIME_ERROR("%s", err);
+      QUICK_IOP(tr_lng_div, OP_DIV);
+      NEXT();
+    }
+    CASE(OP_ADD_DBL) {
+      QUICK_OP(IS_DBL, AS_DBL, DOUBLE_VALUE, +, OP_ADD);
+      NEXT();
+    }
+    CASE(OP_SUB_DBL) {
+      QUICK_OP(IS_DBL, AS_DBL, DOUBLE_VALUE, -, OP_SUB);
+      NEXT();
+    }
+    CASE(OP_MUL_DBL) {
+      QUICK_OP(IS_DBL, AS_DBL, DOUBLE_VALUE, *, OP_MUL);
+      NEXT();
+    }
+    CASE(OP_DIV_DBL) {
+      QUICK_OP(IS_DBL, AS_DBL, DOUBLE_VALUE, /, OP_DIV);
+      NEXT();
+    }
+    CASE(OP_ADD_IMM_INT) {
+      if (IS_LNG(sp[-1])) {
+        INT_OP(sp[-1], tr_lng_add, AS_LNG(sp[-1]), (int16_t)READ_SHORT());
+      } else {
+        ip[-1] = OP_ADD_IMM;
+        ip--;
+      }
+      NEXT();
+    }
+    CASE(OP_ADD_IMM) {
+      int16_t k = (int16_t)READ_SHORT();
+      if (IS_LNG(sp[-1])) {
+        INT_OP(sp[-1], tr_lng_add, AS_LNG(sp[-1]), k);
+        QUICKEN(3, OP_ADD_IMM_INT);
+      } else if (IS_DBL(sp[-1])) {
+        sp[-1] = DOUBLE_VALUE(AS_DBL(sp[-1]) + k);
+      } else {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      NEXT();
+    }
+    CASE(OP_CHECK_TYPE) {
+      uint8_t type = READ_BYTE();
+      if (tr_value_type(sp[-1]) != type) {
+        if (type == VAL_DBL && IS_LNG(sp[-1])) {
+          sp[-1] = DOUBLE_VALUE((double)AS_LNG(sp[-1]));
+        } else {
+          RUNTIME_ERROR("Type mismatch: expected %s, got %s.", type_name(type),
+                        tr_debug_value_type(&sp[-1]));
+        }
+      }
+      NEXT();
+    }
+    CASE(OP_CONSTANT) {
       uint8_t idx = READ_BYTE();
-      tr_vm_push(vm, chunk->constants.values[idx]);
-      break;
+      PUSH(chunk->constants.values[idx]);
+      NEXT();
     }
+    CASE(OP_CONSTANT_LONG) {
+      uint32_t idx = READ_LONG();
+      PUSH(chunk->constants.values[idx]);
+      NEXT();
     }
+    CASE(OP_PUSH_INT) {
+      PUSH(INT_VALUE((int16_t)READ_SHORT()));
+      NEXT();
+    }
+    DEFAULT {
+      RUNTIME_ERROR("Unknown opcode %d", op);
+    }
+    }
+#ifndef TR_COMPUTED_GOTO
   }
+#endif
 #undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef RUNTIME_ERROR
+#undef CASE
+#undef DEFAULT
+#undef NEXT
 }
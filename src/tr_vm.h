@@ -2,7 +2,10 @@
 #define tr_vm_h
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include "memory.h"
+#include "tr_gc.h"
 #include "tr_lexer.h"
 #include "tr_obj.h"
 #include "tr_table.h"
@@ -12,8 +15,16 @@
 #define TR_DEBUG_TRACE
 #endif
 
-#define FRAMES_MAX 256
-#define STACK_MAX (FRAMES_MAX * (UINT8_MAX + 1))
+// Call depth limit. The stack and frame arrays start small and grow towards
+// it as calls need them.
+#define FRAMES_MAX (1 << 16)
+// Initial stack size; calls grow it to what their function's max_stack needs.
+#define STACK_INIT (UINT8_MAX + 1)
+#define FRAMES_INIT 8
+// Global slots are addressed by a 24-bit operand (16-bit in the short forms).
+#define GLOBALS_MAX (1 << 24)
+// Likewise constant pool indices.
+#define CONSTANTS_MAX (1 << 24)
 
 struct tr_constants {
   int count;
@@ -21,11 +32,23 @@ struct tr_constants {
   struct tr_value* values;
 };
 
+// Open-addressed map from constant value to pool index, used to deduplicate
+// constants while a chunk is compiled. Hits are checked against the pool, so
+// entries left behind when the pool shrinks are just skipped. Its memory
+// comes from the compiler's arena.
+struct tr_constants_index {
+  int* slots; // pool index + 1; 0 is empty
+  int capacity;
+  int count;
+  struct mem_arena* arena;
+};
+
 struct tr_chunk {
   struct tr_constants constants;
   int count;
-  int capacity;
-  uint8_t* instructions;
+  int capacity; // 0 when instructions and lines belong to someone else (a .trc image)
+  uint8_t* instructions; // in lines' block, after its capacity entries
+  int* lines;            // source line of each instruction byte
 };
 
 typedef enum { TYPE_SCRIPT, TYPE_FUNC } tr_func_type;
@@ -35,9 +58,15 @@ struct tr_func {
   int arity;
   int upvalue_count;
   int type;
+  int max_locals; // most local slots in use at once
+  int max_stack;  // most stack slots in use at once, locals included
   struct tr_chunk chunk;
   struct tr_string* name;
   struct tr_func* enclosing;
+  // Inline caches for the call sites, by instruction offset; built on the
+  // first call the function makes.
+  struct tr_call_cache* calls;
+  int call_mask; // open-addressed, capacity call_mask + 1
 };
 
 struct tr_closure {
@@ -45,48 +74,117 @@ struct tr_closure {
   struct tr_func* func;
 };
 
+struct tr_image;
+
 struct tr_call_frame {
   struct tr_closure* func;
   uint8_t* ip;
   struct tr_value* slots;
 };
 
+typedef struct tr_value (*tr_cfunc)(struct tr_vm* vm, int args, struct tr_value* vals);
+
+// A site that changes callee this many times stops caching.
+#define TR_CALL_POLY 4
+
+// Monomorphic inline cache for one OP_CALL: the function (of any closure
+// over it) or C function it last called, already checked to take the site's
+// argument count.
+struct tr_call_cache {
+  int offset; // of the call instruction; -1 for a free entry
+  int misses;
+  struct tr_func* func;
+  tr_cfunc cfunc;
+};
+
+struct tr_call_stats {
+  size_t hits;
+  size_t misses;
+  size_t sites;
+  size_t polymorphic; // sites that gave up caching
+};
+
 typedef enum { TR_VM_E_OK, TR_VM_E_RUNTIME, TR_VM_E_COMPILE } tr_vm_result;
 
 struct tr_vm {
+  // Globals live in slots the compiler resolves names to; the table maps each
+  // name to its slot index. Slots never go away, so compiled code stays valid
+  // across tr_vm_reset.
   struct tr_table globals;
-  struct tr_value stack[STACK_MAX];
+  struct tr_value* global_values; // UNDEF_VAL until defined
+  struct tr_string** global_names; // in global_values' block, after its slots
+  int global_count;
+  int global_capacity;
+  struct tr_table strings; // intern table; the keys are the only copies
+  struct tr_value* stack;
   struct tr_value* stackTop;
-  struct tr_call_frame frames[FRAMES_MAX];
+  int stack_capacity;
+  struct tr_call_frame* frames;
   int frame_count;
+  int frame_capacity;
+  struct tr_gc gc;
+  struct mem_ctx mem; // everything the VM and its compiler allocate
+  struct tr_image* images; // loaded .trc files, see tr_cache.c
+  struct tr_call_stats call_stats;
 };
 
-typedef struct tr_value (*tr_cfunc)(struct tr_vm* vm, int args, struct tr_value* vals);
-
 void tr_chunk_init(struct tr_chunk* chunk);
 void tr_chunk_free(struct tr_chunk* chunk);
-void tr_chunk_add(struct tr_chunk* chunk, uint8_t instruction);
+void tr_chunk_add(struct tr_chunk* chunk, uint8_t instruction, int line);
+// Grows chunk to hold capacity bytes of code.
+void tr_chunk_reserve(struct tr_chunk* chunk, int capacity);
 
 void tr_constants_init(struct tr_constants* constants);
 void tr_constants_free(struct tr_constants* constants);
 int tr_constants_add(struct tr_constants* constants, struct tr_value val);
+// Numbers, bools and (interned) strings are deduplicated through index;
+// functions always get their own slot. Returns the pool index of val and sets
+// *fresh if it had to be added.
+int tr_constants_add_unique(struct tr_constants* constants, struct tr_constants_index* index,
+                            struct tr_value val, bool* fresh);
+void tr_constants_index_init(struct tr_constants_index* index, struct mem_arena* arena);
 struct tr_value* tr_constants_get(struct tr_constants* constants, int index);
 
-struct tr_func* tr_func_new();
+struct tr_func* tr_func_new(struct tr_vm* vm);
 void tr_func_destroy(struct tr_object* obj);
 
-struct tr_closure* tr_closure_new(struct tr_func* func);
+struct tr_closure* tr_closure_new(struct tr_vm* vm, struct tr_func* func);
 void tr_closure_free(struct tr_closure* c);
 
-struct tr_vm* tr_vm_new();
-void tr_vm_init(struct tr_vm* vm);
+// All allocations made on behalf of the VM (including compiling into it) go
+// through alloc, or through slabs of the VM's own when it is NULL; those go
+// back to the system with tr_vm_free. Returns NULL when out of memory.
+struct tr_vm* tr_vm_new(const struct mem_allocator* alloc);
 void tr_vm_free(struct tr_vm* vm);
-
-void tr_vm_add_cfunc(struct tr_vm* vm, const char* s, tr_cfunc func);
+// Drops globals and any leftover stack so the VM can run another chunk.
+void tr_vm_reset(struct tr_vm* vm);
+
+// Caps the bytes the VM may hold (0 = no cap). Going over it collects first;
+// if that is not enough the running chunk fails with a runtime error.
+void tr_vm_set_memory_limit(struct tr_vm* vm, size_t bytes);
+size_t tr_vm_memory_live(struct tr_vm* vm);
+size_t tr_vm_memory_peak(struct tr_vm* vm);
+
+// These allocate. Called from the host they fail by returning false, NULL or
+// -1 when out of memory; called while compiling or running a chunk the
+// failure goes to that compile or run instead.
+
+// Returns false if it ran out of memory.
+bool tr_vm_add_cfunc(struct tr_vm* vm, const char* s, tr_cfunc func);
+// Returns the VM's single copy of the string, creating it on first use.
+struct tr_string* tr_vm_intern(struct tr_vm* vm, const char* chars, int len);
+// Returns the slot of the global called name, adding an undefined one if it
+// has none yet, or -1 when all GLOBALS_MAX slots are taken.
+int tr_vm_global_slot(struct tr_vm* vm, struct tr_string* name);
 
 void tr_vm_push(struct tr_vm* vm, struct tr_value val);
 struct tr_value tr_vm_pop(struct tr_vm* vm);
 
 int tr_vm_do_chunk(struct tr_vm* vm, struct tr_func* func);
 
+void tr_call_stats_print(const struct tr_call_stats* stats, FILE* fp);
+
+// Prints the most frequent opcode pairs seen so far (needs TR_PROFILE_OPCODES).
+void tr_vm_dump_op_profile(FILE* fp, int top);
+
 #endif // tr_vm_h
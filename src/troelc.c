@@ -1,32 +1,158 @@
+#include "memory.h"
 #include "tr_debug.h"
 #include "tr_opcode.h"
 
+#include "tr_cache.h"
 #include "tr_lexer.h"
 #include "tr_parser.h"
 #include "tr_stdlib.h"
 #include "tr_vm.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-int main(int argc, char** argv) {
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [-O0] [--no-inline | --inline-max BYTES] [-c [-o out.trc]] [--no-cache] "
+          "[--opt-stats] [--op-profile] [--gc-stats] [--call-stats] [--mem-limit BYTES] "
+          "[file.tr | file.trc]\n",
+          prog);
+}
+
+static bool has_suffix(const char* s, const char* suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// Compiles file into vm and, if cache is set, saves the bytecode there under
+// flags. A cache that cannot be written only fails the compile when required
+// is set.
+static struct tr_func* compile(struct tr_vm* vm, const char* file, bool optimize, int inline_max,
+                               bool opt_stats, const char* cache, uint32_t flags, bool required) {
   struct tr_lexer lex;
   struct tr_parser p;
-  // tr_lexer_str_init(&lex, "fn Hello() { var b = \"Hello World\"; print(b); } Hello();");
-  if (tr_lexer_file_init(&lex, "example.tr") < 0) {
+  if (tr_lexer_file_init(&lex, file) < 0) {
     fprintf(stderr, "Failed to open file.\n");
-    return -1;
+    return NULL;
   }
-  tr_parser_init(&p, &lex);
+  tr_parser_init(&p, &lex, vm);
+  p.optimize   = optimize;
+  p.inline_max = inline_max;
   if (!tr_parser_compile(&p)) {
     printf("Parsing failed!\n");
+    tr_parser_free(&p);
+    tr_lexer_free(&lex);
+    return NULL;
+  }
+  if (opt_stats) {
+    tr_opt_stats_print(&p.opt_stats, stderr);
+  }
+  tr_parser_free(&p);
+  struct tr_func* script = p.function;
+  if (cache != NULL && !tr_cache_write(vm, script, cache, file, lex.buf, lex.buf_len, flags) &&
+      required) {
+    fprintf(stderr, "%s: cannot write bytecode.\n", cache);
+    script = NULL;
+  }
+  tr_lexer_free(&lex);
+  return script;
+}
+
+int main(int argc, char** argv) {
+  const char* file  = "example.tr";
+  const char* out   = NULL;
+  bool optimize     = true;
+  bool compile_only = false;
+  bool use_cache    = true;
+  bool opt_stats    = false;
+  bool op_profile   = false;
+  bool gc_stats     = false;
+  bool call_stats   = false;
+  int inline_max    = TR_INLINE_MAX;
+  size_t mem_limit  = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-O0") == 0) {
+      optimize = false;
+    } else if (strcmp(argv[i], "--no-inline") == 0) {
+      inline_max = 0;
+    } else if (strcmp(argv[i], "--inline-max") == 0 && i + 1 < argc) {
+      inline_max = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      compile_only = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      use_cache = false;
+    } else if (strcmp(argv[i], "--opt-stats") == 0) {
+      opt_stats = true;
+    } else if (strcmp(argv[i], "--op-profile") == 0) {
+      op_profile = true;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      gc_stats = true;
+    } else if (strcmp(argv[i], "--call-stats") == 0) {
+      call_stats = true;
+    } else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+      mem_limit = strtoull(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return -1;
+    } else {
+      file = argv[i];
+    }
+  }
+  struct tr_vm* vm = tr_vm_new(NULL);
+  if (vm == NULL) {
+    fprintf(stderr, "Out of memory.\n");
     return -1;
   }
-  struct tr_vm* vm = tr_vm_new();
-  tr_stdlib_open(vm);
-  int ret = tr_vm_do_chunk(vm, p.function);
+  tr_vm_set_memory_limit(vm, mem_limit);
+  // Inlining is one of the optimizations -O0 turns off.
+  if (!optimize || inline_max < 0)
+    inline_max = 0;
+  uint32_t flags = optimize ? TR_CACHE_OPTIMIZED : 0;
+  flags |= (uint32_t)inline_max << TR_CACHE_INLINE_SHIFT;
+
+  // Sources get a bytecode cache next to them (x.tr -> x.trc), reused for as
+  // long as the source is unchanged. -c only writes it.
+  char cache[4096];
+  bool cached = (use_cache || compile_only) && tr_cache_path(file, cache, sizeof(cache));
+  if (out != NULL) {
+    cached = snprintf(cache, sizeof(cache), "%s", out) < (int)sizeof(cache);
+  }
+  struct tr_func* script = NULL;
+  if (has_suffix(file, ".trc")) {
+    script = tr_cache_load(vm, file, NULL, 0);
+    if (script == NULL)
+      fprintf(stderr, "%s: not a usable bytecode file.\n", file);
+  } else {
+    if (cached && !compile_only && !opt_stats)
+      script = tr_cache_load(vm, cache, file, flags);
+    if (script == NULL)
+      script = compile(vm, file, optimize, inline_max, opt_stats, cached ? cache : NULL, flags,
+                       compile_only);
+  }
+  if (script == NULL || compile_only) {
+    tr_vm_free(vm);
+    return script == NULL ? -1 : 0;
+  }
+
+  int ret = tr_stdlib_open(vm) ? tr_vm_do_chunk(vm, script) : TR_VM_E_RUNTIME;
   if (ret != TR_VM_E_OK) {
     printf("An error occurred\n");
   }
-  // tr_vm_free(&vm);
+  if (op_profile) {
+    tr_vm_dump_op_profile(stderr, 20);
+  }
+  if (gc_stats) {
+    tr_gc_stats_print(&vm->gc.stats, stderr);
+    fprintf(stderr, "memory: %zu bytes live, %zu peak\n", tr_vm_memory_live(vm),
+            tr_vm_memory_peak(vm));
+  }
+  if (call_stats) {
+    tr_call_stats_print(&vm->call_stats, stderr);
+  }
+  tr_vm_free(vm);
   return 0;
 }